@@ -0,0 +1,204 @@
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netinet/in.h>
+#include <netinet/udp.h> // UDP_SEGMENT and UDP_GRO
+#include "BatchIO.h"
+
+#ifndef SOL_UDP
+#define SOL_UDP (17)
+#endif
+
+#define SEND_WAIT_MS (100) // How long a full socket send buffer may hold up a flush before the rest of the batch is dropped
+
+void batch_send_init(struct send_batch* b, int socket, int batched)
+{
+	memset(b, 0, sizeof(*b));
+	b->socket = socket;
+	b->impaired = unreliable_active();
+	if (b->impaired) { unreliable_open(&b->channel); batched = 0; } // The channel decides per packet
+	b->useMmsg = batched;
+	int seg = 0; // Probe GSO support, the option only exists on kernels that can segment UDP (4.18+)
+	b->gso = batched && setsockopt(socket, SOL_UDP, UDP_SEGMENT, &seg, sizeof(seg)) == 0;
+}
+
+void batch_send(struct send_batch* b, const void* packet, size_t len, const struct sockaddr* dest, socklen_t destLen)
+{ // Queue a packet. The caller keeps the buffer untouched until the next flush
+	if (b->count == BATCH_SIZE) { batch_flush(b); }
+	b->iov[b->count].iov_base = (void*)packet;
+	b->iov[b->count].iov_len = len;
+	memcpy(&b->addr[b->count], dest, destLen);
+	b->addrLen[b->count] = destLen;
+	b->count+=1;
+}
+
+void batch_send_copy(struct send_batch* b, const void* packet, size_t len, const struct sockaddr* dest, socklen_t destLen)
+{ // Queue a copy of a small packet, for packets built on the stack
+	assert(len <= BATCH_COPY_MAX);
+	if (b->count == BATCH_SIZE) { batch_flush(b); }
+	memcpy(b->copies[b->count], packet, len);
+	batch_send(b, b->copies[b->count], len, dest, destLen);
+}
+
+static void send_single(struct send_batch* b, unsigned int from)
+{ // One sendto() per packet, for kernels without sendmmsg() or when batching is turned off
+	for (unsigned int i = from; i < b->count; i++) {
+		if (b->impaired) { send_packet(&b->channel, b->socket, b->iov[i].iov_base, b->iov[i].iov_len, (struct sockaddr*)&b->addr[i], b->addrLen[i]); }
+		else { sendto(b->socket, b->iov[i].iov_base, b->iov[i].iov_len, 0, (struct sockaddr*)&b->addr[i], b->addrLen[i]); }
+		b->syscalls+=1;
+	}
+}
+
+static int same_dest(struct send_batch* b, unsigned int i, unsigned int j)
+{
+	return b->addrLen[i] == b->addrLen[j] && !memcmp(&b->addr[i], &b->addr[j], b->addrLen[i]);
+}
+
+void batch_flush(struct send_batch* b)
+{ // Send everything queued, coalescing runs of equal sized packets to one destination into GSO messages
+	if (!b->count) { return; }
+	if (!b->useMmsg) { send_single(b, 0); b->count = 0; return; }
+
+	struct mmsghdr msgs[BATCH_SIZE];
+	unsigned int first[BATCH_SIZE]; // First packet of each message
+	char control[BATCH_SIZE][CMSG_SPACE(sizeof(uint16_t))];
+	unsigned int m = 0;
+	memset(msgs, 0, sizeof(msgs));
+	memset(control, 0, sizeof(control));
+
+	for (unsigned int i = 0; i < b->count; m++) {
+		size_t seg = b->iov[i].iov_len;
+		size_t total = seg;
+		unsigned int n = 1;
+		// GSO cuts the message every seg bytes, so every packet but the last has to be exactly seg bytes long
+		while (b->gso && i+n < b->count && n < GSO_MAX_SEGMENTS && b->iov[i+n-1].iov_len == seg &&
+		       b->iov[i+n].iov_len <= seg && total+b->iov[i+n].iov_len <= GSO_MAX_BYTES && same_dest(b, i, i+n)) {
+			total += b->iov[i+n].iov_len;
+			n+=1;
+		}
+		first[m] = i;
+		msgs[m].msg_hdr.msg_name = &b->addr[i];
+		msgs[m].msg_hdr.msg_namelen = b->addrLen[i];
+		msgs[m].msg_hdr.msg_iov = &b->iov[i];
+		msgs[m].msg_hdr.msg_iovlen = n;
+		if (n > 1) { // Tell the kernel where to cut
+			msgs[m].msg_hdr.msg_control = control[m];
+			msgs[m].msg_hdr.msg_controllen = sizeof(control[m]);
+			struct cmsghdr* cm = CMSG_FIRSTHDR(&msgs[m].msg_hdr);
+			cm->cmsg_level = SOL_UDP;
+			cm->cmsg_type = UDP_SEGMENT;
+			cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t segSize = seg;
+			memcpy(CMSG_DATA(cm), &segSize, sizeof(segSize));
+		}
+		i += n;
+	}
+
+	unsigned int sent = 0;
+	while (sent < m) {
+		int r = sendmmsg(b->socket, msgs+sent, m-sent, 0);
+		b->syscalls+=1;
+		if (r > 0) { sent += r; continue; }
+		if (errno == EINTR) { continue; }
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) { // Socket buffer full, wait for room rather than dropping the batch
+			struct pollfd pfd = { .fd = b->socket, .events = POLLOUT };
+			if (poll(&pfd, 1, SEND_WAIT_MS) > 0) { continue; }
+			break; // Still full, the rest is lost like on any congested queue and the timers will resend it
+		}
+		if (errno == ENOSYS) { b->useMmsg = 0; } // No sendmmsg at all
+		else if (b->gso && msgs[sent].msg_hdr.msg_iovlen > 1) { b->gso = 0; } // GSO refused (e.g. device without checksum offload)
+		else { sent+=1; continue; } // This one datagram is unsendable (EMSGSIZE...), skip it
+		send_single(b, first[sent]); // Send the rest the slow way
+		break;
+	}
+	b->count = 0;
+}
+
+void batch_recv_init(struct recv_batch* b, int socket, size_t maxPacket, int batched)
+{
+	memset(b, 0, sizeof(*b));
+	b->socket = socket;
+	b->useMmsg = batched;
+	int on = 1; // Ask for coalesced packets. Each buffer then has to hold a whole 64KB GRO super-packet
+	b->gro = batched && setsockopt(socket, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+	b->bufSize = b->gro ? 65536 : maxPacket;
+	b->capacity = b->gro ? BATCH_SIZE/4 : BATCH_SIZE;
+	if (!batched) { b->capacity = 1; }
+	b->buffers = malloc(b->capacity*b->bufSize);
+	assert(b->buffers);
+}
+
+void batch_recv_free(struct recv_batch* b)
+{
+	free(b->buffers);
+	b->buffers = NULL;
+}
+
+int batch_recv(struct recv_batch* b, int wait)
+{ // Fill the buffers with whatever is queued. With wait set, blocks until at least one packet arrived
+	b->count = 0;
+	b->index = 0;
+	b->offset = 0;
+	if (b->useMmsg) {
+		for (unsigned int i = 0; i < b->capacity; i++) {
+			b->iov[i].iov_base = b->buffers + i*b->bufSize;
+			b->iov[i].iov_len = b->bufSize;
+			memset(&b->msgs[i].msg_hdr, 0, sizeof(struct msghdr));
+			b->msgs[i].msg_hdr.msg_name = &b->addr[i];
+			b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addr[i]);
+			b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+			b->msgs[i].msg_hdr.msg_iovlen = 1;
+			b->msgs[i].msg_hdr.msg_control = b->control[i];
+			b->msgs[i].msg_hdr.msg_controllen = sizeof(b->control[i]);
+		}
+		int r = recvmmsg(b->socket, b->msgs, b->capacity, wait ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+		b->syscalls+=1;
+		if (r >= 0 || errno != ENOSYS) { b->count = (r > 0) ? r : 0; return r; }
+		b->useMmsg = 0; // No recvmmsg, and without it we cannot learn GRO segment sizes either
+		if (b->gro) { int off = 0; setsockopt(b->socket, SOL_UDP, UDP_GRO, &off, sizeof(off)); b->gro = 0; }
+	}
+
+	socklen_t addrLen = sizeof(b->addr[0]);
+	ssize_t r = recvfrom(b->socket, b->buffers, b->bufSize, wait ? 0 : MSG_DONTWAIT, (struct sockaddr*)&b->addr[0], &addrLen);
+	b->syscalls+=1;
+	if (r < 0) { return -1; }
+	b->msgs[0].msg_len = r;
+	b->msgs[0].msg_hdr.msg_namelen = addrLen;
+	b->msgs[0].msg_hdr.msg_controllen = 0;
+	b->count = 1;
+	return 1;
+}
+
+static size_t gro_size(struct msghdr* hdr, size_t len)
+{ // Size of each packet coalesced in a buffer, or the whole buffer if the kernel did not coalesce anything
+	for (struct cmsghdr* cm = CMSG_FIRSTHDR(hdr); cm; cm = CMSG_NXTHDR(hdr, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			int seg = 0;
+			memcpy(&seg, CMSG_DATA(cm), sizeof(seg));
+			return (seg > 0) ? (size_t)seg : len;
+		}
+	}
+	return len;
+}
+
+int batch_next(struct recv_batch* b, uint8_t** packet, size_t* len, struct sockaddr** from, socklen_t* fromLen)
+{ // Hand out the next packet of the batch, splitting GRO buffers back into the packets the Sender sent
+	while (b->index < b->count) {
+		struct mmsghdr* msg = &b->msgs[b->index];
+		size_t total = msg->msg_len;
+		if (b->offset < total) {
+			size_t seg = gro_size(&msg->msg_hdr, total);
+			*packet = b->buffers + b->index*b->bufSize + b->offset;
+			*len = (total-b->offset < seg) ? total-b->offset : seg;
+			if (from) { *from = (struct sockaddr*)&b->addr[b->index]; }
+			if (fromLen) { *fromLen = msg->msg_hdr.msg_namelen; }
+			b->offset += *len;
+			return 1;
+		}
+		b->index+=1;
+		b->offset = 0;
+	}
+	return 0;
+}
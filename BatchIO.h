@@ -0,0 +1,61 @@
+#ifndef BATCHIO_H
+#define BATCHIO_H
+// Batched datagram I/O shared by the Sender and Receiver.
+// Outgoing packets are queued and sent with one sendmmsg() per batch, and runs of equal sized packets to the same
+// destination are handed to the kernel as one UDP_SEGMENT (GSO) message. Incoming packets are read with recvmmsg(),
+// with UDP_GRO so the kernel can hand us several coalesced packets per buffer.
+// Every feature is probed at runtime, and falls back to one sendto()/recvfrom() per packet where it is missing.
+// When the process set up an unreliable channel (-u), every socket sends one packet at a time through its own channel.
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "UnreliableChannel.h"
+
+#define BATCH_SIZE (64) // Most packets queued or received per system call
+#define BATCH_COPY_MAX (256) // Largest packet batch_send_copy() can hold on to (ACKs and other small control packets)
+#define GSO_MAX_SEGMENTS (64) // Kernel limit on segments per GSO message
+#define GSO_MAX_BYTES (65000) // GSO messages have to fit in one IP datagram
+
+struct send_batch {
+	int socket;
+	int useMmsg; // sendmmsg() works on this kernel
+	int gso; // UDP_SEGMENT works on this socket
+	unsigned int count; // Packets queued
+	struct iovec iov[BATCH_SIZE]; // The queued packets, they must stay untouched until the batch is flushed
+	struct sockaddr_storage addr[BATCH_SIZE]; // Destination of each packet
+	socklen_t addrLen[BATCH_SIZE];
+	uint8_t copies[BATCH_SIZE][BATCH_COPY_MAX]; // Storage for packets queued with batch_send_copy()
+	unsigned long syscalls; // Send system calls made, for the benchmark
+	int impaired; // Sends go through channel
+	struct channel channel;
+};
+
+struct recv_batch {
+	int socket;
+	int useMmsg; // recvmmsg() works on this kernel
+	int gro; // UDP_GRO is enabled, so one buffer may hold several packets
+	unsigned int capacity; // Buffers available
+	size_t bufSize; // Bytes per buffer
+	uint8_t* buffers; // capacity * bufSize bytes
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct iovec iov[BATCH_SIZE];
+	struct sockaddr_storage addr[BATCH_SIZE];
+	char control[BATCH_SIZE][64]; // Ancillary data, carries the GRO segment size
+	unsigned int count; // Buffers filled by the last batch_recv()
+	unsigned int index; // Buffer batch_next() is walking
+	size_t offset; // Offset of the next packet in that buffer
+	unsigned long syscalls; // Receive system calls made, for the benchmark
+};
+
+void batch_send_init(struct send_batch* b, int socket, int batched); // batched=0 forces one sendto() per packet
+void batch_send(struct send_batch* b, const void* packet, size_t len, const struct sockaddr* dest, socklen_t destLen);
+void batch_send_copy(struct send_batch* b, const void* packet, size_t len, const struct sockaddr* dest, socklen_t destLen);
+void batch_flush(struct send_batch* b);
+
+void batch_recv_init(struct recv_batch* b, int socket, size_t maxPacket, int batched); // batched=0 forces one recvfrom() per call
+void batch_recv_free(struct recv_batch* b);
+int batch_recv(struct recv_batch* b, int wait); // Read what is queued on the socket (blocking for the first packet if wait). Returns packets' buffers read
+int batch_next(struct recv_batch* b, uint8_t** packet, size_t* len, struct sockaddr** from, socklen_t* fromLen); // Walk the packets of the last batch_recv()
+
+#endif
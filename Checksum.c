@@ -0,0 +1,204 @@
+#include <string.h> // memcpy for unaligned loads
+#include <pthread.h> // pthread_once so the tables are built exactly once, whichever thread gets here first
+#include "Checksum.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // PCLMULQDQ and SSE4.1 intrinsics, only used when the CPU reports them
+#define HAVE_PCLMUL_PATH 1
+#endif
+
+#define CRC_POLY (0xEDB88320) // Reflected IEEE polynomial, the one the original bit-at-a-time crc32() used
+#define PCLMUL_MIN (64) // The folding loop needs at least one 64 byte block
+
+static uint32_t table[8][256]; // Slicing-by-8 tables, table[0] is the classic byte-at-a-time table
+static pthread_once_t tablesOnce = PTHREAD_ONCE_INIT;
+static enum crc32_impl active = CRC32_SLICE8;
+
+static void init_tables(void)
+{ // Build the slicing tables and pick the fastest engine this CPU supports
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (int j = 0; j < 8; j++) { crc = (crc >> 1) ^ (CRC_POLY & -(crc & 1)); }
+		table[0][i] = crc;
+	}
+	for (uint32_t i = 0; i < 256; i++) { // table[k][i] is the CRC of byte i followed by k zero bytes
+		for (int k = 1; k < 8; k++) { table[k][i] = (table[k-1][i] >> 8) ^ table[0][table[k-1][i] & 0xFF]; }
+	}
+#ifdef HAVE_PCLMUL_PATH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) { active = CRC32_PCLMUL; }
+#endif
+}
+
+static uint32_t crc_bitwise(uint32_t crc, const uint8_t* p, size_t len)
+{ // stackoverflow.com/questions/21001659/crc32-algorithm-implementation-in-c-without-a-look-up-table-and-with-a-public-li
+	// Kept as the reference engine for the benchmark
+	for (size_t i = 0; i < len; i++) {
+		crc ^= p[i];
+		for (int j = 7; j >= 0; j--) { crc = (crc >> 1) ^ (CRC_POLY & -(crc & 1)); } // Do eight times
+	}
+	return crc;
+}
+
+static uint32_t crc_slice8(uint32_t crc, const uint8_t* p, size_t len)
+{ // Eight table lookups per 8 bytes instead of 64 shift/xor steps
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	while (len >= 8) {
+		uint32_t one, two;
+		memcpy(&one, p, sizeof(uint32_t)); // memcpy compiles to a plain load and is fine with unaligned data
+		memcpy(&two, p+4, sizeof(uint32_t));
+		one ^= crc;
+		crc = table[7][one & 0xFF] ^ table[6][(one >> 8) & 0xFF] ^ table[5][(one >> 16) & 0xFF] ^ table[4][one >> 24] ^
+		      table[3][two & 0xFF] ^ table[2][(two >> 8) & 0xFF] ^ table[1][(two >> 16) & 0xFF] ^ table[0][two >> 24];
+		p += 8;
+		len -= 8;
+	}
+#endif
+	while (len--) { crc = table[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8); } // Leftover bytes (or every byte on big endian hosts)
+	return crc;
+}
+
+#ifdef HAVE_PCLMUL_PATH
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc_pclmul(uint32_t crc, const uint8_t* buf, size_t len)
+{ // Carry-less multiplication folding from Intel's "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ".
+	// Folds 64 bytes per iteration with four independent accumulators, then Barrett-reduces to 32 bits.
+	// len must be at least 64 and a multiple of 16, crc32_update hands the tail to the table engine.
+	// Note the SSE4.2 crc32 instruction is not usable here: it only computes CRC32C, which would change every checksum on the wire.
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) = { 0x0154442bd4, 0x01c6e41596 };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) = { 0x01751997d0, 0x00ccaa009e };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) = { 0x0163cd6124, 0x0000000000 };
+	static const uint64_t poly[2] __attribute__((aligned(16))) = { 0x01db710641, 0x01f7011641 };
+
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8, y5, y6, y7, y8;
+
+	x1 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+	x2 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+	x3 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+	x4 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc)); // Fold the running CRC into the first block
+	x0 = _mm_load_si128((const __m128i*)k1k2);
+	buf += 64;
+	len -= 64;
+
+	while (len >= 64) { // Fold four 16 byte lanes 64 bytes forward
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		y5 = _mm_loadu_si128((const __m128i*)(buf + 0x00));
+		y6 = _mm_loadu_si128((const __m128i*)(buf + 0x10));
+		y7 = _mm_loadu_si128((const __m128i*)(buf + 0x20));
+		y8 = _mm_loadu_si128((const __m128i*)(buf + 0x30));
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), y5);
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), y6);
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), y7);
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), y8);
+		buf += 64;
+		len -= 64;
+	}
+
+	x0 = _mm_load_si128((const __m128i*)k3k4); // Fold the four lanes into one
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (len >= 16) { // Remaining whole 16 byte blocks
+		x2 = _mm_loadu_si128((const __m128i*)buf);
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+		buf += 16;
+		len -= 16;
+	}
+
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10); // 128 bits down to 64
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	x0 = _mm_load_si128((const __m128i*)poly); // Barrett reduction to 32 bits
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+uint32_t crc32_update_with(enum crc32_impl impl, uint32_t crc, const void* data, size_t len)
+{
+	const uint8_t* p = data;
+	pthread_once(&tablesOnce, init_tables);
+	switch (impl) {
+		case CRC32_BITWISE: return crc_bitwise(crc, p, len);
+#ifdef HAVE_PCLMUL_PATH
+		case CRC32_PCLMUL:
+			if (len >= PCLMUL_MIN) {
+				size_t chunk = len & ~(size_t)15;
+				crc = crc_pclmul(crc, p, chunk);
+				p += chunk;
+				len -= chunk;
+			}
+			return crc_slice8(crc, p, len);
+#endif
+		default: return crc_slice8(crc, p, len);
+	}
+}
+
+uint32_t crc32_begin(void) { return 0xFFFFFFFF; }
+
+uint32_t crc32_end(uint32_t crc) { return ~crc; }
+
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len)
+{
+	pthread_once(&tablesOnce, init_tables);
+	return crc32_update_with(active, crc, data, len);
+}
+
+uint32_t crc32(const void* data, size_t len) { return crc32_end(crc32_update(crc32_begin(), data, len)); }
+
+int crc32_supported(enum crc32_impl impl)
+{
+	pthread_once(&tablesOnce, init_tables);
+	return impl != CRC32_PCLMUL || active == CRC32_PCLMUL;
+}
+
+const char* crc32_impl_name(enum crc32_impl impl)
+{
+	switch (impl) {
+		case CRC32_BITWISE: return "bitwise";
+		case CRC32_SLICE8: return "slice8";
+		default: return "pclmul";
+	}
+}
+
+uint32_t rolling_sum(const void* data, size_t len)
+{ // The 32 bit sums wrap, which keeps their low 16 bits exact
+	const uint8_t* p = data;
+	uint32_t a = 0, b = 0;
+	for (size_t i = 0; i < len; i++) { a += p[i]; b += a; }
+	return (a & 0xFFFF) | (b << 16);
+}
+
+enum crc32_impl crc32_active(void)
+{
+	pthread_once(&tablesOnce, init_tables);
+	return active;
+}
@@ -0,0 +1,25 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+// CRC32 (IEEE 802.3, reflected polynomial 0xEDB88320) shared by the Sender and Receiver.
+// Streaming API so the header fields and the data can be fed in place without copying them into one buffer:
+//     uint32_t crc = crc32_begin(); crc = crc32_update(crc, &type, 4); ... ; checksum = crc32_end(crc);
+#include <stddef.h>
+#include <stdint.h>
+
+enum crc32_impl { CRC32_BITWISE, CRC32_SLICE8, CRC32_PCLMUL }; // Available engines, fastest supported one is picked at runtime
+
+uint32_t crc32_begin(void);
+uint32_t crc32_update(uint32_t crc, const void* data, size_t len);
+uint32_t crc32_end(uint32_t crc);
+uint32_t crc32(const void* data, size_t len); // One shot, same as begin/update/end
+
+int crc32_supported(enum crc32_impl impl); // For the benchmark: can this engine run on this CPU
+uint32_t crc32_update_with(enum crc32_impl impl, uint32_t crc, const void* data, size_t len);
+const char* crc32_impl_name(enum crc32_impl impl);
+enum crc32_impl crc32_active(void); // Engine crc32_update dispatches to
+
+// rsync's rolling checksum: the byte sum (low 16 bits) and the sum of the running sums (high 16 bits). Much weaker than
+// the CRC, but it mixes differently, so the pair makes a 64 bit chunk signature for delta sync (the Sender's -r)
+uint32_t rolling_sum(const void* data, size_t len);
+
+#endif
@@ -0,0 +1,136 @@
+#include <string.h>
+#include "Compression.h"
+
+#define HASH_LOG (12) // 4096 entries of 16 bit positions, small enough to clear for every chunk
+#define MIN_MATCH (4)
+#define MAX_OFFSET (65535)
+#define LAST_LITERALS (5) // The format ends with at least this many literals...
+#define MATCH_LIMIT (12) // ...and no match starts closer than this to the end
+#define SKIP_STRENGTH (6) // Every 64 misses in a row the search steps one byte further, so incompressible data goes fast
+
+static uint32_t read32(const uint8_t* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static uint64_t read64(const uint8_t* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+
+static uint32_t hash32(uint32_t v) { return (v * 2654435761u) >> (32-HASH_LOG); }
+
+static size_t match_length(const uint8_t* a, const uint8_t* b, size_t max)
+{ // Common prefix of a and b, at most max bytes, compared 8 at a time
+	size_t n = 0;
+	while (n+8 <= max) {
+		uint64_t diff = read64(a+n) ^ read64(b+n);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+		if (diff) { return n + (__builtin_ctzll(diff) >> 3); } // The first differing byte is the lowest one
+#else
+		if (diff) { return n + (__builtin_clzll(diff) >> 3); }
+#endif
+		n += 8;
+	}
+	while (n < max && a[n] == b[n]) { n+=1; }
+	return n;
+}
+
+static int put_length(uint8_t* dst, size_t capacity, size_t* op, size_t n)
+{ // The bytes of a length beyond its nibble: 255 until less is left
+	for (; n >= 255; n -= 255) {
+		if (*op >= capacity) { return 0; }
+		dst[(*op)++] = 255;
+	}
+	if (*op >= capacity) { return 0; }
+	dst[(*op)++] = (uint8_t)n;
+	return 1;
+}
+
+static int put_sequence(uint8_t* dst, size_t capacity, size_t* op, const uint8_t* literals, size_t litLen, size_t offset, size_t matchLen)
+{ // One token, its literals and its match (matchLen 0 for the last sequence). Returns 0 if it does not fit
+	if (*op >= capacity) { return 0; }
+	size_t token = *op;
+	dst[(*op)++] = (uint8_t)(((litLen < 15) ? litLen : 15) << 4);
+	if (litLen >= 15 && !put_length(dst, capacity, op, litLen-15)) { return 0; }
+	if (litLen > capacity-*op) { return 0; }
+	memcpy(dst+*op, literals, litLen);
+	*op += litLen;
+	if (!matchLen) { return 1; }
+	if (capacity-*op < 2) { return 0; }
+	dst[(*op)++] = (uint8_t)offset;
+	dst[(*op)++] = (uint8_t)(offset >> 8);
+	size_t code = matchLen-MIN_MATCH;
+	dst[token] |= (uint8_t)((code < 15) ? code : 15);
+	if (code >= 15 && !put_length(dst, capacity, op, code-15)) { return 0; }
+	return 1;
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t capacity)
+{ // Greedy single pass: hash 4 bytes, check the last position with the same hash, extend any match both ways
+	if (len > LZ_MAX_INPUT) { return 0; }
+	uint16_t table[1 << HASH_LOG];
+	memset(table, 0, sizeof(table)); // Position 0 for every hash, a wrong candidate only fails the comparison
+	size_t ip = 0, anchor = 0, op = 0;
+	if (len >= MATCH_LIMIT) {
+		size_t limit = len-MATCH_LIMIT; // Last position a match may start at
+		size_t matchEnd = len-LAST_LITERALS; // Matches stop before the final literals
+		unsigned int misses = 1 << SKIP_STRENGTH;
+		ip = 1; // Nothing to match the first byte against
+		while (ip <= limit) {
+			uint32_t h = hash32(read32(src+ip));
+			size_t ref = table[h];
+			table[h] = (uint16_t)ip;
+			if (ref >= ip || ip-ref > MAX_OFFSET || read32(src+ref) != read32(src+ip)) {
+				ip += misses++ >> SKIP_STRENGTH;
+				continue;
+			}
+			while (ip > anchor && ref > 0 && src[ip-1] == src[ref-1]) { ip--; ref--; } // The match may have started earlier
+			size_t matchLen = MIN_MATCH + match_length(src+ip+MIN_MATCH, src+ref+MIN_MATCH, matchEnd-ip-MIN_MATCH);
+			if (!put_sequence(dst, capacity, &op, src+anchor, ip-anchor, ip-ref, matchLen)) { return 0; }
+			ip += matchLen;
+			anchor = ip;
+			misses = 1 << SKIP_STRENGTH;
+			if (ip-2 <= limit) { table[hash32(read32(src+ip-2))] = (uint16_t)(ip-2); } // Cheap extra candidate inside the match
+		}
+	}
+	if (!put_sequence(dst, capacity, &op, src+anchor, len-anchor, 0, 0)) { return 0; }
+	return op;
+}
+
+static int get_length(const uint8_t* src, size_t len, size_t* ip, size_t* n)
+{ // Adds the extra length bytes to n. Returns 0 if they run past the input
+	uint8_t b;
+	do {
+		if (*ip >= len) { return 0; }
+		b = src[(*ip)++];
+		*n += b;
+	} while (b == 255);
+	return 1;
+}
+
+int lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t expected)
+{ // Every length and offset comes off the wire, so each one is checked against both buffers before it is used
+	size_t ip = 0, op = 0;
+	while (ip < len) {
+		uint8_t token = src[ip++];
+		size_t litLen = token >> 4;
+		if (litLen == 15 && !get_length(src, len, &ip, &litLen)) { return 0; }
+		if (litLen > len-ip || litLen > expected-op) { return 0; }
+		if (litLen <= 16 && len-ip >= 16 && expected-op >= 16) { memcpy(dst+op, src+ip, 16); } // Fixed size copies are a few instructions, the extra bytes get overwritten
+		else { memcpy(dst+op, src+ip, litLen); }
+		ip += litLen;
+		op += litLen;
+		if (ip == len) { break; } // The last sequence has no match
+		if (len-ip < 2) { return 0; }
+		size_t offset = src[ip] | (size_t)src[ip+1] << 8;
+		ip += 2;
+		size_t matchLen = (token & 15);
+		if (matchLen == 15 && !get_length(src, len, &ip, &matchLen)) { return 0; }
+		matchLen += MIN_MATCH;
+		if (!offset || offset > op || matchLen > expected-op) { return 0; }
+		const uint8_t* ref = dst+op-offset;
+		if (matchLen <= 16 && offset >= 16 && expected-op >= 16) { memcpy(dst+op, ref, 16); op += matchLen; continue; }
+		for (size_t done = 0; done < matchLen;) { // A match closer than its length repeats the last offset bytes. Each copy
+			size_t n = (offset+done < matchLen-done) ? offset+done : matchLen-done; // doubles what can be copied without overlap
+			memcpy(dst+op+done, ref, n);
+			done += n;
+		}
+		op += matchLen;
+	}
+	return op == expected;
+}
@@ -0,0 +1,15 @@
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+// Fast LZ77 codec for single chunks (the LZ4 block format), used by the Sender's optional compression (-z).
+// Every chunk is compressed on its own, so any packet can be decompressed whatever arrived before it.
+// A sequence is a token (literal count in the high nibble, match length - 4 in the low one, 15 meaning more bytes of
+// 255 follow), the literals, then a 2 byte little endian offset back into the output. The last sequence has no match.
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ_MAX_INPUT (65536) // Positions are kept in 16 bits, chunks never get this large anyway
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t capacity); // Compressed size, 0 if it does not fit in capacity
+int lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t expected); // 1 if src decodes to exactly expected bytes
+
+#endif
@@ -0,0 +1,214 @@
+#include <string.h>
+#include "Congestion.h"
+
+#define PACING_SLACK_US (1000) // The pacer lets up to this much of the rate go out at once after an idle period, so batches stay large
+#define RENO_SS_GAIN (2.0) // Pace at twice cwnd/srtt in slow start, so the window can actually double each round trip
+#define RENO_CA_GAIN (1.2) // And a little above it afterwards, so the pacer never becomes the bottleneck
+#define BBR_HIGH_GAIN (2.885) // 2/ln(2), doubles the sending rate every round trip during startup
+#define BBR_CWND_GAIN (2.0) // Window in PROBE_BW, in bandwidth-delay products
+#define BBR_MIN_PACKETS (4) // Smallest BBR window
+#define BBR_FULL_BW_GROWTH (1.25) // Startup ends when the bandwidth stops growing by this much...
+#define BBR_FULL_BW_ROUNDS (3) // ...for this many rounds
+#define BBR_PROBE_RTT_INTERVAL_US (10000000) // Re-measure the minimum RTT when it has not been seen for this long
+#define BBR_PROBE_RTT_US (200000) // Spend this long at a tiny window to measure it
+
+enum { BBR_STARTUP, BBR_DRAIN, BBR_PROBE_BW, BBR_PROBE_RTT };
+static const double bbrCycle[8] = { 1.25, 0.75, 1, 1, 1, 1, 1, 1 }; // Probe for more bandwidth, drain the queue it built, cruise
+
+static uint64_t max64(uint64_t a, uint64_t b) { return (a > b) ? a : b; }
+
+static void none_init(struct cc* c) { c->cwnd = UINT64_MAX; }
+static void none_ack(struct cc* c, const struct cc_ack* a) { (void)c; (void)a; }
+static void none_loss(struct cc* c, uint64_t now, int severe) { (void)c; (void)now; (void)severe; }
+
+static void reno_pace(struct cc* c)
+{ // Spread the window over one smoothed RTT
+	if (!c->srtt) { c->pacingRate = 0; return; }
+	double gain = (c->cwnd < c->ssthresh) ? RENO_SS_GAIN : RENO_CA_GAIN;
+	c->pacingRate = gain * c->cwnd * 1000000 / c->srtt;
+}
+
+static void reno_init(struct cc* c)
+{
+	c->cwnd = (uint64_t)CC_INITIAL_PACKETS*c->mss;
+	c->ssthresh = UINT64_MAX;
+}
+
+static void reno_ack(struct cc* c, const struct cc_ack* a)
+{ // Slow start doubles the window every round trip, congestion avoidance adds one packet per window of ACKed bytes
+	if (c->cwnd < c->ssthresh) {
+		c->cwnd += a->bytes;
+	} else {
+		c->caBytes += a->bytes;
+		if (c->caBytes >= c->cwnd) { c->caBytes -= c->cwnd; c->cwnd += c->mss; }
+	}
+	reno_pace(c);
+}
+
+static void reno_loss(struct cc* c, uint64_t now, int severe)
+{ // Multiplicative decrease. A packet lost while others are still ACKed halves the window, silence drops it to one packet
+	(void)now;
+	c->ssthresh = max64(c->inflight/2, (uint64_t)CC_MIN_PACKETS*c->mss);
+	c->cwnd = severe ? c->mss : c->ssthresh;
+	c->caBytes = 0;
+	reno_pace(c);
+}
+
+static void bbr_enter_probe_bw(struct cc* c, uint64_t now)
+{
+	c->mode = BBR_PROBE_BW;
+	c->cycleIndex = 2; // Start cruising, the next probe comes after the cycle wraps
+	c->cycleStart = now;
+}
+
+static void bbr_init(struct cc* c)
+{
+	c->cwnd = (uint64_t)CC_INITIAL_PACKETS*c->mss;
+	c->mode = BBR_STARTUP;
+	c->pacingGain = BBR_HIGH_GAIN;
+	c->cwndGain = BBR_HIGH_GAIN;
+}
+
+static void bbr_ack(struct cc* c, const struct cc_ack* a)
+{
+	int roundStart = 0;
+	if (a->txDelivered >= c->nextRoundDelivered) { // Every packet sent in the last round has been ACKed
+		c->round+=1;
+		c->nextRoundDelivered = c->delivered;
+		roundStart = 1;
+	}
+
+	if (a->rate) { // Bottleneck bandwidth: the best delivery rate of the last BBR_BW_ROUNDS rounds
+		unsigned int i = c->round % BBR_BW_ROUNDS;
+		if (c->bwRound[i] != c->round) { c->bwRound[i] = c->round; c->bwSample[i] = 0; }
+		c->bwSample[i] = max64(c->bwSample[i], a->rate);
+		c->btlBw = 0;
+		for (i = 0; i < BBR_BW_ROUNDS; i++) {
+			if (c->round - c->bwRound[i] < BBR_BW_ROUNDS) { c->btlBw = max64(c->btlBw, c->bwSample[i]); }
+		}
+	}
+
+	int rttExpired = (a->now - c->minRttAt > BBR_PROBE_RTT_INTERVAL_US);
+	if (a->rtt && (!c->minRtt || a->rtt <= c->minRtt || rttExpired)) { c->minRtt = a->rtt; c->minRttAt = a->now; }
+
+	uint64_t bdp = c->btlBw * c->minRtt / 1000000;
+	switch (c->mode) {
+		case BBR_STARTUP: // Grow until the bandwidth stops growing
+			if (roundStart && c->btlBw) {
+				if (c->btlBw >= c->fullBw*BBR_FULL_BW_GROWTH) { c->fullBw = c->btlBw; c->fullBwRounds = 0; }
+				else if (++c->fullBwRounds >= BBR_FULL_BW_ROUNDS) { c->filledPipe = 1; c->mode = BBR_DRAIN; }
+			}
+			break;
+		case BBR_DRAIN: // Empty the queue startup built, then cruise
+			if (c->inflight <= bdp) { bbr_enter_probe_bw(c, a->now); }
+			break;
+		case BBR_PROBE_BW: // One gain per minimum RTT
+			if (c->minRtt && a->now - c->cycleStart > c->minRtt) { c->cycleIndex = (c->cycleIndex+1) % 8; c->cycleStart = a->now; }
+			break;
+		case BBR_PROBE_RTT:
+			if (a->now >= c->probeRttDone) {
+				c->minRttAt = a->now;
+				if (c->filledPipe) { bbr_enter_probe_bw(c, a->now); } else { c->mode = BBR_STARTUP; }
+			}
+			break;
+	}
+	if (c->mode != BBR_PROBE_RTT && rttExpired && c->filledPipe) { // The minimum RTT is stale, drain the queue to measure it again
+		c->mode = BBR_PROBE_RTT;
+		c->probeRttDone = a->now + BBR_PROBE_RTT_US;
+	}
+
+	switch (c->mode) {
+		case BBR_STARTUP: c->pacingGain = BBR_HIGH_GAIN; c->cwndGain = BBR_HIGH_GAIN; break;
+		case BBR_DRAIN: c->pacingGain = 1/BBR_HIGH_GAIN; c->cwndGain = BBR_HIGH_GAIN; break;
+		case BBR_PROBE_BW: c->pacingGain = bbrCycle[c->cycleIndex]; c->cwndGain = BBR_CWND_GAIN; break;
+		default: c->pacingGain = 1; c->cwndGain = 1; break;
+	}
+
+	if (c->btlBw) { c->pacingRate = c->pacingGain * c->btlBw; }
+	uint64_t minCwnd = (uint64_t)BBR_MIN_PACKETS*c->mss;
+	if (c->mode == BBR_PROBE_RTT) { c->cwnd = minCwnd; return; }
+	uint64_t target = max64((uint64_t)(c->cwndGain*bdp) + 3*c->mss, minCwnd);
+	if (c->filledPipe) { c->cwnd = (c->cwnd + a->bytes < target) ? c->cwnd + a->bytes : target; }
+	else if (c->cwnd < target || !bdp) { c->cwnd += a->bytes; } // Startup only ever grows the window
+	if (c->cwnd < minCwnd) { c->cwnd = minCwnd; }
+}
+
+static void bbr_loss(struct cc* c, uint64_t now, int severe)
+{ // The model already accounts for random loss. Only silence means the path changed, start over from a small window
+	(void)now;
+	if (severe) { c->cwnd = (uint64_t)BBR_MIN_PACKETS*c->mss; }
+}
+
+static const struct cc_ops ccOps[] = {
+	[CC_NONE] = { "none", none_init, none_ack, none_loss },
+	[CC_RENO] = { "reno", reno_init, reno_ack, reno_loss },
+	[CC_BBR] = { "bbr", bbr_init, bbr_ack, bbr_loss },
+};
+
+void cc_init(struct cc* c, enum cc_algo algo, uint32_t mss)
+{
+	memset(c, 0, sizeof(*c));
+	c->ops = &ccOps[algo];
+	c->mss = mss;
+	c->ops->init(c);
+}
+
+int cc_algo_parse(const char* name, enum cc_algo* algo)
+{
+	for (unsigned int i = 0; i < sizeof(ccOps)/sizeof(ccOps[0]); i++) {
+		if (!strcmp(name, ccOps[i].name)) { *algo = i; return 1; }
+	}
+	return 0;
+}
+
+const char* cc_name(const struct cc* c) { return c->ops->name; }
+
+int cc_window_full(const struct cc* c, uint32_t bytes)
+{ // An empty pipe may always take one packet, whatever the window, so the transfer can never stall on it
+	return c->inflight && c->inflight + bytes > c->cwnd;
+}
+
+int cc_can_send(const struct cc* c, uint64_t now, uint32_t bytes)
+{
+	return !cc_window_full(c, bytes) && now >= c->nextSendAt;
+}
+
+uint64_t cc_next_send(const struct cc* c) { return c->nextSendAt; }
+
+void cc_on_send(struct cc* c, uint64_t now, uint32_t bytes, struct cc_tx* tx, int retransmit)
+{ // Resends count toward the pacer but not the flight size, the lost copy was never taken out of it
+	if (!retransmit) { c->inflight += bytes; }
+	if (!c->deliveredAt) { c->deliveredAt = now; } // Rate samples of the first flight start at the first send
+	tx->sentAt = now;
+	tx->delivered = c->delivered;
+	tx->deliveredAt = c->deliveredAt;
+	if (c->pacingRate) { // Credit never builds up beyond PACING_SLACK_US, so an idle stream can't burst its whole window
+		uint64_t earliest = (now > PACING_SLACK_US) ? now-PACING_SLACK_US : 0;
+		if (c->nextSendAt < earliest) { c->nextSendAt = earliest; }
+		c->nextSendAt += (uint64_t)bytes*1000000/c->pacingRate;
+	}
+}
+
+void cc_on_ack(struct cc* c, uint64_t now, uint32_t bytes, const struct cc_tx* tx, uint64_t rtt)
+{
+	c->inflight = (c->inflight > bytes) ? c->inflight-bytes : 0;
+	c->delivered += bytes;
+	c->deliveredAt = now;
+	if (rtt) { c->srtt = c->srtt ? (7*c->srtt + rtt)/8 : rtt; }
+
+	struct cc_ack a;
+	a.now = now;
+	a.bytes = bytes;
+	a.rtt = rtt;
+	a.txDelivered = tx->delivered;
+	a.rate = 0; // Bytes delivered while this packet was in flight, over the time that took
+	if (now > tx->deliveredAt) { a.rate = (c->delivered - tx->delivered)*1000000/(now - tx->deliveredAt); }
+	c->ops->ack(c, &a);
+}
+
+void cc_on_loss(struct cc* c, uint64_t now, const struct cc_tx* tx, int severe)
+{ // One reaction per loss episode: packets sent before the last reduction were lost to the old window
+	if (!severe && tx->sentAt < c->recoveryStart) { return; }
+	c->recoveryStart = now;
+	c->ops->loss(c, now, severe);
+}
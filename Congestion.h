@@ -0,0 +1,83 @@
+#ifndef CONGESTION_H
+#define CONGESTION_H
+// Congestion control for the Sender. Every stream owns a struct cc, which decides how many bytes may be in flight (cwnd)
+// and how fast they may leave (pacing rate). The controllers are pluggable through struct cc_ops:
+//   none   no limit besides the send window, no pacing (the behaviour before congestion control)
+//   reno   NewReno/AIMD: slow start, additive increase, halve on loss, back to one packet when the ACKs stop
+//   bbr    BBR-like: models the bottleneck bandwidth and minimum RTT from delivery rate samples and paces at that rate,
+//          only reacting to loss when the ACKs stop altogether
+// Pacing is timer based: the Sender asks cc_can_send() before every new packet and sleeps until cc_next_send().
+#include <stdint.h>
+
+#define CC_INITIAL_PACKETS (10) // Initial window in packets (RFC 6928)
+#define CC_MIN_PACKETS (2) // Smallest window after a loss
+#define BBR_BW_ROUNDS (10) // Bandwidth samples are a windowed max over this many round trips
+
+enum cc_algo { CC_NONE, CC_RENO, CC_BBR };
+
+struct cc_tx { // Snapshot taken when a packet is sent, handed back when it is ACKed or lost
+	uint64_t sentAt; // Monotonic time (us) of the (last) transmission
+	uint64_t delivered; // Bytes delivered when it was sent, for delivery rate samples
+	uint64_t deliveredAt; // Time of that delivery
+};
+
+struct cc_ack { // What one ACK tells the controller
+	uint64_t now;
+	uint32_t bytes; // Size of the ACKed packet
+	uint64_t rtt; // RTT sample (us), 0 if ambiguous (Karn's rule)
+	uint64_t rate; // Delivery rate sample (bytes/s), 0 if none
+	uint64_t txDelivered; // Bytes delivered when the ACKed packet was sent, for counting round trips
+};
+
+struct cc;
+
+struct cc_ops {
+	const char* name;
+	void (*init)(struct cc* c);
+	void (*ack)(struct cc* c, const struct cc_ack* a);
+	void (*loss)(struct cc* c, uint64_t now, int severe); // severe: no ACK at all for a whole RTO
+};
+
+struct cc {
+	const struct cc_ops* ops;
+	uint32_t mss; // Largest packet (bytes)
+	uint64_t cwnd; // Bytes allowed in flight
+	uint64_t ssthresh; // Slow start threshold (reno)
+	uint64_t caBytes; // Bytes ACKed toward the next congestion avoidance increase (reno)
+	uint64_t pacingRate; // Bytes per second, 0 leaves the packets unpaced
+	uint64_t inflight; // Bytes sent and not ACKed yet
+	uint64_t delivered; // Bytes ACKed so far
+	uint64_t deliveredAt; // Time of the last ACK
+	uint64_t srtt; // Smoothed RTT (us) for the pacing rate
+	uint64_t minRtt; // Lowest RTT seen (us), refreshed every few seconds (bbr)
+	uint64_t minRttAt;
+	uint64_t nextSendAt; // Pacing: the next packet may not leave before this time
+	uint64_t recoveryStart; // Losses of packets sent before this belong to an episode we already reacted to
+
+	int mode; // BBR state machine
+	uint64_t btlBw; // Estimated bottleneck bandwidth (bytes/s)
+	uint64_t bwSample[BBR_BW_ROUNDS]; // Highest delivery rate of each recent round
+	uint64_t bwRound[BBR_BW_ROUNDS]; // Round each sample belongs to
+	uint64_t round; // Round trips counted so far
+	uint64_t nextRoundDelivered; // A new round starts once a packet sent after this many bytes were delivered is ACKed
+	uint64_t fullBw; // Bandwidth when startup last grew by 25%
+	int fullBwRounds; // Rounds since then
+	int filledPipe; // Startup is over
+	int cycleIndex; // Position in the probe bandwidth gain cycle
+	uint64_t cycleStart;
+	uint64_t probeRttDone; // End of the current probe RTT phase
+	double pacingGain;
+	double cwndGain;
+};
+
+void cc_init(struct cc* c, enum cc_algo algo, uint32_t mss);
+int cc_algo_parse(const char* name, enum cc_algo* algo); // "none", "reno" or "bbr". Returns 0 for anything else
+const char* cc_name(const struct cc* c);
+int cc_window_full(const struct cc* c, uint32_t bytes); // No room for bytes more in flight, whatever the pacer says
+int cc_can_send(const struct cc* c, uint64_t now, uint32_t bytes); // Room in the window and the pacer lets it go now
+uint64_t cc_next_send(const struct cc* c); // When the pacer lets the next packet go
+void cc_on_send(struct cc* c, uint64_t now, uint32_t bytes, struct cc_tx* tx, int retransmit);
+void cc_on_ack(struct cc* c, uint64_t now, uint32_t bytes, const struct cc_tx* tx, uint64_t rtt); // rtt 0 if ambiguous
+void cc_on_loss(struct cc* c, uint64_t now, const struct cc_tx* tx, int severe); // A packet timed out and is about to be resent
+
+#endif
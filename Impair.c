@@ -0,0 +1,214 @@
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h> // getopt
+#include <poll.h> // ppoll waits for packets until the next held packet is due, with microsecond precision
+#include <arpa/inet.h>
+#include "UnreliableChannel.h" // The impairment model
+// Network impairment relay. Listens on a UDP port, forwards everything to the target and the answers back, impairing both
+// directions with their own channel (see UnreliableChannel.h for the spec). Every client address gets its own socket
+// toward the target, so the target still sees one flow per client socket (one per stripe of a Sender).
+// Usage: ./Impair [-f spec] [-r spec] [listen-port] [target-IP] [target-port]
+//   -f impairs the packets toward the target, -r the ones coming back. Prints what each channel did on exit (Ctrl-C).
+
+#define MAX_FLOWS (1024) // Clients relayed at once
+#define FLOW_IDLE_US (60000000) // A client that sent and received nothing for this long gives up its socket
+#define MAX_DATAGRAM (65536)
+
+struct flow {
+	struct sockaddr_in client; // Where the client sends from
+	int socket; // Our socket toward the target for this client
+	uint64_t lastSeen;
+};
+
+struct held { // A packet waiting for its delivery time
+	uint64_t deliverAt;
+	uint64_t order; // Packets due at the same time leave in arrival order
+	int socket; // Socket to send it from
+	struct sockaddr_in dest;
+	size_t len;
+	uint8_t data[];
+};
+
+static struct flow flows[MAX_FLOWS];
+static unsigned int numFlows = 0;
+static struct held** heap = NULL; // Min-heap of held packets by delivery time
+static unsigned int heapCount = 0, heapSize = 0;
+static uint64_t arrivals = 0;
+static volatile sig_atomic_t stop = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static int earlier(struct held* a, struct held* b) { return a->deliverAt < b->deliverAt || (a->deliverAt == b->deliverAt && a->order < b->order); }
+
+static void heap_push(struct held* h)
+{
+	if (heapCount == heapSize) {
+		heapSize = heapSize ? 2*heapSize : 1024;
+		heap = realloc(heap, heapSize*sizeof(struct held*));
+		assert(heap);
+	}
+	unsigned int i = heapCount++;
+	while (i && earlier(h, heap[(i-1)/2])) { heap[i] = heap[(i-1)/2]; i = (i-1)/2; }
+	heap[i] = h;
+}
+
+static struct held* heap_pop(void)
+{
+	struct held* top = heap[0];
+	struct held* last = heap[--heapCount];
+	unsigned int i = 0;
+	for (;;) {
+		unsigned int c = 2*i+1;
+		if (c >= heapCount) { break; }
+		if (c+1 < heapCount && earlier(heap[c+1], heap[c])) { c+=1; }
+		if (!earlier(heap[c], last)) { break; }
+		heap[i] = heap[c];
+		i = c;
+	}
+	if (heapCount) { heap[i] = last; }
+	return top;
+}
+
+static void relay(struct channel* ch, uint8_t* packet, size_t len, int socket, struct sockaddr_in* dest, uint64_t now)
+{ // Impair one packet and hold every copy that survives until it is due
+	uint64_t deliverAt[2];
+	unsigned int copies = channel_apply(ch, now, packet, len, deliverAt);
+	for (unsigned int i = 0; i < copies; i++) {
+		struct held* h = malloc(sizeof(struct held) + len);
+		assert(h);
+		h->deliverAt = deliverAt[i];
+		h->order = arrivals++;
+		h->socket = socket;
+		h->dest = *dest;
+		h->len = len;
+		memcpy(h->data, packet, len);
+		heap_push(h);
+	}
+}
+
+static void deliver(uint64_t now)
+{
+	while (heapCount && heap[0]->deliverAt <= now) {
+		struct held* h = heap_pop();
+		sendto(h->socket, h->data, h->len, 0, (struct sockaddr*)&h->dest, sizeof(h->dest));
+		free(h);
+	}
+}
+
+static struct flow* find_flow(struct sockaddr_in* client, uint64_t now)
+{ // The flow of a client, opening a socket toward the target for a new one. NULL if every flow is taken
+	for (unsigned int i = 0; i < numFlows; i++) {
+		if (flows[i].client.sin_port == client->sin_port && flows[i].client.sin_addr.s_addr == client->sin_addr.s_addr) { return &flows[i]; }
+	}
+	for (unsigned int i = 0; i < numFlows; i++) { // Reuse the socket of a client that went quiet
+		if (now - flows[i].lastSeen > FLOW_IDLE_US) { flows[i].client = *client; return &flows[i]; }
+	}
+	if (numFlows == MAX_FLOWS) { return NULL; }
+	struct flow* f = &flows[numFlows++];
+	f->client = *client;
+	f->socket = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(f->socket != -1);
+	return f;
+}
+
+static void on_signal(int sig) { (void)sig; stop = 1; }
+
+static void report(const char* name, struct channel* ch)
+{
+	printf("%s: %lu packets, %lu lost, %lu queue overflows, %lu duplicated, %lu corrupted, %lu reordered\n", name,
+	       ch->packets, ch->dropped, ch->overflows, ch->duplicated, ch->corrupted, ch->reordered);
+}
+
+int main(int argc, char* argv[])
+{
+	const char* forwardSpec = "";
+	const char* reverseSpec = "";
+	int opt;
+	while ((opt = getopt(argc, argv, "f:r:")) != -1) {
+		switch (opt) {
+			case 'f': forwardSpec = optarg; break; // Impairments toward the target
+			case 'r': reverseSpec = optarg; break; // Impairments on the way back
+			default: assert(0);
+		}
+	}
+	argc -= optind-1; argv += optind-1; // Shift so the positional arguments keep their usual indices
+	assert(argc == 4);
+
+	struct channel_config cfg;
+	struct channel forward, reverse;
+	assert(channel_parse(forwardSpec, &cfg));
+	channel_init(&forward, &cfg, 0);
+	assert(channel_parse(reverseSpec, &cfg));
+	channel_init(&reverse, &cfg, 1); // Its own stream, even with the same seed
+
+	struct sockaddr_in listenAddr = {0};
+	listenAddr.sin_family = AF_INET;
+	listenAddr.sin_port = htons(atoi(argv[1]));
+	listenAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	int listener = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(listener != -1);
+	assert(bind(listener, (struct sockaddr*)&listenAddr, sizeof(listenAddr)) != -1);
+
+	struct sockaddr_in target = {0};
+	target.sin_family = AF_INET;
+	target.sin_port = htons(atoi(argv[3]));
+	assert(inet_pton(AF_INET, argv[2], &target.sin_addr) == 1);
+
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	setvbuf(stdout, NULL, _IOLBF, 0);
+
+	struct pollfd fds[MAX_FLOWS+1];
+	uint8_t packet[MAX_DATAGRAM];
+	while (!stop) {
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (unsigned int i = 0; i < numFlows; i++) { fds[i+1].fd = flows[i].socket; fds[i+1].events = POLLIN; }
+		struct timespec ts, *timeout = NULL;
+		if (heapCount) { // Wake up for the next held packet
+			uint64_t now = now_us();
+			uint64_t wait = (heap[0]->deliverAt > now) ? heap[0]->deliverAt-now : 0;
+			ts.tv_sec = wait/1000000;
+			ts.tv_nsec = (wait%1000000)*1000;
+			timeout = &ts;
+		}
+		int ready = ppoll(fds, numFlows+1, timeout, NULL);
+		if (ready < 0 && errno != EINTR) { perror("ppoll"); break; }
+
+		uint64_t now = now_us();
+		if (ready > 0 && (fds[0].revents & POLLIN)) { // From the clients, toward the target
+			struct sockaddr_in client;
+			socklen_t clientLen = sizeof(client);
+			ssize_t r;
+			while ((r = recvfrom(listener, packet, sizeof(packet), MSG_DONTWAIT, (struct sockaddr*)&client, &clientLen)) >= 0) {
+				struct flow* f = find_flow(&client, now);
+				if (f) { f->lastSeen = now; relay(&forward, packet, r, f->socket, &target, now); }
+				clientLen = sizeof(client);
+			}
+		}
+		for (unsigned int i = 0; ready > 0 && i < numFlows; i++) { // From the target, back to its client
+			if (!(fds[i+1].revents & POLLIN)) { continue; }
+			ssize_t r;
+			while ((r = recvfrom(flows[i].socket, packet, sizeof(packet), MSG_DONTWAIT, NULL, NULL)) >= 0) {
+				flows[i].lastSeen = now;
+				relay(&reverse, packet, r, listener, &flows[i].client, now);
+			}
+		}
+		deliver(now_us());
+	}
+	report("forward", &forward);
+	report("reverse", &reverse);
+	return 0;
+}
@@ -0,0 +1,179 @@
+#include <stdio.h> // Lines go to stderr
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <poll.h> // The reporting thread waits for the next interval, a socket client or the stop event at once
+#include <time.h> // clock_gettime for the report intervals
+#include <pthread.h> // The reporting thread
+#include <sys/socket.h>
+#include <sys/un.h> // The UNIX socket (-x)
+#include <sys/stat.h> // lstat, only a stale socket at the path is removed
+#include <sys/eventfd.h> // Wakes the reporting thread when the program is done
+#include "Metrics.h"
+// Only the reporting thread builds lines and answers clients, so the latest line needs no lock. Clients get the line of
+// the last interval rather than a fresh one, a report in between would split the interval its rates are measured over.
+
+static metrics_report reportFn = NULL;
+static uint64_t intervalUs = 0;
+static int printing = 0; // Every line also goes to stderr (-p)
+static int listenFd = -1; // The UNIX socket, -1 without -x
+static char listenPath[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static int wakeFd = -1; // eventfd written by metrics_stop
+static pthread_t reporter;
+static char line[METRICS_LINE+1]; // Latest line, newline included
+static size_t lineLen = 0;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static unsigned int bucket_of(uint64_t v)
+{
+	if (v < HIST_SUB) { return v; }
+	if (v >> HIST_MAX_BITS) { return HIST_BUCKETS-1; }
+	unsigned int k = 63 - __builtin_clzll(v); // The power of two the value is in, at least HIST_SUB_BITS
+	return HIST_SUB + (k-HIST_SUB_BITS)*HIST_SUB + (unsigned int)(v >> (k-HIST_SUB_BITS)) - HIST_SUB;
+}
+
+static uint64_t bucket_middle(unsigned int i)
+{
+	if (i < HIST_SUB) { return i; }
+	unsigned int k = (i-HIST_SUB)/HIST_SUB + HIST_SUB_BITS;
+	uint64_t low = (uint64_t)(HIST_SUB + (i-HIST_SUB)%HIST_SUB) << (k-HIST_SUB_BITS);
+	return low + ((1ull << (k-HIST_SUB_BITS)) >> 1);
+}
+
+void hist_add(struct hist* h, uint64_t value)
+{
+	if (!h->count || value < h->min) { h->min = value; }
+	if (value > h->max) { h->max = value; }
+	h->count+=1;
+	h->sum += value;
+	h->buckets[bucket_of(value)]+=1;
+}
+
+void hist_merge(struct hist* into, const struct hist* h)
+{
+	if (!h->count) { return; }
+	if (!into->count || h->min < into->min) { into->min = h->min; }
+	if (h->max > into->max) { into->max = h->max; }
+	into->count += h->count;
+	into->sum += h->sum;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) { into->buckets[i] += h->buckets[i]; }
+}
+
+uint64_t hist_quantile(const struct hist* h, double q)
+{ // The middle of the bucket the quantile falls in, kept between the smallest and largest value recorded
+	if (!h->count) { return 0; }
+	uint64_t rank = (uint64_t)(q*h->count + 0.5);
+	if (rank < 1) { rank = 1; }
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen < rank) { continue; }
+		uint64_t v = bucket_middle(i);
+		return (v < h->min) ? h->min : (v > h->max) ? h->max : v;
+	}
+	return h->max;
+}
+
+int hist_json(char* buf, size_t cap, const struct hist* h)
+{
+	return snprintf(buf, cap, "{\"count\":%llu,\"mean\":%llu,\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,\"max\":%llu}",
+		(unsigned long long)h->count, (unsigned long long)(h->count ? h->sum/h->count : 0), (unsigned long long)(h->count ? h->min : 0),
+		(unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9), (unsigned long long)hist_quantile(h, 0.99),
+		(unsigned long long)hist_quantile(h, 0.999), (unsigned long long)h->max);
+}
+
+int hist_summary(char* buf, size_t cap, const struct hist* h)
+{
+	if (!h->count) { return snprintf(buf, cap, "no samples"); }
+	return snprintf(buf, cap, "min %llu, p50 %llu, p90 %llu, p99 %llu, max %llu (%llu samples)", (unsigned long long)h->min,
+		(unsigned long long)hist_quantile(h, 0.5), (unsigned long long)hist_quantile(h, 0.9), (unsigned long long)hist_quantile(h, 0.99),
+		(unsigned long long)h->max, (unsigned long long)h->count);
+}
+
+static void take_report(int final)
+{
+	int n = reportFn(line, METRICS_LINE, final);
+	assert(n > 0 && n < METRICS_LINE);
+	line[n] = '\n';
+	lineLen = n+1;
+}
+
+static void serve_client(void)
+{ // Every client gets the latest line and is hung up on, e.g. nc -U path
+	int fd = accept(listenFd, NULL, NULL);
+	if (fd == -1) { return; }
+	send(fd, line, lineLen, MSG_NOSIGNAL | MSG_DONTWAIT); // A line fits any socket buffer, a client that went away is no error
+	close(fd);
+}
+
+static void* run_reporter(void* arg)
+{
+	(void)arg;
+	take_report(0); // Clients that connect before the first interval get zeros
+	uint64_t next = now_us() + intervalUs;
+	struct pollfd fds[2] = { { .fd = wakeFd, .events = POLLIN }, { .fd = listenFd, .events = POLLIN } };
+	for (;;) {
+		uint64_t now = now_us();
+		if (now >= next) {
+			take_report(0);
+			if (printing) { fwrite(line, 1, lineLen, stderr); }
+			next = (next+intervalUs > now) ? next+intervalUs : now+intervalUs; // A late wakeup does not cause a burst of lines
+			continue;
+		}
+		int n = poll(fds, (listenFd != -1) ? 2 : 1, (int)((next-now+999)/1000));
+		if (n > 0 && fds[0].revents) { break; }
+		if (n > 0 && fds[1].revents) { serve_client(); }
+	}
+	return NULL;
+}
+
+int metrics_start(metrics_report report, unsigned int intervalMs, int print, const char* socketPath)
+{
+	reportFn = report;
+	intervalUs = (uint64_t)(intervalMs ? intervalMs : METRICS_DEFAULT_MS)*1000;
+	printing = print;
+	if (socketPath) {
+		struct sockaddr_un addr = {0};
+		addr.sun_family = AF_UNIX;
+		if (strlen(socketPath) >= sizeof(addr.sun_path)) { return 0; }
+		strcpy(addr.sun_path, socketPath);
+		struct stat st;
+		if (lstat(socketPath, &st) == 0) { // Only a socket nobody answers on any more is ours to replace
+			if (!S_ISSOCK(st.st_mode)) { return 0; }
+			int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+			int live = (probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+			if (probe != -1) { close(probe); }
+			if (live) { return 0; } // Another run is serving it
+			unlink(socketPath); // Left behind by a run that was killed
+		}
+		listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (listenFd == -1) { return 0; }
+		if (bind(listenFd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(listenFd, 16) == -1) { close(listenFd); listenFd = -1; return 0; }
+		strcpy(listenPath, socketPath);
+	}
+	wakeFd = eventfd(0, EFD_NONBLOCK);
+	assert(wakeFd != -1);
+	assert(pthread_create(&reporter, NULL, run_reporter, NULL) == 0);
+	return 1;
+}
+
+void metrics_stop(void)
+{
+	uint64_t one = 1;
+	assert(write(wakeFd, &one, sizeof(one)) == sizeof(one));
+	pthread_join(reporter, NULL);
+	take_report(1);
+	if (printing) { fwrite(line, 1, lineLen, stderr); }
+	if (listenFd != -1) {
+		close(listenFd);
+		unlink(listenPath);
+		listenFd = -1;
+	}
+	close(wakeFd);
+}
@@ -0,0 +1,36 @@
+#ifndef METRICS_H
+#define METRICS_H
+// Live transfer metrics of the Sender and Receiver. Every packet thread keeps plain counters and HDR-style histograms of
+// its own, and copies them into a snapshot under a lock once per report interval, so the packet path never takes a lock
+// or an atomic. A reporting thread asks the program for a JSON line built from the snapshots every interval. It writes
+// the line to stderr (-p) and hands the latest one to every client connecting to a UNIX socket (-x).
+#include <stddef.h>
+#include <stdint.h>
+
+#define HIST_SUB_BITS (5) // 32 buckets per power of two, so every value is recorded within about 3%
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS (32) // Values up to 2^32-1 (us: over an hour), larger ones land in the last bucket
+#define HIST_BUCKETS (HIST_SUB + (HIST_MAX_BITS-HIST_SUB_BITS)*HIST_SUB)
+#define METRICS_LINE (4096) // Longest JSON line
+#define METRICS_DEFAULT_MS (1000) // Report interval when only the socket (-x) was asked for
+#define METRICS_PUBLISHES (4) // Copies of their stats the threads publish per interval, so a report is at most a quarter interval behind
+
+struct hist { // Log-linear histogram: values below HIST_SUB exactly, then HIST_SUB equal buckets per power of two
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min; // Only valid once count is
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+void hist_add(struct hist* h, uint64_t value);
+void hist_merge(struct hist* into, const struct hist* h);
+uint64_t hist_quantile(const struct hist* h, double q); // Value at quantile q (0 to 1), 0 if the histogram is empty
+int hist_json(char* buf, size_t cap, const struct hist* h); // {"count":..,"mean":..,"min":..,"p50":..,..,"max":..}, returns what snprintf does
+int hist_summary(char* buf, size_t cap, const struct hist* h); // The same as one line of text for the final summary
+
+typedef int (*metrics_report)(char* buf, size_t cap, int final); // Writes the program's JSON line (no newline), returns its length
+int metrics_start(metrics_report report, unsigned int intervalMs, int print, const char* socketPath); // Starts the reporting thread. Returns 0 if the socket can't be created, or the path is something other than a stale socket
+void metrics_stop(void); // Prints a last line (final set) if printing, and removes the socket
+
+#endif
@@ -0,0 +1,115 @@
+#include <string.h> // memcpy for unaligned loads
+#include <pthread.h> // pthread_once so the engine is picked exactly once, whichever thread gets here first
+#include "Parity.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h> // SSE2 and AVX2 intrinsics, AVX2 only used when the CPU reports it
+#define HAVE_SIMD_PATH 1
+#endif
+
+static pthread_once_t pickOnce = PTHREAD_ONCE_INIT;
+static enum xor_impl active = XOR_WORD;
+static int haveSse2 = 0, haveAvx2 = 0;
+
+static void pick_engine(void)
+{ // The fastest engine this CPU supports
+#ifdef HAVE_SIMD_PATH
+	__builtin_cpu_init();
+	haveSse2 = __builtin_cpu_supports("sse2");
+	haveAvx2 = __builtin_cpu_supports("avx2");
+	if (haveSse2) { active = XOR_SSE2; }
+	if (haveAvx2) { active = XOR_AVX2; }
+#endif
+}
+
+static void xor_word(uint8_t* dst, const uint8_t* src, size_t len)
+{ // 8 bytes per step, memcpy compiles to plain loads and stores and is fine with unaligned chunks
+	for (; len >= 8; dst += 8, src += 8, len -= 8) {
+		uint64_t a, b;
+		memcpy(&a, dst, sizeof(a));
+		memcpy(&b, src, sizeof(b));
+		a ^= b;
+		memcpy(dst, &a, sizeof(a));
+	}
+	while (len--) { *dst++ ^= *src++; }
+}
+
+#ifdef HAVE_SIMD_PATH
+__attribute__((target("sse2")))
+static void xor_sse2(uint8_t* dst, const uint8_t* src, size_t len)
+{ // 64 bytes per iteration in four independent registers, the tail goes to the word engine
+	for (; len >= 64; dst += 64, src += 64, len -= 64) {
+		__m128i a0 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)dst), _mm_loadu_si128((const __m128i*)src));
+		__m128i a1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst+16)), _mm_loadu_si128((const __m128i*)(src+16)));
+		__m128i a2 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst+32)), _mm_loadu_si128((const __m128i*)(src+32)));
+		__m128i a3 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(dst+48)), _mm_loadu_si128((const __m128i*)(src+48)));
+		_mm_storeu_si128((__m128i*)dst, a0);
+		_mm_storeu_si128((__m128i*)(dst+16), a1);
+		_mm_storeu_si128((__m128i*)(dst+32), a2);
+		_mm_storeu_si128((__m128i*)(dst+48), a3);
+	}
+	for (; len >= 16; dst += 16, src += 16, len -= 16) {
+		_mm_storeu_si128((__m128i*)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i*)dst), _mm_loadu_si128((const __m128i*)src)));
+	}
+	xor_word(dst, src, len);
+}
+
+__attribute__((target("avx2")))
+static void xor_avx2(uint8_t* dst, const uint8_t* src, size_t len)
+{ // Same as SSE2 with 32 byte registers, 128 bytes per iteration
+	for (; len >= 128; dst += 128, src += 128, len -= 128) {
+		__m256i a0 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)dst), _mm256_loadu_si256((const __m256i*)src));
+		__m256i a1 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst+32)), _mm256_loadu_si256((const __m256i*)(src+32)));
+		__m256i a2 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst+64)), _mm256_loadu_si256((const __m256i*)(src+64)));
+		__m256i a3 = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(dst+96)), _mm256_loadu_si256((const __m256i*)(src+96)));
+		_mm256_storeu_si256((__m256i*)dst, a0);
+		_mm256_storeu_si256((__m256i*)(dst+32), a1);
+		_mm256_storeu_si256((__m256i*)(dst+64), a2);
+		_mm256_storeu_si256((__m256i*)(dst+96), a3);
+	}
+	for (; len >= 32; dst += 32, src += 32, len -= 32) {
+		_mm256_storeu_si256((__m256i*)dst, _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)dst), _mm256_loadu_si256((const __m256i*)src)));
+	}
+	xor_sse2(dst, src, len); // AVX2 CPUs all have SSE2
+}
+#endif
+
+void xor_into_with(enum xor_impl impl, uint8_t* dst, const uint8_t* src, size_t len)
+{
+	pthread_once(&pickOnce, pick_engine);
+	switch (impl) {
+#ifdef HAVE_SIMD_PATH
+		case XOR_AVX2: if (haveAvx2) { xor_avx2(dst, src, len); return; } break;
+		case XOR_SSE2: if (haveSse2) { xor_sse2(dst, src, len); return; } break;
+#endif
+		default: break;
+	}
+	xor_word(dst, src, len); // Unsupported engines fall back to the portable one
+}
+
+void xor_into(uint8_t* dst, const uint8_t* src, size_t len)
+{
+	pthread_once(&pickOnce, pick_engine);
+	xor_into_with(active, dst, src, len);
+}
+
+int xor_supported(enum xor_impl impl)
+{
+	pthread_once(&pickOnce, pick_engine);
+	return impl == XOR_WORD || (impl == XOR_SSE2 && haveSse2) || (impl == XOR_AVX2 && haveAvx2);
+}
+
+const char* xor_impl_name(enum xor_impl impl)
+{
+	switch (impl) {
+		case XOR_WORD: return "word";
+		case XOR_SSE2: return "sse2";
+		default: return "avx2";
+	}
+}
+
+enum xor_impl xor_active(void)
+{
+	pthread_once(&pickOnce, pick_engine);
+	return active;
+}
@@ -0,0 +1,18 @@
+#ifndef PARITY_H
+#define PARITY_H
+// XOR kernel for the parity packets of forward error correction (the Sender's -f). The parity of a group of chunks is
+// their XOR, so the Receiver gets any one missing chunk back by XORing the parity with the others. Both sides run every
+// byte of a group through xor_into(), so it is vectorized: AVX2 or SSE2 on x86, 8 bytes at a time everywhere else.
+#include <stddef.h>
+#include <stdint.h>
+
+enum xor_impl { XOR_WORD, XOR_SSE2, XOR_AVX2 }; // Available engines, fastest supported one is picked at runtime
+
+void xor_into(uint8_t* dst, const uint8_t* src, size_t len); // dst ^= src, byte for byte
+
+int xor_supported(enum xor_impl impl); // For the benchmark: can this engine run on this CPU
+void xor_into_with(enum xor_impl impl, uint8_t* dst, const uint8_t* src, size_t len);
+const char* xor_impl_name(enum xor_impl impl);
+enum xor_impl xor_active(void); // Engine xor_into dispatches to
+
+#endif
@@ -3,201 +3,1211 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <string.h>
-#include <poll.h>
-#include "UnreliableChannel.h" // For unreliable sending/receiving. See the associated C and Header file.
-// Make sure to replace the randomization when finally cleaning up. Remove print statements
+#include <unistd.h> // getopt
+#include <fcntl.h> // open/fallocate for the preallocated output file
+#include <limits.h> // IOV_MAX, PATH_MAX
+#include <time.h> // clock_gettime, sessions remember when they last heard from their Sender
+#include <sys/uio.h> // pwritev, runs of chunks are written with one call
+#include <sys/epoll.h> // Every worker waits on its socket, its eviction timer and the stop event at once
+#include <sys/timerfd.h> // Periodic tick for evicting idle sessions
+#include <sys/eventfd.h> // Wakes every worker once the (single) transfer is over
+#include <sys/mman.h> // The received-chunk map is a shared mapping of its file
+#include <sys/stat.h> // fstat for the size of an existing output and map
+#include <pthread.h> // One worker thread per socket (-s)
+#include "UnreliableChannel.h" // Simulated network impairments (-u). See the associated C and Header file.
+#include "Checksum.h" // CRC32 shared with the Sender
+#include "BatchIO.h" // sendmmsg/recvmmsg batching shared with the Sender
+#include "Compression.h" // Compressed chunks (the Sender's -z)
+#include "Parity.h" // Lost chunks rebuilt from parity packets (the Sender's -f)
+#include "Trace.h" // Binary event log, written by a background thread (see TraceDecode)
+#include "Metrics.h" // Counters and latency histograms, reported while the transfers run (-p, -x)
+#include "Tree.h" // A directory arrives packed into one file, it is unpacked once complete
 
-#define HEADER_BYTES 16 // Amount of header bytes
+#define HEADER_BYTES 20 // Amount of header bytes
+#define IP_UDP_BYTES 28 // IPv4 and UDP headers in front of every packet
+#define DEFAULT_MTU 9000 // Largest MTU we take packets for (-m), jumbo frames
+#define MIN_MTU 1500 // The Sender never probes below this, so we must at least take its packets
+#define DEFAULT_WINDOW 64 // Default amount of out of order packets we are willing to hold
+#define FLUSH_RUN 32 // Out of order runs this long are written right away instead of waiting for the gap before them
+#define SYN_BYTES (HEADER_BYTES+36) // File size, stripe index and count, first DATA seq and FIN seq of the stripe, chunk size, file version, then the file name
+#define MAX_NAME 255 // Longest file name a SYN may carry
+#define MAX_STRIPES 64 // Most stripes one transfer may be split into
+#define MAX_WORKERS 64 // Most worker sockets (-s)
+#define STRIPE_BUCKETS 1024 // Hash buckets of every worker's session table
+#define TRANSFER_BUCKETS 1024 // Hash buckets of the transfer table
+#define DEFAULT_IDLE_S 30 // Sessions that have not sent anything for this long are evicted (-i)
+#define TICK_MS 1000 // How often the workers look for idle sessions
+#define BATCHES_PER_WAKEUP 16 // Batches read before the worker checks its timer again, so a flood from one Sender can't starve the others
+#define DEFAULT_ACK_EVERY 16 // In order packets acknowledged by one ACK (-a)
+#define DEFAULT_ACK_DELAY_US 1000 // Longest an in order packet waits for its ACK (-t), the Sender's RTO allows for this much
+#define SACK_BYTES 128 // Most bytes of selective ACK bitmap, covering the 1024 sequence numbers after the cumulative ACK
+#define MAP_PAGE (SACK_BYTES*8) // Most chunks one MAPREQ asks about, the MAP answering it is a bitmap as large as a selective ACK
+#define SIG_BYTES 8 // Signature of a chunk in a MAPREQ: its rolling sum and its CRC32
+#define MAP_MAGIC "RUFSMAP1" // First bytes of a received-chunk map
+#define PARITY_SLOTS 8 // Parity packets a stripe holds on to while their groups miss more than one chunk
 
-static FILE* fptr = NULL; // Pointer to the file we are writing to
-static FILE* write_log = NULL; // Log file
+enum { TYPE_ACK, TYPE_DATA, TYPE_FIN, TYPE_SYN, TYPE_SYNACK, TYPE_PROBE, TYPE_PROBEACK, TYPE_MAPREQ, TYPE_MAP, TYPE_PARITY }; // Packet types
+#define TYPE_MASK (0xFFFF) // The upper bits of the type field are flags
+#define FLAG_ACK_NOW (1u << 16) // The Sender can't send more until it hears back, so ACK this packet without delay
+#define FLAG_COMPRESSED (1u << 17) // The DATA is compressed, it expands to the full chunk at its offset
+#define FLAG_DELTA (1u << 18) // SYN: the Sender will send signatures, so the existing file is kept to compare them against
+#define FLAG_HAS_MAP (1u << 19) // SYNACK: we already have some of the file, the Sender should ask which chunks (MAPREQ)
+#define FLAG_TREE (1u << 20) // SYN: the file is a packed directory tree, it is recreated in the output directory once complete
+#define FLAG_REFUSED (1u << 21) // SYNACK: we will not take the file, the payload says why (REFUSE_*), so the Sender stops retrying. ACK of a FIN: the file could not be stored
+#define FLAG_PENDING (1u << 22) // ACK: the stripe is complete, but the FIN is only ACKed once the file is stored (a tree unpacked)
+enum { REFUSE_NOT_DIR = 1, REFUSE_NAME }; // A tree needs an output directory, the name would leave the output directory
+#define PARITY_COUNT_SHIFT 24 // PARITY: the number of chunks in the group is the top byte of TYPE
+enum { SLOT_EMPTY, SLOT_HELD, SLOT_WRITTEN }; // State of a receive window slot
 
-static uint32_t expectedSeq  = 0; // The expected sequence number of the next arriving packet
-static uint32_t lastSeq  = 0; // The last sequence number we sent back as an ACK
+struct chunk { // Pool entry holding the data of one out of order packet until it is written
+	uint32_t seq; // Sequence number of the data
+	uint32_t len; // Data bytes
+	struct chunk* next; // Next free chunk while in the free list
+	uint8_t data[]; // The transfer's chunk size
+};
 
-static struct sockaddr senderAddr = {0}; // Use this to store the address of the sender so we can send ACKS back to
-static socklen_t addrLen = 0; // Length of address/sockaddr that is returned back from the recvfrom ^
+struct parity { // A parity packet held until its group is missing only one chunk
+	uint32_t first; // First chunk of the group
+	uint32_t count; // Chunks in the group, 0 while the entry is free
+	uint32_t len; // Parity bytes, the length of the group's first (longest) chunk
+	uint8_t data[]; // The XOR of every chunk of the group
+};
 
-static int isLogging = 0;
+struct mapHeader { // Start of a received-chunk map (the output's name plus .map), one bit per chunk (LSB first) follows
+	char magic[8];
+	uint64_t fileSize;
+	uint64_t version; // The Sender's modification time of the file, a map of any other version is started over
+	uint32_t chunk;
+	uint32_t reserved;
+};
 
-static void writeFile(uint8_t* buffer) // Write to the file based on the specified buffer/packet provided
-{
-	uint32_t length = 0;
-	memcpy(&length, buffer+8, sizeof(uint32_t)); // Copy the length from the packet
-	length = ntohl(length); // Convert to native endianness
-	fwrite(buffer+HEADER_BYTES, sizeof(uint8_t), (length-HEADER_BYTES), fptr); // Write from the 16th byte for len-HEADER bytes
-}
+struct transfer { // One file being received, possibly split into several stripes. Keyed by sender IP and session id
+	struct transfer* next; // Hash chain
+	uint32_t ip; // Sender IP (network order)
+	uint32_t session; // Session id from the packet headers
+	uint64_t fileSize; // Size of the file being received, from the SYN
+	uint32_t chunk; // Data bytes per packet, from the SYN. Chunk seq lives at offset seq * chunk of the file
+	uint32_t stripeCount; // Amount of stripes the file was split into
+	uint8_t claimed[MAX_STRIPES]; // Stripes some worker already accepted a SYN for
+	uint32_t stripesDone; // Stripes completely written
+	uint32_t stripes; // Stripe sessions still pointing at this transfer, it is freed once the last one is evicted
+	int fd; // The file we are writing to, every chunk is written at its own offset, so all workers share it
+	int complete; // Every stripe is done
+	int settled; // The complete file got its name or its tree was unpacked (or that failed), so the part file is no longer ours
+	int failed; // Storing the complete file failed, the Sender is told so instead of getting the FIN's ACK
+	struct worker* owner; // Worker of the stripe that completed the file, woken once it is stored
+	char path[PATH_MAX]; // Final name of the file, or the tree's root (output directory)
+	char partPath[PATH_MAX]; // Name while it is incomplete (output directory)
+	int tree; // The file is a packed tree, unpacked into path once complete
+	uint64_t version; // The Sender's modification time of the file, from the SYN
+	int mapFd; // Received-chunk map, it survives restarts of either side so an interrupted transfer resumes where it stopped
+	uint8_t* map; // The map file mapped, every bit is set once its chunk is on disk
+	size_t mapLen;
+	int hasMap; // Some chunks may not have to be sent: the map has bits from an earlier attempt, or there is a file to compare against
+	char mapPath[PATH_MAX];
+	unsigned long rebuilt; // Chunks of the finished stripes rebuilt from parity
+};
+
+struct stripe { // Reassembly state of one stripe of a file. A stripe is one UDP flow, so it is only ever touched by the worker it hashed to
+	struct stripe* next; // Hash chain of the worker's session table
+	uint32_t session; // Session id from the packet headers
+	struct sockaddr_storage addr; // Where the stripe comes from, ACKs go back there
+	socklen_t addrLen;
+	struct transfer* transfer; // The file this stripe is part of
+	uint32_t index; // Stripe number from the SYN
+	uint32_t first; // First DATA sequence number of the stripe
+	uint32_t fin; // Sequence number of the stripe's FIN, one past its last DATA packet
+	uint32_t rcvBase; // Lowest sequence number that has not been received (and written) yet
+	uint32_t finSeq; // Sequence number of the FIN once it arrived
+	uint8_t* rcvState; // SLOT_* for every slot of the receive window, indexed by seq % window
+	uint64_t* missingSince; // When a packet past every missing slot first arrived, 0 for slots that are not missing
+	uint32_t holeScan; // One past the highest sequence number received, slots below it were checked for holes
+	struct chunk** rcvChunks; // Chunk of every SLOT_HELD slot
+	struct chunk* chunkPool; // window chunks of the transfer's chunk size, allocated while the stripe is incomplete, the reassembly buffer never grows
+	struct chunk* freeChunks; // Free list of the pool
+	int done; // The FIN and everything before it has been written. The stripe stays around to re-ACK retransmissions until it goes idle
+	int held; // Completed the file, its FIN is ACKed once the file is stored. Never evicted until then
+	struct stripe* heldNext; // Next stripe in the worker's list of held ones
+	struct stripe* dirtyNext; // Next stripe in the worker's list of stripes the current batch touched
+	int dirty; // Already in that list
+	uint32_t unacked; // In order packets received since the last ACK
+	uint64_t unackedSince; // When the first of them arrived
+	int ackNow; // Something the Sender must hear about right away: a hole, a duplicate or the FIN
+	uint64_t ackDeadline; // When the delayed ACK is due, 0 if none is pending
+	struct stripe* delayedNext; // Next stripe in the worker's list of delayed ACKs
+	int delayed; // Already in that list
+	uint64_t lastSeen; // Monotonic time (us) of the last packet, for idle eviction
+	uint8_t* parityPool; // PARITY_SLOTS struct parity, allocated when the first one is held
+	uint32_t paritiesHeld; // Entries in use
+	unsigned long rebuilt; // Chunks rebuilt from parity instead of resent
+};
+
+struct worker_stats { // What a worker counts. Only its own thread writes it, copies are published for the reports (-p, -x)
+	unsigned long packets; // Packets with a valid checksum
+	unsigned long corrupt;
+	unsigned long duplicates; // DATA and FIN we already had, below the window or in it
+	unsigned long beyondWindow;
+	unsigned long rebuilt; // Chunks rebuilt from parity
+	unsigned long acks;
+	unsigned long long bytes; // New data bytes, rebuilt ones included
+	uint64_t firstData; // When the first of them arrived, 0 before
+	uint64_t lastData; // When the last one did
+	struct hist holeRepair; // From the first packet past a missing chunk until the chunk arrived or was rebuilt (us)
+	struct hist ackDelay; // From the first packet an ACK covers until the ACK went out (us)
+};
+
+struct worker { // One socket bound with SO_REUSEPORT and the thread running its event loop. The kernel hashes every flow to one of them
+	pthread_t thread;
+	int socket;
+	int epfd; // epoll instance watching the socket, timerFd, wakeFd and stopFd
+	int wakeFd; // eventfd written when a file one of our stripes completed is stored
+	int timerFd; // Ticks every TICK_MS for idle eviction
+	struct recv_batch packets; // Where we will store our packets that we have received
+	struct send_batch ackBatch; // ACKs queued while a batch of packets is processed
+	struct stripe* table[STRIPE_BUCKETS]; // Stripe sessions whose SYN arrived on this socket
+	struct stripe* last; // Stripe of the previous packet, consecutive packets almost always share it
+	struct stripe* dirty; // Stripes that may have something to write or ACK after this batch
+	struct stripe* delayedAcks; // Stripes that may have a delayed ACK pending
+	struct stripe* held; // Stripes holding the ACK of their FIN until their file is stored
+	uint64_t now; // Time of the current wakeup
+	uint8_t* block; // A chunk read back from the output to compare with a signature, maxPacket bytes
+	struct worker_stats stats;
+	uint64_t publishAt; // When the next copy of stats is due (-p, -x)
+};
+
+static char* outPath = NULL; // Output file, or output directory
+static int outFd = -1; // The output file when it is not a directory
+static int outIsDir = 0; // Files (and trees) are stored in outPath under the name the Sender gave, always in server mode
 
-static void printPack(uint8_t* packet)
-{ // Print header fields of the packet
-	uint32_t type = 0;
-	uint32_t seqNum = 0;
-	uint32_t length = 0;
-	uint32_t checksum = 0;
+static pthread_mutex_t transferLock = PTHREAD_MUTEX_INITIALIZER; // Guards the transfer table and every transfer's shared fields
+static struct transfer* transfers[TRANSFER_BUCKETS]; // Transfers in progress (or recently completed), keyed by sender IP and session id
+static unsigned int liveTransfers = 0; // Entries in the table
+static int finished = 0; // The single transfer is done, workers exit
+static int stopFd = -1; // eventfd written when finished is set
 
-	memcpy(&type, packet, sizeof(uint32_t));
-	memcpy(&seqNum, packet+4, sizeof(uint32_t));
-	memcpy(&length, packet+8, sizeof(uint32_t));
-	memcpy(&checksum, packet+12, sizeof(uint32_t));
+static int serverMode = 0; // Keep running and receive any amount of files concurrently into the output directory (-d)
+static uint64_t idleUs = DEFAULT_IDLE_S*1000000ULL; // Sessions silent for this long are evicted (-i)
+static uint32_t maxPacket = DEFAULT_MTU-IP_UDP_BYTES; // Largest packet we accept (-m sets the MTU), larger probes go unanswered
+static uint32_t window = DEFAULT_WINDOW; // Size of the receive window of every stripe (-w), should be at least the Sender's window
+static unsigned int numWorkers = 1; // Amount of SO_REUSEPORT sockets and threads (-s)
+static struct worker* workers = NULL;
 
-	char* typeStr = ntohl(type) ? ((ntohl(type)==1) ? "DATA" : "FIN") : "ACK";
+static int isLogging = 0; // Record events in the log file (see Trace.h)
+
+static int batched = 1; // Use recvmmsg/sendmmsg and GRO (-b turns it off)
+static uint32_t ackEvery = DEFAULT_ACK_EVERY; // In order packets per ACK (-a)
+static uint64_t ackDelayUs = DEFAULT_ACK_DELAY_US; // Delayed ACK timeout (-t)
+static unsigned int statsEvery = 0; // Report interval (ms) of the metrics, 0 without -p and -x
+static int statsPrint = 0; // Print every report to stderr (-p)
+static char* statsSocket = NULL; // Serve the latest report on this UNIX socket (-x)
+static struct worker_stats* published = NULL; // The latest copy of every worker's stats, for the reporting thread
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; // Guards published
+static uint64_t startedAt = 0; // Monotonic time (us) the Receiver started
+
+static uint64_t now_us(void)
+{ // Monotonic clock, precise enough for the delayed ACK timer. Logged events are stamped with the latest reading
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	if (isLogging) { trace_clock(now); }
+	return now;
+}
+
+static uint32_t hashKey(const void* key, size_t len, uint32_t session)
+{ // FNV-1a over the address bytes and the session id
+	const uint8_t* p = key;
+	uint32_t h = 2166136261u ^ session;
+	for (size_t i = 0; i < len; i++) { h = (h ^ p[i]) * 16777619u; }
+	return h ^ (h >> 16);
+}
 
-	if (isLogging) { fprintf(write_log, "type=%s; seqNum=%u; length=%u; checksum=%x\n\n", typeStr, ntohl(seqNum), ntohl(length), ntohl(checksum)); }
+static int haveChunk(struct transfer* t, uint32_t seq)
+{ // Workers share the map, and a byte can hold the bits of two stripes
+	return (__atomic_load_n(&t->map[sizeof(struct mapHeader)+seq/8], __ATOMIC_RELAXED) >> (seq%8)) & 1;
 }
 
-static unsigned int crc32(uint8_t* message, int len)
-{ // stackoverflow.com/questions/21001659/crc32-algorithm-implementation-in-c-without-a-look-up-table-and-with-a-public-li
-	unsigned int byte, crc, mask;
-	crc = 0xFFFFFFFF;
+static void setHave(struct transfer* t, uint32_t seq)
+{
+	__atomic_fetch_or(&t->map[sizeof(struct mapHeader)+seq/8], (uint8_t)(1 << (seq%8)), __ATOMIC_RELAXED);
+}
 
-	for(int i = 0; i < len; i++) {
-		byte = message[i]; // Get next byte
-		crc = crc ^ byte;
-		for(int j = 7; j >= 0; j--) { // Do eight times
-			mask = -(crc & 1);
-			crc = (crc >> 1) ^ (0xEDB88320 & mask);
+static void writeRun(struct stripe* sp, uint32_t first, uint32_t end) // Write the held chunks first..end-1, which are contiguous in the file
+{
+	struct iovec iov[IOV_MAX];
+	uint32_t seq = first;
+	while (seq < end) { // One pwritev per IOV_MAX chunks
+		int n = 0;
+		size_t total = 0;
+		uint32_t runStart = seq;
+		for (; seq < end && n < IOV_MAX; seq++, n++) {
+			struct chunk* c = sp->rcvChunks[seq % window];
+			iov[n].iov_base = c->data;
+			iov[n].iov_len = c->len;
+			total += c->len;
 		}
+		ssize_t written = pwritev(sp->transfer->fd, iov, n, (off_t)runStart*sp->transfer->chunk);
+		assert(written == (ssize_t)total); // Assert the disk took all of it
+		for (uint32_t s = runStart; s < seq; s++) { setHave(sp->transfer, s); } // Only after the data, a restart must never trust a chunk that is not there
+	}
+	for (seq = first; seq < end; seq++) { // Give the chunks back to the pool
+		struct chunk* c = sp->rcvChunks[seq % window];
+		c->next = sp->freeChunks;
+		sp->freeChunks = c;
+		sp->rcvChunks[seq % window] = NULL;
+		sp->rcvState[seq % window] = SLOT_WRITTEN;
 	}
-	return ~crc;
 }
 
-static void generic_send(int socket, uint32_t seqNum) // Here we will create the ACK packet
-{
-	uint32_t type = 0; // The type of ACK is 0, DATA is 1
-	uint32_t length = 16; // There is no data/content to be sent, we only need the header bytes, hence 16 length
+static void slideWindow(struct stripe* sp)
+{ // Chunks we already had (an earlier attempt, or delta sync) are never sent, so they count as written
+	for (;;) {
+		uint8_t* state = &sp->rcvState[sp->rcvBase % window];
+		if (*state == SLOT_WRITTEN) { *state = SLOT_EMPTY; }
+		else if (*state != SLOT_EMPTY || sp->rcvBase >= sp->fin || !haveChunk(sp->transfer, sp->rcvBase)) { break; }
+		sp->rcvBase+=1;
+	}
+}
 
-	uint8_t* message = calloc(12, sizeof(uint8_t)); // We need to create a checksum with the other 3 headers
+static void flushChunks(struct stripe* sp) // Write what can be written and slide the window past everything written
+{ // The run at the front of the window is final, so it is always written. A run further ahead is written once it is
+	// FLUSH_RUN chunks long, so one missing packet does not hold back the disk, while short runs wait to be merged into bigger writes.
+	uint32_t seq = sp->rcvBase;
+	while (seq < sp->rcvBase+window) {
+		if (sp->rcvState[seq % window] != SLOT_HELD) { seq+=1; continue; }
+		uint32_t end = seq;
+		while (end < sp->rcvBase+window && sp->rcvState[end % window] == SLOT_HELD) { end+=1; }
+		if (seq == sp->rcvBase || end-seq >= FLUSH_RUN) { writeRun(sp, seq, end); }
+		slideWindow(sp);
+		seq = (end > sp->rcvBase) ? end : sp->rcvBase;
+	}
+	slideWindow(sp); // The FIN (or a run written earlier) may be at the front without anything to write
+}
+
+static void freeWindow(struct stripe* sp)
+{ // The reassembly buffer is only needed until the stripe is done
+	free(sp->chunkPool);
+	free(sp->rcvChunks);
+	free(sp->rcvState);
+	free(sp->missingSince);
+	free(sp->parityPool);
+	sp->parityPool = NULL;
+	sp->paritiesHeld = 0;
+	sp->chunkPool = NULL;
+	sp->rcvChunks = NULL;
+	sp->rcvState = NULL;
+	sp->missingSince = NULL;
+}
 
-	memcpy(message, &type, sizeof(uint32_t)); // First the type, copy it to the message
-	memcpy(message+4, &seqNum, sizeof(uint32_t)); // Then copy the seqnum
-	memcpy(message+8, &length, sizeof(uint32_t)); // Finally copy the length
+static void generic_send(struct worker* w, uint32_t session, struct sockaddr* to, socklen_t toLen, uint32_t type, uint32_t seqNum, const uint8_t* data, uint32_t bytes) // Here we will create the ACK (or SYNACK, PROBEACK) packet
+{	uint32_t length = HEADER_BYTES+bytes; // The only data an ACK carries is its selective ACK bitmap
+	// The session id is echoed so the Sender can tell its ACKs apart
 
-	unsigned int checksum = crc32(message, 12); // Acquire the checksum
+	uint32_t crc = crc32_begin(); // We need to create a checksum with the other 4 headers
+	crc = crc32_update(crc, &type, sizeof(uint32_t)); // First the type
+	crc = crc32_update(crc, &seqNum, sizeof(uint32_t)); // Then the seqnum
+	crc = crc32_update(crc, &length, sizeof(uint32_t)); // Then the length
+	crc = crc32_update(crc, &session, sizeof(uint32_t)); // Then the session
+	crc = crc32_update(crc, data, bytes); // Finally the bitmap
+	uint32_t checksum = crc32_end(crc); // Acquire the checksum
 
-	uint8_t* packet = calloc(16, sizeof(uint8_t)); // Now we finally have to make the packet
+	uint8_t packet[HEADER_BYTES+SACK_BYTES]; // An ACK is small, so it lives on the stack
 
 	type = htonl(type); // Convert all these sensitive integers to network order. Endianness could affect them
 	seqNum = htonl(seqNum);
 	length = htonl(length);
 	checksum = htonl(checksum); // The checksum as well
+	session = htonl(session);
 
 	memcpy(packet, &type, sizeof(uint32_t)); // Finally copy everything over to the page
 	memcpy(packet+4, &seqNum, sizeof(uint32_t)); // Each field is 4 bytes
 	memcpy(packet+8, &length, sizeof(uint32_t));
 	memcpy(packet+12, &checksum, sizeof(uint32_t));
-	
-	if (isLogging) { fprintf(write_log, "Packet sent; "); printPack(packet); }
-	//send_packet(socket, packet, 16, &senderAddr, addrLen);  // For unreliable sending. Check UnreliableChannel
-	sendto(socket, packet, 16, 0, &senderAddr, addrLen); // Finally send the packet
-	free(message); // We no longer need the message or the packet
-	free(packet); // Free them
+	memcpy(packet+16, &session, sizeof(uint32_t));
+	if (bytes) { memcpy(packet+HEADER_BYTES, data, bytes); }
+
+	if (isLogging) { trace_packet(TRACE_SENT, packet, 0); }
+	batch_send_copy(&w->ackBatch, packet, HEADER_BYTES+bytes, to, toLen); // Sent together with the other ACKs of this batch
+}
+
+static void sendAck(struct worker* w, struct stripe* sp)
+{ // Cumulative ACK of everything below rcvBase, plus a bitmap of what arrived after the first hole:
+	// bit i (LSB first) covers rcvBase+1+i. One ACK tells the Sender about every packet in the window, holes included
+	uint8_t sack[SACK_BYTES];
+	uint32_t bytes = 0;
+	memset(sack, 0, sizeof(sack));
+	if (!sp->done) { // A finished stripe has no window left, the cumulative ACK covers all of it
+		uint32_t span = (window-1 < SACK_BYTES*8) ? window-1 : SACK_BYTES*8;
+		for (uint32_t i = 0; i < span; i++) {
+			uint32_t seq = sp->rcvBase+1+i;
+			if (sp->rcvState[seq % window] == SLOT_EMPTY && (seq >= sp->fin || !haveChunk(sp->transfer, seq))) { continue; }
+			sack[i/8] |= 1 << (i%8);
+			bytes = i/8+1; // Trailing zero bytes are not sent
+		}
+	}
+	uint32_t type = TYPE_ACK, seq = sp->rcvBase;
+	if (sp->held || (sp->done && __atomic_load_n(&sp->transfer->failed, __ATOMIC_RELAXED))) { // Everything but the FIN: the file is not stored yet, or could not be
+		seq = sp->finSeq;
+		type |= sp->held ? FLAG_PENDING : FLAG_REFUSED;
+	}
+	generic_send(w, sp->session, (struct sockaddr*)&sp->addr, sp->addrLen, type, seq, sack, bytes);
+	w->stats.acks+=1;
+	if (sp->unacked) { hist_add(&w->stats.ackDelay, w->now - sp->unackedSince); }
+	sp->unacked = 0;
+	sp->ackNow = 0;
+	sp->ackDeadline = 0;
 }
 
-static int checkChecksum(uint8_t* buffer, unsigned int* calc_checksum)
+static int checkChecksum(uint8_t* buffer, size_t received, unsigned int* calc_checksum)
 {
-	uint32_t type = 0; // The checksum will only consist of 12 bytes
-	uint32_t seqNum = 0; // Type | SeqNum | Length, plus the actual
+	uint32_t type = 0; // The checksum covers the other 4 header fields
+	uint32_t seqNum = 0; // Type | SeqNum | Length | Session, plus the actual
 	uint32_t length = 0; // data or content we're sending
 	uint32_t checksum = 0; // checksum from packet
+	uint32_t session = 0;
 
 	memcpy(&type, buffer, sizeof(uint32_t)); // Get the type from the buffer
 	memcpy(&seqNum, buffer+4, sizeof(uint32_t)); // Get the seqNum from the buffer
 	memcpy(&length, buffer+8, sizeof(uint32_t)); // Get the length from the buffer
 	memcpy(&checksum, buffer+12, sizeof(uint32_t)); // Copy the checksum from the packet so we can compare it later
+	memcpy(&session, buffer+16, sizeof(uint32_t)); // Get the session id from the buffer
 
 	type = ntohl(type); // These bytes are in network order, so convert them to native endianness
 	seqNum = ntohl(seqNum);
 	length = ntohl(length);
+	session = ntohl(session);
+
+	// A corrupt length could point past what actually arrived, so never checksum more than the datagram
+	uint32_t data_len = (length >= HEADER_BYTES && length <= received) ? (length-HEADER_BYTES) : (received-HEADER_BYTES);
+
+	uint32_t crc = crc32_begin(); // The fields and the data are fed straight from the packet, nothing is copied
+	crc = crc32_update(crc, &type, sizeof(uint32_t));
+	crc = crc32_update(crc, &seqNum, sizeof(uint32_t));
+	crc = crc32_update(crc, &length, sizeof(uint32_t));
+	crc = crc32_update(crc, &session, sizeof(uint32_t));
+	crc = crc32_update(crc, buffer+HEADER_BYTES, data_len);
+	crc = crc32_end(crc);
+	*calc_checksum = crc;
+	return (crc == ntohl(checksum)); // Recall the checksum was converted to network byte order, so convert back b4 comparing
+}
 
-	uint32_t data_len = (length <= 1472) ? (length-HEADER_BYTES) : 1456; // Copy the correct number of bytes
+static uint32_t get32(uint8_t* p) { uint32_t v = 0; memcpy(&v, p, sizeof(uint32_t)); return ntohl(v); }
 
-	uint8_t* data = NULL;
-	if(data_len) { // if not finality
-		data = calloc(data_len, sizeof(uint8_t)); // Get the actual data/content
-		memcpy(data, buffer+16, data_len); // Data starts at the 16th byte and has len subtracted from Header bytes
+static uint32_t senderIP(struct sockaddr* from) { return ((struct sockaddr_in*)from)->sin_addr.s_addr; }
+
+static struct stripe* findStripe(struct worker* w, uint32_t session, struct sockaddr* from, socklen_t fromLen)
+{ // The stripe session a packet belongs to, by the address it came from and its session id
+	struct stripe* sp = w->last;
+	if (sp && sp->session == session && sp->addrLen == fromLen && !memcmp(&sp->addr, from, fromLen)) { return sp; }
+	for (sp = w->table[hashKey(from, fromLen, session) % STRIPE_BUCKETS]; sp; sp = sp->next) {
+		if (sp->session == session && sp->addrLen == fromLen && !memcmp(&sp->addr, from, fromLen)) { w->last = sp; return sp; }
 	}
+	return NULL;
+}
 
-	uint8_t* message = calloc(data_len+12, sizeof(uint8_t)); // Finally, we need to assemble all our fields
-	memcpy(message, &type, sizeof(uint32_t)); // For the final checksum to be calculated. First insert the type
-	memcpy(message+4, &seqNum, sizeof(uint32_t)); // Then the seq number
-	memcpy(message+8, &length, sizeof(uint32_t)); // Then the length
-	if(data_len) { memcpy(message+12, data, data_len); } // Finally the data
+static int validName(const char* name)
+{ // The name comes off the wire, so it must not be able to leave the output directory
+	return name[0] && !strchr(name, '/') && strcmp(name, ".") && strcmp(name, "..");
+}
 
-	unsigned int crc = crc32(message, data_len+12); // Calculate the checksum from the bytes
-	*calc_checksum = crc;
-	free(data); // We no longer need the data or the message
-	free(message); // So free them
-	return (crc == ntohl(checksum)); // Recall the checksum was converted to network byte order, so convert back b4 comparing
+static int openMap(struct transfer* t, const char* dataPath, int fresh)
+{ // Map the received-chunk map of dataPath. It is started over unless it belongs to this version of the file in chunks of
+	// this size, and always for a new output. Returns 1 if it already has chunks, 0 if not, -1 if it can't be created
+	uint64_t chunks = (t->fileSize+t->chunk-1)/t->chunk;
+	struct mapHeader want;
+	memset(&want, 0, sizeof(want));
+	memcpy(want.magic, MAP_MAGIC, sizeof(want.magic));
+	want.fileSize = t->fileSize;
+	want.version = t->version;
+	want.chunk = t->chunk;
+
+	if (snprintf(t->mapPath, sizeof(t->mapPath), "%s.map", dataPath) >= (int)sizeof(t->mapPath)) { return -1; }
+	t->mapFd = open(t->mapPath, O_RDWR | O_CREAT, 0644);
+	if (t->mapFd == -1) { return -1; }
+	t->mapLen = sizeof(struct mapHeader) + (chunks+7)/8;
+	struct mapHeader found;
+	struct stat st;
+	int valid = (!fresh && fstat(t->mapFd, &st) == 0 && (size_t)st.st_size == t->mapLen &&
+		pread(t->mapFd, &found, sizeof(found), 0) == sizeof(found) && !memcmp(&found, &want, sizeof(want)));
+	if (!valid && (ftruncate(t->mapFd, 0) == -1 || ftruncate(t->mapFd, t->mapLen) == -1 || pwrite(t->mapFd, &want, sizeof(want), 0) != sizeof(want))) {
+		close(t->mapFd);
+		return -1;
+	}
+	t->map = mmap(NULL, t->mapLen, PROT_READ | PROT_WRITE, MAP_SHARED, t->mapFd, 0); // Bits set by the workers reach the file even if we are killed
+	if (t->map == MAP_FAILED) { close(t->mapFd); return -1; }
+	if (!valid) { return 0; }
+	for (size_t i = sizeof(struct mapHeader); i < t->mapLen; i++) { if (t->map[i]) { return 1; } }
+	return 0;
+}
+
+static void closeMap(struct transfer* t, int remove)
+{ // The map is removed once the file is complete, and kept for the next attempt otherwise
+	munmap(t->map, t->mapLen);
+	close(t->mapFd);
+	if (remove) { unlink(t->mapPath); }
+	t->map = NULL;
 }
 
-static int checkSeq(int socket, uint8_t* buffer) // Check the sequence number of the arriving packet.
-{ // In circumstances when an ACK sent to the Sender is lost, the Sender will retransmit the same packet thinking the Receiver didn't receive it
-	// even though the Receiver might be on the next expected sequence number. So, we will send the lastAck to the Sender
-	// in this scenario to satisfy the Sender. Only then will we continue.
-
-	// Get the type,seq from the buffer/packet and convert to native endian
-	uint32_t type = 0; memcpy(&type, buffer, sizeof(uint32_t)); type = ntohl(type); 
-	uint32_t seq = 0; memcpy(&seq, buffer+4, sizeof(uint32_t)); seq = ntohl(seq); 
-
-	if (seq == expectedSeq) {
-		if (isLogging) { fprintf(write_log, "Provided seqNum and expected seqNum match; Sending ACK\n"); }
-		generic_send(socket, expectedSeq); // If our current received seq matches the expectedSeq then we can safely send
-		if(type==2) { return 0; }
-		writeFile(buffer); // We can also write the packet to the file 
-		lastSeq = expectedSeq; // Since we've ACKed this file, set it to the lastACK
-		expectedSeq+=1; // And increase the expected ACK to the next ACK in sequence we're expecting
-	} else { 
-		if (isLogging) { 
-			fprintf(write_log, "Mismatch between provided and expected seqNum (Seq: %u, Expected Seq: %u)\n", seq, expectedSeq);
-			fprintf(write_log, "Resending ACK for provided seqNum=%u...\n\n", seq);
+static void cloneFile(const char* from, int to)
+{ // Start a part file as a copy of the previous version of the file, so delta sync finds the chunks that did not change.
+	// Reflinked on filesystems that can, a local copy otherwise, either way far cheaper than sending it
+	int fd = open(from, O_RDONLY);
+	if (fd == -1) { return; } // There is no previous version
+	loff_t in = 0, out = 0;
+	while (copy_file_range(fd, &in, to, &out, 1 << 30, 0) > 0) {}
+	close(fd);
+}
+
+static struct transfer* openTransfer(uint32_t ip, uint32_t session, uint64_t size, uint32_t count, uint32_t chunk, uint64_t version, int delta, int tree, const char* name)
+{ // Find the transfer a stripe belongs to, or set up the file for a new one. Called with transferLock held
+	uint32_t bucket = hashKey(&ip, sizeof(ip), session) % TRANSFER_BUCKETS;
+	struct transfer* t;
+	for (t = transfers[bucket]; t; t = t->next) {
+		if (t->ip == ip && t->session == session) { return (t->fileSize == size && t->stripeCount == count && t->chunk == chunk) ? t : NULL; }
+	}
+	if (!serverMode && liveTransfers) { return NULL; } // Only one file at a time without -d
+
+	t = calloc(1, sizeof(struct transfer));
+	assert(t);
+	t->ip = ip;
+	t->session = session;
+	t->fileSize = size;
+	t->stripeCount = count;
+	t->chunk = chunk;
+	t->version = version;
+	t->tree = tree;
+	int fresh = 0; // No earlier attempt left anything behind
+	if (outIsDir) { // Written under a temporary name and renamed once complete, so a reader never sees half a file
+		snprintf(t->path, sizeof(t->path), "%s/%s", outPath, name);
+		snprintf(t->partPath, sizeof(t->partPath), "%s/.%s.part", outPath, name); // Not per session, a restarted Sender picks it up
+		for (uint32_t b = 0; b < TRANSFER_BUCKETS; b++) { // Two Senders can't write the same part file
+			for (struct transfer* o = transfers[b]; o; o = o->next) { if (!o->settled && !strcmp(o->partPath, t->partPath)) { free(t); return NULL; } }
 		}
-		generic_send(socket, lastSeq); 
-	} // If it doesn't match for the reasons listed above, then send another ACK to satisfy Sender
+		fresh = (access(t->partPath, F_OK) != 0);
+		t->fd = open(t->partPath, O_RDWR | O_CREAT, 0644);
+		if (t->fd == -1) { free(t); return NULL; }
+		if (fresh && delta && !tree) { cloneFile(t->path, t->fd); } // A tree is only resumed, its old packed stream is gone
+	} else {
+		t->fd = outFd; // Kept as it is, an earlier attempt (or an older version, for delta sync) may already hold most of it
+	}
+	struct stat st;
+	assert(fstat(t->fd, &st) == 0);
+	int basis = (st.st_size > 0); // Something to compare signatures against
+	if (!outIsDir) { fresh = !basis; }
+	// Reserve the whole file up front, so positional writes never extend it and the blocks end up contiguous. What is
+	// already there stays, anything past the new size goes
+	assert(ftruncate(t->fd, size) == 0);
+	if (size) { fallocate(t->fd, 0, 0, size); } // Filesystems without fallocate just allocate as they go
+	int resumed = openMap(t, outIsDir ? t->partPath : outPath, fresh);
+	if (resumed == -1) {
+		if (outIsDir) { close(t->fd); }
+		free(t);
+		return NULL;
+	}
+	t->hasMap = resumed || (delta && basis);
+	t->next = transfers[bucket];
+	transfers[bucket] = t;
+	liveTransfers+=1;
+	if (isLogging) { trace_event(resumed ? TRACE_SYN_RESUMED : TRACE_SYN, size >> 32, count, chunk, session, size & 0xFFFFFFFF); }
+	return t;
+}
+
+static void closeTransfer(struct transfer* t)
+{ // The last stripe session of the transfer is gone. Called with transferLock held
+	struct transfer** link = &transfers[hashKey(&t->ip, sizeof(t->ip), t->session) % TRANSFER_BUCKETS];
+	while (*link != t) { link = &(*link)->next; }
+	*link = t->next;
+	liveTransfers-=1;
+	if (!t->complete) { // The Sender went away. What we have stays, with its map, for the next attempt to resume from
+		closeMap(t, 0);
+		if (outIsDir) {
+			close(t->fd);
+			printf("Session %08x evicted before it completed, %s is kept for resuming\n", t->session, t->partPath);
+		}
+	}
+	free(t);
+}
+
+static int stripeDone(struct stripe* sp)
+{ // Count a finished stripe, the file is complete once all of its stripes are. Returns 1 if this completed it
+	struct transfer* t = sp->transfer;
+	sp->done = 1;
+	freeWindow(sp);
+	pthread_mutex_lock(&transferLock);
+	t->stripesDone+=1;
+	t->rebuilt += sp->rebuilt;
+	int complete = (t->stripesDone == t->stripeCount);
+	if (complete) {
+		t->complete = 1;
+		closeMap(t, 1); // Nothing left to resume
+	}
+	pthread_mutex_unlock(&transferLock);
+	return complete;
+}
+
+static int storeFile(struct transfer* t)
+{ // Give the complete file its name, or unpack the tree it holds. Returns 0 if that failed
+	int ok = 1;
+	if (!outIsDir) { printf("Successfully received all packets\n"); }
+	else if (!t->tree) {
+		close(t->fd);
+		ok = (rename(t->partPath, t->path) == 0);
+		if (ok) { printf("Successfully received %s\n", t->path); }
+		else { printf("Could not rename %s to %s\n", t->partPath, t->path); }
+	} else {
+		unsigned long files = 0;
+		ok = tree_unpack(t->fd, t->fileSize, t->path, &files);
+		close(t->fd);
+		if (ok) { unlink(t->partPath); printf("Successfully received %s (%lu files)\n", t->path, files); }
+		else { printf("Could not unpack %s, the packed tree is kept as %s\n", t->path, t->partPath); }
+	}
+	if (t->rebuilt) { printf("Chunks rebuilt from parity: %lu\n", t->rebuilt); }
+	return ok;
+}
+
+static void finishAll(void)
+{ // Without -d the one file is stored, every worker exits
+	if (serverMode) { return; }
+	__atomic_store_n(&finished, 1, __ATOMIC_RELEASE);
+	uint64_t one = 1;
+	assert(write(stopFd, &one, sizeof(one)) == sizeof(one));
+}
+
+static void settle(struct transfer* t, int ok)
+{ // The file is stored (or not). A tree's owner is woken to ACK the FIN, under the lock so its wakeFd is written before
+	// it can see settled, finish and close it
+	pthread_mutex_lock(&transferLock);
+	__atomic_store_n(&t->failed, !ok, __ATOMIC_RELAXED); // Read by the workers of the other stripes when they re-ACK
+	t->settled = 1; // Another Sender of the same name may start a new part file now
+	uint64_t one = 1;
+	if (t->owner) { assert(write(t->owner->wakeFd, &one, sizeof(one)) == sizeof(one)); }
+	pthread_mutex_unlock(&transferLock);
+}
+
+static void* runStore(void* arg)
+{ // Thread body: unpack a tree away from the workers, so their other sessions never wait for it
+	struct transfer* t = arg;
+	settle(t, storeFile(t));
+	return NULL;
+}
+
+static void storeTransfer(struct worker* w, struct stripe* sp)
+{ // sp completed its file, store it before the FIN is ACKed, so the Sender only succeeds once the file exists. A file
+	// only needs a rename. A tree is unpacked on a thread of its own while sp holds the ACK (pending ACKs tell the Sender
+	// to wait), and the transfer stays until sp is evicted, which it is not until then
+	struct transfer* t = sp->transfer;
+	if (!t->tree) {
+		settle(t, storeFile(t));
+		finishAll();
+		return;
+	}
+	t->owner = w;
+	sp->held = 1;
+	sp->heldNext = w->held;
+	w->held = sp;
+	pthread_t thread;
+	assert(pthread_create(&thread, NULL, runStore, t) == 0);
+	pthread_detach(thread);
+}
+
+static void releaseHeld(struct worker* w)
+{ // ACK the FIN of every held stripe whose tree is stored
+	for (struct stripe** link = &w->held; *link; ) {
+		struct stripe* sp = *link;
+		pthread_mutex_lock(&transferLock);
+		int settled = sp->transfer->settled;
+		pthread_mutex_unlock(&transferLock);
+		if (!settled) { link = &sp->heldNext; continue; }
+		*link = sp->heldNext;
+		sp->held = 0;
+		sendAck(w, sp);
+		finishAll();
+	}
+}
+
+static void handleSyn(struct worker* w, uint8_t* buffer, size_t received, struct sockaddr* from, socklen_t fromLen)
+{ // The SYN announces the file (size and name) before any DATA, and which stripe of the file this flow carries
+	uint32_t session = get32(buffer+16);
+	struct stripe* sp = findStripe(w, session, from, fromLen);
+	if (sp) { generic_send(w, session, from, fromLen, TYPE_SYNACK | (sp->transfer->hasMap ? FLAG_HAS_MAP : 0), sp->first, NULL, 0); return; } // A repeated SYN only means our SYNACK was lost
+	if (received < SYN_BYTES || received > SYN_BYTES+MAX_NAME) { return; }
+
+	uint64_t size = ((uint64_t)get32(buffer+HEADER_BYTES) << 32) | get32(buffer+HEADER_BYTES+4);
+	uint32_t index = get32(buffer+HEADER_BYTES+8);
+	uint32_t count = get32(buffer+HEADER_BYTES+12);
+	uint32_t first = get32(buffer+HEADER_BYTES+16);
+	uint32_t fin = get32(buffer+HEADER_BYTES+20);
+	uint32_t chunk = get32(buffer+HEADER_BYTES+24);
+	uint64_t version = ((uint64_t)get32(buffer+HEADER_BYTES+28) << 32) | get32(buffer+HEADER_BYTES+32);
+	int delta = (get32(buffer) & FLAG_DELTA) != 0;
+	int tree = (get32(buffer) & FLAG_TREE) != 0;
+	char name[MAX_NAME+1];
+	size_t nameLen = received-SYN_BYTES;
+	memcpy(name, buffer+SYN_BYTES, nameLen);
+	name[nameLen] = '\0';
+	if (!chunk || chunk > maxPacket-HEADER_BYTES) { return; } // Packets we could not take, the Sender's probes should have found that out
+	if (!count || count > MAX_STRIPES || index >= count || first > fin || (uint64_t)first*chunk > size) { return; }
+	if (memchr(name, '\0', nameLen)) { return; }
+	uint32_t refusal = outIsDir ? (validName(name) ? 0 : REFUSE_NAME) : (tree ? REFUSE_NOT_DIR : 0);
+	if (refusal) { // Answered rather than dropped, so the Sender can say why instead of retrying until it gives up
+		uint32_t reason = htonl(refusal);
+		if (refusal == REFUSE_NOT_DIR) { printf("Refused the directory %s: the output %s is not a directory\n", name, outPath); }
+		else { printf("Refused the file %s: not a valid name in the output directory\n", name); }
+		fflush(stdout); // We keep waiting for a file we can take, the line should not sit in the buffer until then
+		generic_send(w, session, from, fromLen, TYPE_SYNACK | FLAG_REFUSED, first, (uint8_t*)&reason, sizeof(reason));
+		return;
+	}
+
+	pthread_mutex_lock(&transferLock);
+	struct transfer* t = openTransfer(senderIP(from), session, size, count, chunk, version, delta, tree, name);
+	int ok = (t && !t->claimed[index]); // Another file while one is running (without -d), a tree without an output directory, or a stripe we already have
+	if (ok) { t->claimed[index] = 1; t->stripes+=1; }
+	pthread_mutex_unlock(&transferLock);
+	if (!ok) { return; }
+
+	sp = calloc(1, sizeof(struct stripe));
+	assert(sp);
+	memcpy(&sp->addr, from, (fromLen < sizeof(sp->addr)) ? fromLen : sizeof(sp->addr));
+	sp->addrLen = fromLen;
+	sp->session = session;
+	sp->transfer = t;
+	sp->index = index;
+	sp->first = first;
+	sp->fin = fin;
+	sp->rcvBase = first;
+	sp->finSeq = UINT32_MAX;
+	sp->lastSeen = w->now;
+	sp->rcvState = calloc(window, sizeof(uint8_t)); // Reassembly state for the receive window
+	sp->missingSince = calloc(window, sizeof(uint64_t));
+	sp->holeScan = first;
+	sp->rcvChunks = calloc(window, sizeof(struct chunk*));
+	size_t stride = (sizeof(struct chunk)+chunk+7) & ~(size_t)7; // Keeps every chunk aligned
+	sp->chunkPool = malloc((size_t)window*stride); // Sized from the negotiated chunk, not the largest one we accept
+	assert(sp->rcvState && sp->missingSince && sp->rcvChunks && sp->chunkPool);
+	for (uint32_t i = 0; i < window; i++) {
+		struct chunk* c = (struct chunk*)((uint8_t*)sp->chunkPool + i*stride);
+		c->next = sp->freeChunks;
+		sp->freeChunks = c;
+	}
+
+	uint32_t bucket = hashKey(from, fromLen, session) % STRIPE_BUCKETS;
+	sp->next = w->table[bucket];
+	w->table[bucket] = sp;
+	w->last = sp;
+	slideWindow(sp); // Past the chunks an earlier attempt already wrote
+	generic_send(w, session, from, fromLen, TYPE_SYNACK | (t->hasMap ? FLAG_HAS_MAP : 0), first, NULL, 0);
+}
+
+static int sameChunk(struct worker* w, struct transfer* t, uint32_t seq, uint8_t* sig)
+{ // Does the file already hold the Sender's chunk seq, going by its signature. The cheap rolling sum rules out most chunks
+	uint64_t offset = (uint64_t)seq*t->chunk;
+	size_t len = (t->fileSize-offset < t->chunk) ? t->fileSize-offset : t->chunk;
+	if (pread(t->fd, w->block, len, offset) != (ssize_t)len) { return 0; }
+	return rolling_sum(w->block, len) == get32(sig) && crc32(w->block, len) == get32(sig+4);
+}
+
+static void handleMapReq(struct worker* w, uint8_t* buffer, size_t received, struct sockaddr* from, socklen_t fromLen)
+{ // Which chunks of a page of the stripe we already have: written by an earlier attempt, or, when the request carries the
+	// Sender's signatures, equal to what the file already holds (delta sync). Matches are recorded in the map, so the
+	// answer to a resent request is the same. Payload: the number of chunks, then optionally one signature per chunk
+	uint32_t session = get32(buffer+16);
+	struct stripe* sp = findStripe(w, session, from, fromLen);
+	if (!sp) { return; }
+	sp->lastSeen = w->now;
+	struct transfer* t = sp->transfer;
+	uint32_t seq = get32(buffer+4);
+	uint32_t length = get32(buffer+8);
+	if (length < HEADER_BYTES+4 || length > received) { return; }
+	uint32_t count = get32(buffer+HEADER_BYTES);
+	size_t sigBytes = length-HEADER_BYTES-4;
+	if (!count || count > MAP_PAGE || seq < sp->first || seq >= sp->fin || count > sp->fin-seq) { return; }
+	if (sigBytes && sigBytes != (size_t)count*SIG_BYTES) { return; }
+
+	uint8_t bits[MAP_PAGE/8];
+	if (sp->done) { // A late duplicate: every chunk of the stripe is stored, and once the file is complete its map and
+		memset(bits, 0xFF, sizeof(bits)); // descriptor may be gone, so neither is touched
+		generic_send(w, session, from, fromLen, TYPE_MAP, seq, bits, (count+7)/8);
+		return;
+	}
+	memset(bits, 0, sizeof(bits));
+	for (uint32_t i = 0; i < count; i++) {
+		if (!haveChunk(t, seq+i) && sigBytes && sameChunk(w, t, seq+i, buffer+HEADER_BYTES+4+i*SIG_BYTES)) { setHave(t, seq+i); }
+		if (haveChunk(t, seq+i)) { bits[i/8] |= 1 << (i%8); }
+	}
+	slideWindow(sp); // The FIN only fits the window once it moved past the chunks that will never come
+	generic_send(w, session, from, fromLen, TYPE_MAP, seq, bits, (count+7)/8);
+}
+
+static uint32_t chunkBytes(struct transfer* t, uint32_t seq)
+{ // Every chunk is full but the file's last one
+	uint64_t left = t->fileSize-(uint64_t)seq*t->chunk;
+	return (left < t->chunk) ? left : t->chunk;
+}
+
+static uint32_t missingChunks(struct stripe* sp, uint32_t first, uint32_t count, uint32_t* missing)
+{ // How many chunks of a parity group we neither hold nor have on disk, and (the last of) which
+	uint32_t n = 0;
+	for (uint32_t seq = (first > sp->rcvBase) ? first : sp->rcvBase; seq < first+count; seq++) {
+		if (sp->rcvState[seq % window] == SLOT_EMPTY && !haveChunk(sp->transfer, seq)) { n+=1; *missing = seq; }
+	}
+	return n;
+}
+
+static void markHoles(struct stripe* sp, uint32_t seq, uint64_t now)
+{ // A packet arrived past slots that are still missing, the time until each one is filled starts now
+	for (uint32_t q = (sp->holeScan > sp->rcvBase) ? sp->holeScan : sp->rcvBase; q < seq; q++) {
+		if (sp->rcvState[q % window] == SLOT_EMPTY && !haveChunk(sp->transfer, q)) { sp->missingSince[q % window] = now; }
+	}
+	sp->holeScan = seq+1;
+}
+
+static void countData(struct worker* w, struct stripe* sp, uint32_t seq, uint32_t len)
+{ // Chunk seq (or the FIN) filled its slot. If it was missing, how long that took goes into the histogram
+	uint64_t* since = &sp->missingSince[seq % window];
+	if (*since) { hist_add(&w->stats.holeRepair, w->now - *since); *since = 0; }
+	w->stats.bytes += len;
+	if (!w->stats.firstData) { w->stats.firstData = w->now; }
+	w->stats.lastData = w->now;
+}
+
+static void holdParity(struct stripe* sp, uint32_t first, uint32_t count, uint8_t* data, uint32_t len)
+{ // Keep a parity packet whose group has lost chunks, it is used at the end of the batch. Most groups arrive whole and
+	// their parity is dropped right away
+	uint32_t missing = 0;
+	if (sp->done || !count || first < sp->first || count > sp->fin-first) { return; } // Not part of this stripe
+	if (first+count <= sp->rcvBase || first+count > sp->rcvBase+window) { return; } // Complete already, or reaches past the window
+	if (len != chunkBytes(sp->transfer, first) || !missingChunks(sp, first, count, &missing)) { return; }
+	size_t stride = (sizeof(struct parity)+sp->transfer->chunk+7) & ~(size_t)7;
+	if (!sp->parityPool) {
+		sp->parityPool = calloc(PARITY_SLOTS, stride);
+		assert(sp->parityPool);
+	}
+	struct parity* empty = NULL;
+	for (uint32_t i = 0; i < PARITY_SLOTS; i++) {
+		struct parity* p = (struct parity*)(sp->parityPool + i*stride);
+		if (p->count && p->first == first) { return; } // A duplicate
+		if (!p->count && !empty) { empty = p; }
+	}
+	if (!empty) { return; } // Too many groups are short of several chunks, those wait for their retransmissions
+	empty->first = first;
+	empty->count = count;
+	empty->len = len;
+	memcpy(empty->data, data, len);
+	sp->paritiesHeld+=1;
+}
+
+static int rebuildChunk(struct worker* w, struct stripe* sp, struct parity* p, uint32_t missing)
+{ // The missing chunk is the XOR of the parity and every other chunk of the group. Those are still in the pool, or read
+	// back from the file (already written, or had before). Returns 0 if one can't be read
+	struct transfer* t = sp->transfer;
+	struct chunk* c = sp->freeChunks; // The missing chunk's slot is empty, so the pool has a chunk for it
+	assert(c);
+	memcpy(c->data, p->data, p->len);
+	for (uint32_t seq = p->first; seq < p->first+p->count; seq++) {
+		if (seq == missing) { continue; }
+		uint32_t len = chunkBytes(t, seq);
+		if (seq >= sp->rcvBase && sp->rcvState[seq % window] == SLOT_HELD) { xor_into(c->data, sp->rcvChunks[seq % window]->data, len); continue; }
+		if (pread(t->fd, w->block, len, (off_t)seq*t->chunk) != (ssize_t)len) { return 0; }
+		xor_into(c->data, w->block, len);
+	}
+	sp->freeChunks = c->next;
+	c->seq = missing;
+	c->len = chunkBytes(t, missing);
+	sp->rcvChunks[missing % window] = c;
+	sp->rcvState[missing % window] = SLOT_HELD;
+	if (!sp->unacked++) { sp->unackedSince = w->now; }
+	sp->ackNow = 1; // A repaired hole, the Sender must not resend it
+	sp->rebuilt+=1;
+	w->stats.rebuilt+=1;
+	countData(w, sp, missing, c->len);
+	if (isLogging) { trace_event(TRACE_REBUILT, 0, missing, 0, 0, sp->rcvBase); }
 	return 1;
 }
 
-int main(int argc, char* argv[])
+static void repairChunks(struct worker* w, struct stripe* sp)
+{ // Rebuild the chunk of every held group that is now missing only one, and let go of the groups that are complete
+	size_t stride = (sizeof(struct parity)+sp->transfer->chunk+7) & ~(size_t)7;
+	for (uint32_t i = 0; i < PARITY_SLOTS && sp->paritiesHeld; i++) {
+		struct parity* p = (struct parity*)(sp->parityPool + i*stride);
+		if (!p->count) { continue; }
+		uint32_t missing = 0;
+		uint32_t n = (p->first+p->count > sp->rcvBase) ? missingChunks(sp, p->first, p->count, &missing) : 0;
+		if (n > 1) { continue; } // Waits for a retransmission to fill one of them
+		if (n == 1) { rebuildChunk(w, sp, p, missing); }
+		p->count = 0;
+		sp->paritiesHeld-=1;
+	}
+}
+
+static void handleProbe(struct worker* w, uint8_t* buffer, size_t received, struct sockaddr* from, socklen_t fromLen)
+{ // A path MTU probe is only padding. Answering it says a packet that large got here and that we would take it, nothing is kept
+	if (received > maxPacket) { return; } // More than we accept, so the Sender settles for a smaller size
+	generic_send(w, get32(buffer+16), from, fromLen, TYPE_PROBEACK, get32(buffer+4), NULL, 0);
+}
+
+static void checkSeq(struct worker* w, uint8_t* buffer, size_t received, struct sockaddr* from, socklen_t fromLen) // Check the sequence number of the arriving packet.
+{ // Selective repeat: every packet inside the receive window is held in the reassembly pool until it is written.
+	// ACKs are cumulative with a selective ACK bitmap, and are sent at the end of the batch: right away if the Sender has
+	// to learn about a hole, a repair, a duplicate or the FIN or asked for it, otherwise every ackEvery packets or after ackDelayUs.
+	// Packets below the window were already written, but their ACK was lost and the Sender retransmitted,
+	// so we ACK them again to satisfy the Sender. Packets beyond the window are dropped without an ACK.
+
+	// Get the type,seq,len from the buffer/packet and convert to native endian
+	uint32_t type = get32(buffer) & TYPE_MASK;
+	uint32_t flags = get32(buffer) & ~TYPE_MASK;
+	uint32_t seq = get32(buffer+4);
+	uint32_t length = get32(buffer+8);
+
+	// A packet is logged once: DATA and FIN together with where they fell in the window, once that is known
+	if (isLogging && type != TYPE_DATA && type != TYPE_FIN) { trace_packet(TRACE_RECEIVED_OK, buffer, 0); }
+	if (type == TYPE_SYN) { handleSyn(w, buffer, received, from, fromLen); return; }
+	if (type == TYPE_PROBE) { handleProbe(w, buffer, received, from, fromLen); return; }
+	if (type == TYPE_MAPREQ) { handleMapReq(w, buffer, received, from, fromLen); return; }
+	if (type != TYPE_DATA && type != TYPE_FIN && type != TYPE_PARITY) { return; }
+	struct stripe* sp = findStripe(w, get32(buffer+16), from, fromLen);
+	if (!sp) { // Nothing to do with it before the SYN of its stripe
+		if (isLogging && type != TYPE_PARITY) { trace_packet(TRACE_RECEIVED_OK, buffer, 0); }
+		return;
+	}
+	sp->lastSeen = w->now;
+	if (!sp->dirty) { sp->dirty = 1; sp->dirtyNext = w->dirty; w->dirty = sp; } // Flushed and ACKed at the end of the batch
+	if (type == TYPE_PARITY) { holdParity(sp, seq, get32(buffer) >> PARITY_COUNT_SHIFT, buffer+HEADER_BYTES, length-HEADER_BYTES); return; }
+
+	if (isLogging) { trace_packet((seq < sp->rcvBase) ? TRACE_BELOW_WINDOW : (seq >= sp->rcvBase+window) ? TRACE_BEYOND_WINDOW : TRACE_IN_WINDOW, buffer, sp->rcvBase); }
+	if (seq < sp->rcvBase) { // Once the stripe is done every packet of it lands here
+		sp->ackNow = 1;
+		w->stats.duplicates+=1;
+		return;
+	}
+	if (seq >= sp->rcvBase+window) { w->stats.beyondWindow+=1; return; }
+	if (seq > sp->fin || (seq == sp->fin) != (type == TYPE_FIN)) { return; } // Not part of this stripe
+
+	uint32_t data_len = length-HEADER_BYTES;
+	uint64_t offset = (uint64_t)seq*sp->transfer->chunk;
+	if (type == TYPE_DATA && (data_len > sp->transfer->chunk || offset+data_len > sp->transfer->fileSize)) { return; } // Does not fit the file we were promised
+
+	uint32_t slot = seq % window;
+	if (sp->rcvState[slot] != SLOT_EMPTY) { sp->ackNow = 1; w->stats.duplicates+=1; return; } // Duplicate, the previous ACK may have been lost
+	struct chunk* c = sp->freeChunks; // The pool has one chunk per window slot, so it can't run dry
+	assert(c);
+	if (type == TYPE_DATA && (flags & FLAG_COMPRESSED)) { // Expands to the whole chunk (shorter at the end of the file)
+		uint64_t left = sp->transfer->fileSize-offset;
+		c->len = (left < sp->transfer->chunk) ? left : sp->transfer->chunk;
+		if (!lz_decompress(buffer+HEADER_BYTES, data_len, c->data, c->len)) { return; } // Garbled despite the checksum, dropped like a corrupt packet
+	}
+	else if (type == TYPE_DATA) {
+		c->len = data_len;
+		memcpy(c->data, buffer+HEADER_BYTES, data_len); // Hold it until it is written
+	}
+	if (!sp->unacked++) { sp->unackedSince = w->now; }
+	if (seq >= sp->holeScan) { markHoles(sp, seq, w->now); }
+	countData(w, sp, seq, (type == TYPE_DATA) ? c->len : 0);
+	// The Sender has to hear about a hole, and about its repair, right away so it can resend in one round trip. rcvBase
+	// only moves at the end of the batch, so packets are judged by their neighbours rather than by it
+	int hole = (seq != sp->rcvBase && (sp->rcvState[sp->rcvBase % window] == SLOT_EMPTY || sp->rcvState[(seq-1) % window] == SLOT_EMPTY));
+	int repair = (sp->rcvState[(seq+1) % window] != SLOT_EMPTY);
+	if (hole || repair || (flags & FLAG_ACK_NOW)) { sp->ackNow = 1; }
+	if (type == TYPE_FIN) { // Nothing to write, the FIN only marks the end
+		sp->ackNow = 1;
+		sp->finSeq = seq;
+		sp->rcvState[slot] = SLOT_WRITTEN;
+		return;
+	}
+	sp->freeChunks = c->next;
+	c->seq = seq;
+	sp->rcvChunks[slot] = c;
+	sp->rcvState[slot] = SLOT_HELD;
+}
+
+static void handlePackets(struct worker* w)
+{ // Read every packet that is queued (up to BATCHES_PER_WAKEUP batches), handle them all, then send all of their ACKs at once
+	for (int n = 0; n < BATCHES_PER_WAKEUP && batch_recv(&w->packets, 0) > 0; n++) {
+		if (n) { w->now = now_us(); } // Every batch gets its own time, for its delayed ACK and its log events
+		uint8_t* responseBuf = NULL;
+		size_t received = 0;
+		struct sockaddr* from = NULL;
+		socklen_t fromLen = 0;
+		while (batch_next(&w->packets, &responseBuf, &received, &from, &fromLen)) {
+			if (received < HEADER_BYTES) { continue; } // Too short to even hold a header
+			unsigned int calc_checksum = 0;
+			int the_check = checkChecksum(responseBuf, received, &calc_checksum);
+			if (isLogging && !the_check) { trace_packet(TRACE_CORRUPT, responseBuf, calc_checksum); } // checkSeq logs the others
+			if (the_check) { w->stats.packets+=1; checkSeq(w, responseBuf, received, from, fromLen); } // Check the checksum of the packet and see if it hasn't been corrupted
+			else { w->stats.corrupt+=1; } // If it has, don't do anything, and wait for the Sender to timeout and resend
+		}
+		for (struct stripe* sp = w->dirty; sp; sp = sp->dirtyNext) { // Write the batch before ACKing it, only stripes it touched can have something new
+			sp->dirty = 0;
+			if (!sp->done) {
+				if (sp->paritiesHeld) { repairChunks(w, sp); } // Before the flush, the rebuilt chunks are written with the rest
+				flushChunks(sp);
+				if (sp->rcvBase > sp->finSeq && stripeDone(sp)) { storeTransfer(w, sp); } // FIN and everything before it has been written
+			}
+			if (sp->ackNow || sp->unacked >= ackEvery) { sendAck(w, sp); }
+			else if (sp->unacked && !sp->ackDeadline) { // Wait for more packets to share this ACK, but not for long
+				sp->ackDeadline = w->now + ackDelayUs;
+				if (!sp->delayed) { sp->delayed = 1; sp->delayedNext = w->delayedAcks; w->delayedAcks = sp; }
+			}
+		}
+		w->dirty = NULL;
+		batch_flush(&w->ackBatch);
+	}
+}
+
+static void sendDelayedAcks(struct worker* w)
+{ // Send the delayed ACKs that are due and drop stripes without a pending one from the list
+	struct stripe** link = &w->delayedAcks;
+	while (*link) {
+		struct stripe* sp = *link;
+		if (sp->ackDeadline && sp->ackDeadline <= w->now) { sendAck(w, sp); }
+		if (sp->ackDeadline) { link = &sp->delayedNext; continue; }
+		*link = sp->delayedNext;
+		sp->delayed = 0;
+	}
+	batch_flush(&w->ackBatch);
+}
+
+static int nextTimeout(struct worker* w)
+{ // epoll_wait timeout (ms, rounded up) until the earliest delayed ACK or the next copy of the stats, -1 if neither is due
+	uint64_t first = statsEvery ? w->publishAt : UINT64_MAX;
+	for (struct stripe* sp = w->delayedAcks; sp; sp = sp->delayedNext) {
+		if (sp->ackDeadline && sp->ackDeadline < first) { first = sp->ackDeadline; }
+	}
+	if (first == UINT64_MAX) { return -1; }
+	uint64_t now = now_us();
+	return (first > now) ? (int)((first-now+999)/1000) : 0;
+}
+
+static void publishStats(struct worker* w)
+{ // Hand a copy of the worker's stats to the reporting thread, a few times per report interval (METRICS_PUBLISHES)
+	pthread_mutex_lock(&statsLock);
+	published[w-workers] = w->stats;
+	pthread_mutex_unlock(&statsLock);
+	w->publishAt = w->now + (uint64_t)statsEvery*1000/METRICS_PUBLISHES;
+}
+
+static void addStats(struct worker_stats* into, const struct worker_stats* s)
 {
-	assert(argc == 3 || argc == 4); // Assert that we have the correct number of arguments
-	isLogging = (argc == 3) ? 0 : 1; // If we have a third argument that means log file
+	into->packets += s->packets;
+	into->corrupt += s->corrupt;
+	into->duplicates += s->duplicates;
+	into->beyondWindow += s->beyondWindow;
+	into->rebuilt += s->rebuilt;
+	into->acks += s->acks;
+	into->bytes += s->bytes;
+	if (s->firstData && (!into->firstData || s->firstData < into->firstData)) { into->firstData = s->firstData; }
+	if (s->lastData > into->lastData) { into->lastData = s->lastData; }
+	hist_merge(&into->holeRepair, &s->holeRepair);
+	hist_merge(&into->ackDelay, &s->ackDelay);
+}
 
-	int port = atoi(argv[1]); // The port that we will listen on
-	char* out_file_name = argv[2]; // The file to write our data to
-	char* log_file = NULL; if(isLogging) { log_file = argv[3]; } // The file to log to
+static int reportStats(char* buf, size_t cap, int final)
+{ // The JSON line of the metrics (see Metrics.h), over every worker. Goodput is of the last interval and from the first data on
+	static struct worker_stats total; // Only the reporting thread calls this
+	static uint64_t lastAt = 0, lastBytes = 0;
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&statsLock);
+	for (unsigned int i = 0; i < numWorkers; i++) { addStats(&total, &published[i]); }
+	pthread_mutex_unlock(&statsLock);
+	pthread_mutex_lock(&transferLock);
+	unsigned int live = liveTransfers;
+	pthread_mutex_unlock(&transferLock);
+	uint64_t now = now_us();
+	double interval = (now-(lastAt ? lastAt : startedAt))/1e6;
+	double active = (total.lastData-total.firstData)/1e6;
+	int n = snprintf(buf, cap, "{\"time\":%.3f,\"role\":\"receiver\",\"final\":%s,\"transfers\":%u,\"bytes\":%llu,\"goodput_mbps\":%.2f,"
+		"\"average_mbps\":%.2f,\"packets\":%lu,\"corrupt\":%lu,\"duplicates\":%lu,\"beyond_window\":%lu,\"rebuilt\":%lu,\"acks\":%lu,"
+		"\"hole_repair_us\":", (now-startedAt)/1e6, final ? "true" : "false", live, total.bytes,
+		interval > 0 ? (total.bytes-lastBytes)*8/interval/1e6 : 0, active > 0 ? total.bytes*8/active/1e6 : 0,
+		total.packets, total.corrupt, total.duplicates, total.beyondWindow, total.rebuilt, total.acks);
+	n += hist_json(buf+n, cap-n, &total.holeRepair);
+	n += snprintf(buf+n, cap-n, ",\"ack_delay_us\":");
+	n += hist_json(buf+n, cap-n, &total.ackDelay);
+	n += snprintf(buf+n, cap-n, "}");
+	lastAt = now;
+	lastBytes = total.bytes;
+	return n;
+}
 
-	fptr = fopen(out_file_name, "w"); // Open the file for writing
-	assert(fptr); // Assert we can write to it
+static void evictIdle(struct worker* w)
+{ // Forget stripe sessions that went quiet: finished ones no longer need to re-ACK, unfinished ones lost their Sender
+	for (uint32_t b = 0; b < STRIPE_BUCKETS; b++) {
+		struct stripe** link = &w->table[b];
+		while (*link) {
+			struct stripe* sp = *link;
+			if (w->now - sp->lastSeen < idleUs || sp->held) { link = &sp->next; continue; } // A held stripe waits for its file
+			*link = sp->next;
+			if (w->last == sp) { w->last = NULL; }
+			for (struct stripe** d = &w->delayedAcks; *d; d = &(*d)->delayedNext) { // Idle, so its delayed ACK went out long ago
+				if (*d == sp) { *d = sp->delayedNext; break; }
+			}
+			pthread_mutex_lock(&transferLock);
+			sp->transfer->stripes-=1;
+			if (!sp->transfer->stripes) { closeTransfer(sp->transfer); }
+			pthread_mutex_unlock(&transferLock);
+			freeWindow(sp);
+			free(sp);
+		}
+	}
+}
 
-	if(isLogging) { write_log = fopen(log_file, "w"); assert(write_log); } // If we're logging open the log file
+static void* runWorker(void* arg)
+{ // Event loop: packets on the socket, the eviction tick, or the stop event
+	struct worker* w = arg;
+	struct epoll_event events[4];
+	while (!__atomic_load_n(&finished, __ATOMIC_ACQUIRE)) {
+		int n = epoll_wait(w->epfd, events, 4, nextTimeout(w));
+		w->now = now_us();
+		if (statsEvery && w->now >= w->publishAt) { publishStats(w); }
+		if (w->delayedAcks) { sendDelayedAcks(w); }
+		for (int i = 0; i < n; i++) {
+			if (events[i].data.fd == w->socket) { handlePackets(w); }
+			else if (events[i].data.fd == w->timerFd) {
+				uint64_t ticks;
+				if (read(w->timerFd, &ticks, sizeof(ticks)) == sizeof(ticks)) { evictIdle(w); }
+			}
+			else if (events[i].data.fd == w->wakeFd) {
+				uint64_t stored;
+				if (read(w->wakeFd, &stored, sizeof(stored)) == sizeof(stored)) { releaseHeld(w); batch_flush(&w->ackBatch); }
+			}
+		}
+	}
+	if (statsEvery) { publishStats(w); } // Its final numbers
+	return NULL;
+}
+
+static void watch(struct worker* w, int fd)
+{
+	struct epoll_event ev = {0};
+	ev.events = EPOLLIN; // Level triggered, whatever handlePackets leaves behind wakes us again right away
+	ev.data.fd = fd;
+	assert(epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) == 0);
+}
+
+static void initWorker(struct worker* w, int port)
+{
+	w->socket = socket(AF_INET, SOCK_DGRAM, 0); // Make a socket that we can receive packets to (AF_INET for IPv4 communication domain, SOCK_DGRAM for UDP, 0 is automatic protocol)
+	assert(w->socket != -1);
+	fcntl(w->socket, F_SETFL, O_NONBLOCK); // epoll tells us when packets are waiting, reads must never block
 
-	int recvrSocket = socket(AF_INET, SOCK_DGRAM, 0); // Make a socket that we can receive packets to (AF_INET for IPv4 communication domain, SOCK_DGRAM for UDP, 0 is automatic protocol)
+	int on = 1; // Every worker binds the same port, the kernel spreads the flows (stripes) across them by their addresses
+	if (numWorkers > 1) { assert(setsockopt(w->socket, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0); }
 
 	struct sockaddr_in server_addr = {0}; // Bind our socket to this hosts network interfaces and listen on the specified port
 	server_addr.sin_family = AF_INET;
 	server_addr.sin_port = htons(port); // Bind on this port (network order)
 	server_addr.sin_addr.s_addr = INADDR_ANY; // Bind on any network interface
 
-	assert((bind(recvrSocket, (struct sockaddr*)&server_addr, (socklen_t)sizeof(server_addr))) != -1); // Assert that we binded
-	
-	init_random(); // Seed the random values for unreliable sending/receiving later (if used)
-	uint8_t responseBuf[1472] = {0}; // Where we will store our packets that we have received
-
-	while(1) { // If the recv times out, then this loop will break
-		//recv_packet(recvrSocket, responseBuf, 1472, &senderAddr, &addrLen); // For unreliable receiving. Check UnreliableChannel
-		recvfrom(recvrSocket, responseBuf, 1472, 0, &senderAddr, &addrLen);
-		unsigned int calc_checksum = 0;
-		int the_check = checkChecksum(responseBuf, &calc_checksum);
-		if (isLogging) {
-			fprintf(write_log, "Packet received; "); printPack(responseBuf); fprintf(write_log, "checksum_calculated=%x; ", calc_checksum);
-			fprintf(write_log, "status="); the_check ? fprintf(write_log, "NOT_CORRUPT\n\n") : fprintf(write_log, "CORRUPT\n\n");
+	int rcvbuf = window*maxPacket*2; // Room for a whole window of packets (kernel caps this at net.core.rmem_max)
+	setsockopt(w->socket, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+	assert((bind(w->socket, (struct sockaddr*)&server_addr, (socklen_t)sizeof(server_addr))) != -1); // Assert that we binded
+
+	batch_recv_init(&w->packets, w->socket, maxPacket, batched); // Anything larger is cut short and fails its checksum
+	w->block = malloc(maxPacket);
+	assert(w->block);
+	batch_send_init(&w->ackBatch, w->socket, batched);
+
+	w->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+	assert(w->timerFd != -1);
+	struct itimerspec tick = { { TICK_MS/1000, (TICK_MS%1000)*1000000 }, { TICK_MS/1000, (TICK_MS%1000)*1000000 } };
+	assert(timerfd_settime(w->timerFd, 0, &tick, NULL) == 0);
+	w->wakeFd = eventfd(0, EFD_NONBLOCK); // Written by the thread storing a file one of our stripes completed
+	assert(w->wakeFd != -1);
+
+	w->epfd = epoll_create1(0);
+	assert(w->epfd != -1);
+	watch(w, w->socket);
+	watch(w, w->timerFd);
+	watch(w, w->wakeFd);
+	watch(w, stopFd);
+}
+
+int main(int argc, char* argv[])
+{
+	int opt;
+	while ((opt = getopt(argc, argv, "w:bs:di:a:t:u:m:p:x:")) != -1) { // Options come before the positional arguments
+		switch (opt) {
+			case 'w': window = atoi(optarg); break; // Amount of out of order packets to buffer (per stripe)
+			case 'b': batched = 0; break; // One system call per packet, for comparison
+			case 'u': assert(unreliable_setup(optarg)); break; // Impair everything we send, see UnreliableChannel.h
+			case 's': numWorkers = atoi(optarg); break; // Worker sockets and threads sharing the port
+			case 'd': serverMode = 1; break; // Serve forever, the output is a directory
+			case 'i': idleUs = strtoull(optarg, NULL, 10)*1000000; break; // Seconds of silence before a session is evicted
+			case 'a': ackEvery = atoi(optarg); break; // In order packets per ACK, 1 ACKs every packet
+			case 't': ackDelayUs = strtoull(optarg, NULL, 10); break; // Microseconds an ACK may be delayed
+			case 'm': maxPacket = atoi(optarg)-IP_UDP_BYTES; break; // Largest MTU to take packets for
+			case 'p': statsEvery = atoi(optarg); statsPrint = 1; break; // Print a JSON stats line to stderr every this many ms
+			case 'x': statsSocket = optarg; break; // Serve the latest stats line on this UNIX socket
+			default: assert(0);
 		}
-		if (the_check) { // Check the checksum of the packet and see if it hasn't been corrupted
-			if(!checkSeq(recvrSocket, responseBuf)) { printf("Successfully received all packets\n"); break; }
-		} // If it has, don't do anything, and wait for the Sender to timeout and resend
 	}
+	assert(window > 0);
+	assert(numWorkers > 0 && numWorkers <= MAX_WORKERS);
+	assert(idleUs > 0);
+	assert(ackEvery > 0);
+	assert(maxPacket >= MIN_MTU-IP_UDP_BYTES && maxPacket <= 65535-IP_UDP_BYTES);
+	assert(!statsPrint || statsEvery > 0);
+	if (statsSocket && !statsEvery) { statsEvery = METRICS_DEFAULT_MS; }
+	argc -= optind-1; argv += optind-1; // Shift so the positional arguments keep their usual indices
+
+	assert(argc == 3 || argc == 4); // Assert that we have the correct number of arguments
+	isLogging = (argc == 3) ? 0 : 1; // If we have a third argument that means log file
+
+	int port = atoi(argv[1]); // The port that we will listen on
+	outPath = argv[2]; // The file (or directory) to write our data to
+	char* log_file = NULL; if(isLogging) { log_file = argv[3]; } // The file to log to
+
+	struct stat st;
+	outIsDir = serverMode || (stat(outPath, &st) == 0 && S_ISDIR(st.st_mode)); // Also receives a directory tree without -d
+	if (serverMode) { setvbuf(stdout, NULL, _IOLBF, 0); } // A long running server reports every file as it completes
+	if (!outIsDir) {
+		outFd = open(outPath, O_RDWR | O_CREAT, 0644); // Open the file for writing, what it holds may be resumed from
+		assert(outFd != -1); // Assert we can write to it
+	}
+
+	if(isLogging) { assert(trace_open(log_file)); } // If we're logging create the log file, events are written to it in the background
+
+	stopFd = eventfd(0, EFD_NONBLOCK);
+	assert(stopFd != -1);
+	workers = calloc(numWorkers, sizeof(struct worker));
+	assert(workers);
+	for (unsigned int i = 0; i < numWorkers; i++) { initWorker(&workers[i], port); } // All bound before any packet, so no flow moves between sockets
+	startedAt = now_us();
+	if (statsEvery) {
+		published = calloc(numWorkers, sizeof(struct worker_stats));
+		assert(published);
+		assert(metrics_start(reportStats, statsEvery, statsPrint, statsSocket)); // The socket path must be free to bind
+	}
+	for (unsigned int i = 1; i < numWorkers; i++) { assert(pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) == 0); }
+	runWorker(&workers[0]); // The first worker runs on the main thread
+	for (unsigned int i = 1; i < numWorkers; i++) { pthread_join(workers[i].thread, NULL); }
+	if (statsEvery) { metrics_stop(); free(published); }
+	static struct worker_stats total; // Histograms are too large for the stack
+	for (unsigned int i = 0; i < numWorkers; i++) { addStats(&total, &workers[i].stats); }
+	double active = (total.lastData-total.firstData)/1e6;
+	printf("Received %llu bytes in %.3f s (%.2f Mbit/s): %lu packets, %lu corrupt, %lu duplicates, %lu beyond the window; %lu ACKs sent\n",
+		total.bytes, active, active > 0 ? total.bytes*8/active/1e6 : 0, total.packets, total.corrupt, total.duplicates, total.beyondWindow, total.acks);
+	char line[160];
+	hist_summary(line, sizeof(line), &total.holeRepair);
+	printf("Hole repair (us): %s\n", line);
+	hist_summary(line, sizeof(line), &total.ackDelay);
+	printf("ACK delay (us): %s\n", line);
+
+	for (unsigned int i = 0; i < numWorkers; i++) {
+		struct worker* w = &workers[i];
+		w->now = UINT64_MAX; // Evicts everything that is left
+		idleUs = 1;
+		evictIdle(w);
+		batch_recv_free(&w->packets);
+		free(w->block);
+		close(w->epfd);
+		close(w->timerFd);
+		close(w->wakeFd);
+		close(w->socket);
+	}
+	free(workers);
+	close(stopFd);
+	if (outFd != -1) { close(outFd); } // Close our file that we're writing to
+	if (isLogging) { trace_close(); }
 
-	fclose(fptr); // Close our file that we're writing to
-	if (isLogging) { fclose(write_log); }
-	
 	return 0;
 }
@@ -3,20 +3,202 @@
 #include <arpa/inet.h> // For socket/network operations
 #include <stdlib.h> // Calloc
 #include <string.h> // Fpr strtok and other str functions such as memcpy
-#include <poll.h> // Used to set a timer for a response within 500ms (if no reponse with 500ms then likely lost)
-#include "UnreliableChannel.h" // For unreliable sending/receiving. See the associated C and Header file.
-// Make sure to replace the randomization when finally cleaning up. Remove print statements
+#include <poll.h> // ppoll waits for ACKs until the earliest retransmission timer, with microsecond precision
+#include <time.h> // clock_gettime for the per-packet retransmission timers
+#include <unistd.h> // getopt
+#include <fcntl.h> // Non-blocking socket so every queued ACK can be drained at once
+#include <sys/mman.h> // The input file is mapped instead of read into per-packet buffers
+#include <sys/stat.h> // fstat for the size of the input file
+#include <limits.h> // PATH_MAX for the directory's real path
+#include <pthread.h> // One thread per stripe (-s)
+#include "UnreliableChannel.h" // Simulated network impairments (-u). See the associated C and Header file.
+#include "Checksum.h" // CRC32 shared with the Receiver
+#include "BatchIO.h" // sendmmsg/recvmmsg batching shared with the Receiver
+#include "Congestion.h" // Congestion window and pacing of every stream
+#include "Compression.h" // Chunk compression (-z), undone by the Receiver
+#include "Parity.h" // XOR parity packets (-f), the Receiver rebuilds a lost chunk from them
+#include "Trace.h" // Binary event log, written by a background thread (see TraceDecode)
+#include "Metrics.h" // Counters and RTT histograms, reported while the transfer runs (-p, -x)
+#include "Tree.h" // A directory is packed into one stream: a manifest, then every file's data back to back
 
-#define MAX_DATA (1456) // Maximum amount of bytes (excluding header) a MTP message can contain
-#define HEADER_BYTES (16) // Amount of header bytes
+#define HEADER_BYTES (20) // Amount of header bytes
+#define IP_UDP_BYTES (28) // IPv4 and UDP headers in front of every packet
+#define BASE_MTU (1500) // Every path is assumed to take packets this large (Ethernet), probing looks for more
+#define DEFAULT_MTU (9000) // Largest MTU probed for (-m), jumbo frames
+#define DEFAULT_WINDOW (64) // Default number of packets that may be in flight (unACKed) at once
+#define INITIAL_RTO_US (500000) // Retransmission timeout before the first RTT sample (the old fixed 500ms)
+#define MIN_RTO_US (2000) // Never time out faster than this, it has to stay above scheduler jitter
+#define PEER_ACK_DELAY_US (1000) // The Receiver's delayed ACK timeout (its -t default). RTT samples come from the newest packet an ACK covers, the oldest may wait this much longer
+#define MAX_RTO_US (60000000) // Backoff stops doubling the timeout here
+#define GIVEUP_MIN_US (2500000) // Give up when no ACK arrived for this long (the old 5 * 500ms)...
+#define GIVEUP_RTOS (16) // ...or for this many RTOs, whichever is longer, so slow links get proportionally more patience
+#define MAX_ACK (HEADER_BYTES+128) // Largest ACK, the header and a full selective ACK bitmap
+#define DUPTHRESH (3) // A hole is lost once a packet this far past it has been ACKed (fast retransmit)
+#define SYN_BYTES (HEADER_BYTES+36) // The SYN carries the 64 bit file size, which stripe of the file follows, the chunk size and the file version, then the file name
+#define MAX_NAME (255) // Longest file name sent in the SYN
+#define MAX_STREAMS (64) // Most stripes (-s), each gets its own thread and socket
+#define MAP_PAGE (1024) // Most chunks one MAPREQ asks about, the MAP answering it is a bitmap the size of a full selective ACK
+#define MAP_INFLIGHT (8) // MAPREQs outstanding at once. The Receiver may read and hash a lot of its file for each one
+#define SIG_BYTES (8) // Signature of a chunk in a MAPREQ (-r): its rolling sum and its CRC32
+#define FEC_MIN_GROUP (2) // Fewest chunks one parity packet covers (-f)...
+#define FEC_MAX_GROUP (32) // ...and most, it only rebuilds one lost chunk of them
+#define FEC_SAMPLE (128) // -f auto measures the loss rate over this many new packets...
+#define FEC_TARGET_LOSSES (0.25) // ...and sizes the groups to lose this many packets on average, so two in one group are rare
+#define FEC_OFF_LOSS (0.002) // Below this loss rate -f auto sends no parity at all
+#define PARITY_RING (16) // Parity packets waiting for a flush, the batch is flushed before the ring wraps
 
-static unsigned int num_packs = 0; // Number of packets the target file is split into
-static uint8_t** packet_list = NULL; // Pointer list that stores pointers to each packet
+enum { TYPE_ACK, TYPE_DATA, TYPE_FIN, TYPE_SYN, TYPE_SYNACK, TYPE_PROBE, TYPE_PROBEACK, TYPE_MAPREQ, TYPE_MAP, TYPE_PARITY }; // Packet types
+#define TYPE_MASK (0xFFFF) // The upper bits of the type field are flags
+#define FLAG_ACK_NOW (1u << 16) // The Sender can't send more until it hears back, so ACK this packet without delay
+#define FLAG_COMPRESSED (1u << 17) // The DATA is compressed (see Compression.h), it expands to the full chunk at its offset
+#define FLAG_DELTA (1u << 18) // SYN: we will send signatures, the Receiver should keep what it has of the file to compare them against
+#define FLAG_HAS_MAP (1u << 19) // SYNACK: the Receiver already has some of the file, ask it which chunks (MAPREQ)
+#define FLAG_TREE (1u << 20) // SYN: the file is a packed directory tree (see Tree.h), the Receiver recreates the tree from it
+#define FLAG_REFUSED (1u << 21) // SYNACK: the Receiver will not take the file, the payload says why (REFUSE_*). ACK of a FIN: it could not store the file
+#define FLAG_PENDING (1u << 22) // ACK: the Receiver has the whole stripe, but only ACKs the FIN once the file is stored (a tree unpacked)
+enum { REFUSE_NOT_DIR = 1, REFUSE_NAME }; // Reasons: a tree needs an output directory, the name would leave the output directory
+#define PARITY_COUNT_SHIFT (24) // PARITY: the number of chunks in the group is the top byte of TYPE
+#define RELEASE_BYTES (4*1024*1024) // Drop pages of the input we are finished with every time the window passes this many bytes
+#define STORE_POLL_US (200000) // While the Receiver stores the file, the FIN is resent this often to hear that it is still at it
+#define MAX_COMPRESSORS (64) // Most compressor threads (-z)
+#define RAW_STREAK (8) // After this many chunks in a row that did not shrink the data counts as incompressible...
+#define SAMPLE_EVERY (8) // ...and only one chunk in this many is tried, until one shrinks again
+#define COMPRESS_NAP_NS (1000000) // Idle compressors look again after this long even if no stripe woke them
+
+struct slot { // Per-packet state for every packet inside the send window, indexed by seq % window
+	uint32_t seq; // Sequence number currently occupying the slot
+	uint8_t acked; // Has the Receiver ACKed this sequence number
+	uint8_t attempts; // Amount of times this packet was resent. Karn's rule: only packets never resent give RTT samples
+	int heapPos; // Index of the slot in the timer heap, -1 while its timer is not armed
+	uint64_t sentAt; // Monotonic time (us) of the first transmission, for RTT samples
+	uint64_t deadline; // Monotonic time (us) at which the packet is resent
+	uint32_t bytes; // Packet size, for the congestion window
+	struct cc_tx tx; // Congestion control snapshot of the last transmission
+	uint8_t* packet; // Packet buffer from the ring, built when the packet enters the window and reused for resends
+	uint32_t groupEnd; // One past the last chunk of the packet's parity group, 0 if no parity covers it (-f)
+	uint64_t repairAt; // When the group's parity went out, 0 until then
+	uint8_t missed; // Already counted as lost, for the loss rate (-f auto)
+};
+
+struct ahead { // A chunk compressed ahead of the send window (-z), indexed by seq % window like the slots
+	unsigned int ready; // seq+1 once data holds chunk seq compressed, stored last
+	int busy; // A compressor is writing the entry
+	uint32_t bytes; // Compressed size
+	uint8_t* data; // chunk bytes, from aheadRing
+};
+
+struct stream_stats { // What a stream counts. Only its own thread writes it, copies are published for the reports (-p, -x)
+	unsigned long packetsSent; // DATA and FIN packets sent, resends included
+	unsigned long fastRetransmits; // Resends the selective ACKs called for
+	unsigned long timeouts; // Resends of expired timers
+	unsigned long acks; // Valid ACKs of this session
+	unsigned long acksCorrupt;
+	unsigned long chunksCompressed; // DATA packets that went out compressed
+	unsigned long long bytesSaved; // What that saved on the wire
+	unsigned long chunksSkipped;
+	unsigned long paritySent;
+	unsigned long long bytesAcked; // Data bytes the Receiver ACKed, the chunks it already had are not included
+	uint64_t cwnd, inflight, srtt, rto; // When the copy was published
+	struct hist rtt; // RTT samples (us)
+	struct hist delivery; // First transmission of a packet until its ACK (us), so resends included
+};
+
+struct stream { // One stripe of the file: a contiguous range of sequence numbers with its own thread, socket, window and RTT estimate
+	pthread_t thread;
+	unsigned int index; // Stripe number, announced in the SYN
+	int socket; // Every stripe is its own UDP flow, so the Receiver's SO_REUSEPORT workers (and the NIC's RSS queues) can split them
+	unsigned int first; // First DATA sequence number of the stripe
+	unsigned int fin; // Sequence number of the stripe's FIN, one past its last DATA packet
+	size_t endBytes; // Where the stripe's data ends in the file
+	size_t releasedBytes; // Bytes of the mapping (from the start of the stripe) whose pages were already given back
+	uint8_t* packetRing; // window * maxPacket bytes of reusable packet buffers, one per window slot
+	struct send_batch sendBatch; // Packets queued since the last flush
+	struct recv_batch ackBatch; // ACKs read by the last recvmmsg
+
+	unsigned int base; // Oldest sequence number that has not been ACKed yet
+	unsigned int nextSeq; // Next sequence number that has never been sent
+	struct slot* slots; // Window state, window entries
+	struct slot** timerHeap; // Min-heap of the slots with an armed timer, earliest deadline first
+	unsigned int timerCount; // Amount of armed timers, at most one per slot
+	struct slot** newlyAcked; // Slots the ACK being handled covers for the first time, window entries
+	unsigned int highAcked; // One past the highest sequence number ACKed so far
+	uint64_t rackSentAt; // Latest transmission time of any ACKed packet. Holes sent before it were passed by newer packets
+	uint64_t lossCheckAt; // When a hole that might still be reordering becomes overdue, 0 if none
+
+	uint64_t srtt; // Smoothed RTT (us), 0 until the first sample
+	uint64_t rttvar; // RTT variation (us)
+	uint64_t rto; // Current retransmission timeout (us), includes the backoff
+	uint64_t lastAck; // Monotonic time (us) of the last valid ACK, for giving up
+	uint64_t backoffUntil; // Timeouts before this time belong to the same loss episode and do not back off again
+	struct cc cc; // Congestion window and pacing, the stripes are separate flows and each one finds its own share
+	uint64_t loggedCwnd; // Congestion window of the last window event in the log
+	int sent; // Every packet of the stripe was ACKed
+	int storing; // The Receiver has every packet of the stripe and is storing the file, the FIN's ACK follows
+	int storeFailed; // The Receiver could not store the file
+	struct stream_stats stats;
+	uint64_t publishAt; // When the next copy of stats is due (-p, -x)
+	struct tree_reader reader; // The file of the tree the stripe read last
+	uint8_t* chunkBuf; // chunk bytes a chunk of the tree is read into for the parity and signatures. NULL unless treeMode
+
+	struct ahead* ahead; // Chunks the compressors got to before they entered the window, window entries. NULL without -z
+	uint8_t* aheadRing; // window * chunk bytes of compressed data
+	unsigned int aheadBase; // Chunk being built, the compressors stay less than a window ahead of it so its entry is never overwritten
+	unsigned int compressNext; // Next chunk a compressor takes
+	unsigned int rawStreak; // Chunks in a row that did not shrink
+	int sampling; // The data looked incompressible, most chunks are sent without trying
+
+	int peerHasMap; // The SYNACK said the Receiver already has some of the file
+	uint8_t* skip; // Chunks of the stripe the Receiver already has, one bit per chunk from first. NULL until its MAP arrived
+
+	uint8_t* parity; // XOR of the chunks of the current group so far, chunk bytes. NULL without -f
+	uint8_t* parityRing; // PARITY_RING packets of parity waiting to be sent
+	unsigned int parityNext; // Next packet of the ring
+	unsigned int groupFirst; // First chunk of the current parity group
+	unsigned int groupEnd; // One past its last chunk, 0 between groups
+	unsigned int groupBytes; // Size of the parity, the first chunk of a group is the longest
+	unsigned int groupSent; // Chunks of the group that were sent, a group the Receiver already had needs no parity
+	unsigned int lossSent; // New packets since the last loss rate sample (-f auto)
+	unsigned int lossSeen; // Losses among them, repaired or resent
+	unsigned int lossSamples;
+	double lossRate; // Smoothed share of packets lost
+};
+
+static unsigned int num_packs = 0; // Number of DATA packets the target file is split into
+static unsigned int chunk = BASE_MTU-IP_UDP_BYTES-HEADER_BYTES; // Data bytes per packet, picked by probe_path() and announced in every SYN
+static unsigned int maxPacket = BASE_MTU-IP_UDP_BYTES; // Largest packet we send, header included
+static uint8_t* fileMap = NULL; // The input file mapped into memory, packets read their data straight from here
+static int treeMode = 0; // The input is a directory, its packed stream is read with tree_read() instead of from the mapping
+static struct tree_info tree;
+static size_t fileSize = 0; // Size of the input file in bytes
+static uint64_t fileVersion = 0; // Modification time of the input file (ns), the Receiver only resumes a copy of the same version
 static struct sockaddr_in dest_addr = {0}; // The destination address we want to send to
+static uint32_t sessionId = 0; // Random id in every header, the Receiver keeps one session per (address, id), so concurrent Senders never mix
+static char* fileName = NULL; // Base name of the input file, a Receiver in server mode stores it under this name
+
+static int isLogging = 0; // Record events in the log file (see Trace.h)
 
-static FILE* writeFile = NULL;
-static int isLogging = 0;
-static int attempts = 0;
+static int batched = 1; // Use sendmmsg/recvmmsg and GSO (-b turns it off)
+static unsigned int window = DEFAULT_WINDOW; // Size of the send window of every stream (-w)
+static unsigned int numStreams = 1; // Amount of stripes sent in parallel (-s)
+static enum cc_algo ccAlgo = CC_RENO; // Congestion controller of every stream (-c)
+static unsigned int mtuCap = DEFAULT_MTU; // Largest MTU probe_path() tries (-m)
+static int delta = 0; // Send signatures so the Receiver can compare the file it already has (-r)
+static unsigned int mapPage = MAP_PAGE; // Chunks per MAPREQ, with -r as many as their signatures fit in a packet
+static unsigned int fecGroup = 0; // Chunks covered by each parity packet (-f), 0 sends none
+static int fecAuto = 0; // -f auto: the group size follows the measured loss rate
+static struct stream* streams = NULL;
+static unsigned int compressThreads = 0; // Threads compressing chunks ahead of the windows (-z), 0 sends every chunk as it is
+static pthread_t* compressors = NULL;
+static pthread_mutex_t compressLock = PTHREAD_MUTEX_INITIALIZER; // Idle compressors sleep on compressWake
+static pthread_cond_t compressWake = PTHREAD_COND_INITIALIZER;
+static int compressIdle = 0; // Sleeping compressors, the stripes only signal when there is one
+static int compressStop = 0; // Every stripe is done
+static unsigned int statsEvery = 0; // Report interval (ms) of the metrics, 0 without -p and -x
+static int statsPrint = 0; // Print every report to stderr (-p)
+static char* statsSocket = NULL; // Serve the latest report on this UNIX socket (-x)
+static struct stream_stats* published = NULL; // The latest copy of every stream's stats, for the reporting thread
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER; // Guards published
+static uint64_t startedAt = 0; // Monotonic time (us) the Sender started, goodput is measured from here
 
 static unsigned int parseIP(char* recvrIP)
 {
@@ -36,180 +218,1009 @@ static unsigned int parseIP(char* recvrIP)
 	return totality;
 }
 
-static void printPack(uint8_t* packet)
-{ // Print header fields of the packet
-	uint32_t type = 0;
-	uint32_t seqNum = 0;
-	uint32_t length = 0;
-	uint32_t checksum = 0;
+static void map_file(char *in_file_name)
+{ // Map the input file, or walk the input directory. Only the packets inside the window are ever built, so memory use does not depend on the file size.
+	// It is only split into packets once probe_path() picked their size
+	int fd = open(in_file_name, O_RDONLY);
+	assert(fd != -1); // Assert that we can open the file for reading
 
-	memcpy(&type, packet, sizeof(uint32_t));
-	memcpy(&seqNum, packet+4, sizeof(uint32_t));
-	memcpy(&length, packet+8, sizeof(uint32_t));
-	memcpy(&checksum, packet+12, sizeof(uint32_t));
+	struct stat st;
+	assert(fstat(fd, &st) != -1);
+	if (S_ISDIR(st.st_mode)) { // Packed on the fly, only its manifest is built now
+		close(fd);
+		assert(tree_open(in_file_name, &tree));
+		treeMode = 1;
+		fileSize = tree.size;
+		fileVersion = tree.version;
+		return;
+	}
+	fileSize = st.st_size;
+	assert(fileSize); // There has to be at least one DATA packet
+	fileVersion = (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
 
-	char* typeStr = ntohl(type) ? ((ntohl(type)==1) ? "DATA" : "FIN") : "ACK";
+	fileMap = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	assert(fileMap != MAP_FAILED);
+	madvise(fileMap, fileSize, MADV_SEQUENTIAL); // We walk the file front to back, so read ahead aggressively
+	close(fd); // The mapping keeps the file alive
+}
+
+static void make_packet(uint8_t* my_packet, uint32_t type, uint32_t seqNum, const uint8_t* data, size_t bytes)
+{ // Write the header (with its checksum) and the data of a packet into my_packet
+	uint32_t length = bytes+HEADER_BYTES; // The max amount of data we're reading is one chunk, plus we need header (20 bytes)
+	uint32_t session = sessionId;
+
+	uint32_t crc = crc32_begin(); // The checksum covers the other 4 headers (native order) and then the data, fed in place
+	crc = crc32_update(crc, &type, sizeof(uint32_t));
+	crc = crc32_update(crc, &seqNum, sizeof(uint32_t));
+	crc = crc32_update(crc, &length, sizeof(uint32_t));
+	crc = crc32_update(crc, &session, sizeof(uint32_t));
+	crc = crc32_update(crc, data, bytes);
+	uint32_t checksum = crc32_end(crc);
 
-	if (isLogging) { fprintf(writeFile, "type=%s; seqNum=%u; length=%u; checksum=%x\n\n", typeStr, ntohl(seqNum), ntohl(length), ntohl(checksum)); }
+	type = htonl(type); // Convert these to network byte order since they're numbers and endianess could affect them
+	seqNum = htonl(seqNum); // We don't need to convert the data cause they're just characters
+	length = htonl(length);
+	checksum = htonl(checksum);
+	session = htonl(session);
+	
+	memcpy(my_packet, &type, sizeof(uint32_t));
+	memcpy(my_packet+4, &seqNum, sizeof(uint32_t));
+	memcpy(my_packet+8, &length, sizeof(uint32_t));
+	memcpy(my_packet+12, &checksum, sizeof(uint32_t));
+	memcpy(my_packet+16, &session, sizeof(uint32_t)); // First 20 bytes is the Header data
+	if (bytes && data != my_packet+HEADER_BYTES) { memcpy(my_packet+HEADER_BYTES, data, bytes); } // Finally we copy the data
 }
 
-static unsigned int crc32(uint8_t* message, int len)
-{ // stackoverflow.com/questions/21001659/crc32-algorithm-implementation-in-c-without-a-look-up-table-and-with-a-public-li
-	unsigned int byte, crc, mask;
-	crc = 0xFFFFFFFF;
+static const uint8_t* chunk_data(struct tree_reader* r, size_t offset, size_t bytes, uint8_t* buf)
+{ // The bytes of a chunk: straight from the mapping, or read from the tree's files into buf
+	if (!treeMode) { return fileMap+offset; }
+	tree_read(r, offset, buf, bytes);
+	return buf;
+}
 
-	for(int i = 0; i < len; i++) {
-		byte = message[i]; // Get next byte
-		crc = crc ^ byte;
-		for(int j = 7; j >= 0; j--) { // Do eight times
-			mask = -(crc & 1);
-			crc = (crc >> 1) ^ (0xEDB88320 & mask);
+static void build_packet(struct stream* st, unsigned int seq, uint32_t flags, uint8_t* my_packet)
+{ // Build the header and copy the data for one packet into its ring buffer
+	int callFinality = (seq == st->fin); // The last packet of the stripe has descended
+	size_t offset = (size_t)seq*chunk; // Where this packet's data starts in the file
+	size_t bytes = (callFinality) ? 0 : ((fileSize-offset < chunk) ? fileSize-offset : chunk);
+	if (!callFinality && st->ahead) {
+		struct ahead* a = &st->ahead[seq % window];
+		if (__atomic_load_n(&a->ready, __ATOMIC_ACQUIRE) == seq+1) { // Compressed in time, otherwise it goes out as it is
+			make_packet(my_packet, TYPE_DATA | FLAG_COMPRESSED | flags, seq, a->data, a->bytes);
+			st->stats.chunksCompressed+=1;
+			st->stats.bytesSaved += bytes-a->bytes;
+			return;
 		}
 	}
-	return ~crc;
+	const uint8_t* data = bytes ? chunk_data(&st->reader, offset, bytes, my_packet+HEADER_BYTES) : NULL; // Tree chunks are read into the packet itself
+	make_packet(my_packet, (callFinality ? TYPE_FIN : TYPE_DATA) | flags, seq, data, bytes);
 }
 
-static unsigned int packetsToSend(char *in_file_name)
-{ // Gets number of packets to send
-	FILE* fptr = fopen(in_file_name, "r"); 
-	assert(fptr); // Assert that we can open the file for reading
+static int compress_ahead(struct stream* st, struct tree_reader* r, uint8_t* buf)
+{ // Compress the next chunk of the stripe that has not entered its window. Returns 0 once the lookahead is full
+	unsigned int base = __atomic_load_n(&st->aheadBase, __ATOMIC_ACQUIRE);
+	unsigned int limit = (base+window < st->fin) ? base+window : st->fin; // Never reaches the entry of the chunk being built
+	unsigned int seq = __atomic_load_n(&st->compressNext, __ATOMIC_RELAXED), next;
+	do {
+		next = (seq < base) ? base : seq; // Chunks already built went out as they were, catch up
+		if (next >= limit) { return 0; }
+	} while (!__atomic_compare_exchange_n(&st->compressNext, &seq, next+1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	seq = next;
+	if (__atomic_load_n(&st->sampling, __ATOMIC_RELAXED) && seq % SAMPLE_EVERY) { return 1; } // Looked incompressible lately, not worth the time
+	uint8_t* skip = __atomic_load_n(&st->skip, __ATOMIC_ACQUIRE);
+	if (skip && (skip[(seq-st->first)/8] >> ((seq-st->first)%8) & 1)) { return 1; } // The Receiver has it, it is never sent
 
-	char buffer[MAX_DATA] = {0}; // The maximum amount of data a MTP message can contain is 1456 bytes because the header is 16 bytes
-	unsigned int counter = 0; // Count number of packs
+	struct ahead* a = &st->ahead[seq % window];
+	int idle = 0;
+	if (!__atomic_compare_exchange_n(&a->busy, &idle, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) { return 1; } // A slow compressor still has the entry
+	size_t offset = (size_t)seq*chunk;
+	size_t bytes = (fileSize-offset < chunk) ? fileSize-offset : chunk;
+	size_t packed = lz_compress(chunk_data(r, offset, bytes, buf), bytes, a->data, bytes-1); // Only worth sending if it shrinks
+	if (packed) {
+		a->bytes = packed;
+		__atomic_store_n(&a->ready, seq+1, __ATOMIC_RELEASE);
+		__atomic_store_n(&st->rawStreak, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&st->sampling, 0, __ATOMIC_RELAXED);
+	}
+	else if (__atomic_add_fetch(&st->rawStreak, 1, __ATOMIC_RELAXED) >= RAW_STREAK) { // Racy between compressors, but it is only a heuristic
+		__atomic_store_n(&st->sampling, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&a->busy, 0, __ATOMIC_RELEASE);
+	return 1;
+}
 
-	while (fread(buffer, sizeof(char), MAX_DATA, fptr)) { counter+=1; } // While we can keep reading 1456 bytes keep incrementing the counter
+static void* run_compressor(void* arg)
+{ // Thread body: keep every stripe's lookahead full. The stripes never wait for us, a chunk that is not ready in time goes out as it is
+	unsigned int start = (unsigned int)(uintptr_t)arg; // Compressors start at different stripes
+	struct tree_reader reader;
+	tree_reader_init(&reader);
+	uint8_t* buf = treeMode ? malloc(chunk) : NULL;
+	assert(!treeMode || buf);
+	while (!__atomic_load_n(&compressStop, __ATOMIC_ACQUIRE)) {
+		int found = 0;
+		for (unsigned int i = 0; i < numStreams; i++) { found |= compress_ahead(&streams[(start+i) % numStreams], &reader, buf); }
+		if (found) { continue; }
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += COMPRESS_NAP_NS;
+		if (ts.tv_nsec >= 1000000000) { ts.tv_sec+=1; ts.tv_nsec -= 1000000000; }
+		pthread_mutex_lock(&compressLock);
+		__atomic_add_fetch(&compressIdle, 1, __ATOMIC_RELAXED);
+		if (!__atomic_load_n(&compressStop, __ATOMIC_ACQUIRE)) { pthread_cond_timedwait(&compressWake, &compressLock, &ts); } // The timeout covers a wakeup that raced with falling asleep
+		__atomic_sub_fetch(&compressIdle, 1, __ATOMIC_RELAXED);
+		pthread_mutex_unlock(&compressLock);
+	}
+	tree_reader_close(&reader);
+	free(buf);
+	return NULL;
+}
 
-	fclose(fptr); // Close our file
-	return counter; // Return number of packets
+static void wake_compressors(void)
+{ // The window moved, so there is room ahead of it again. Only a sleeping compressor needs telling
+	if (__atomic_load_n(&compressIdle, __ATOMIC_RELAXED)) { pthread_cond_signal(&compressWake); }
 }
 
-static void init_packets(char *in_file_name)
-{
-	FILE* fptr = fopen(in_file_name, "r");
-	assert(fptr);
+static void release_pages(struct stream* st)
+{ // Give back the pages of the mapping below the window. They are never read again, so RSS stays flat however large the file is
+	if (treeMode) { return; } // Nothing is mapped, the files are read through the page cache
+	size_t done = (size_t)st->base*chunk;
+	int last = (done >= st->endBytes); // The stripe is finished, so its partial last page goes too
+	if (last) { done = st->endBytes; }
+	else { done &= ~(size_t)(sysconf(_SC_PAGESIZE)-1); } // madvise starts on whole pages
+	if (done <= st->releasedBytes || (done - st->releasedBytes < RELEASE_BYTES && !last)) { return; }
+	madvise(fileMap+st->releasedBytes, done-st->releasedBytes, MADV_DONTNEED);
+	st->releasedBytes = done;
+}
 
-	char buffer[MAX_DATA] = {0}; // Make a buffer to read the data in a while loop using fread
-	unsigned int counter = 0; // Counter is for the packet/seq number when sending 
-	
-	size_t bytes = 0; // The amount of bytes read. If there are no bytes to read then this will be zero
-	for(int i = 0; i < num_packs; i++)
-	{
-		int callFinality = ((i+1) == num_packs); // The last packet has descended
-		if(!callFinality) { bytes = fread(buffer, sizeof(char), MAX_DATA, fptr); }
-		uint32_t length = (callFinality) ? 16 : bytes+HEADER_BYTES; // The max amount of data we're reading is 1456, plus we need header (16 bytes)
-
-		packet_list[counter] = calloc(length, sizeof(uint8_t)); // Make the packet with 1472 bytes
-
-		uint8_t* message = calloc(length-4, sizeof(uint8_t)); // We need this for the checksum (first 3 headers + actual message/data)
-		assert(message); // A checksum is 4 bytes, so only exlude checksum (-4)
-			
-		uint8_t* my_packet = packet_list[counter]; // Assign a variable to the packet to make it easier to access and use less chars
-		assert(my_packet); // Assert we calloced correctly earlier
-
-		uint32_t type = (callFinality) ? 2 : 1; // The type of the packet we're sending (1 is DATA, 0 is ACK, 2 is FIN)
-		uint32_t seqNum = counter; // Sequence number of packet from counter
-
-		memcpy(message, &type, sizeof(uint32_t)); // Copy the type to the message for checksum
-		memcpy(message+4, &seqNum, sizeof(uint32_t)); // Copy the seqNum to the message for checksum
-		memcpy(message+8, &length, sizeof(uint32_t)); // Copy the length to the message for checksum
-		if (!callFinality) { memcpy(message+12, buffer, bytes); } // Copy the actual data to the message for checksum
-
-		uint32_t checksum = crc32(message, length-4);
-
-		type = htonl(type); // Convert these to network byte order since they're numbers and endianess could affect them
-		seqNum = htonl(seqNum); // We don't need to convert the data cause they're just characters
-		length = htonl(length);
-		checksum = htonl(checksum);
-		
-		memcpy(my_packet, &type, sizeof(uint32_t));
-		memcpy(my_packet+4, &seqNum, sizeof(uint32_t));
-		memcpy(my_packet+8, &length, sizeof(uint32_t));
-		memcpy(my_packet+12, &checksum, sizeof(uint32_t)); // First 16 bytes is the Header data
-		if (!callFinality) { memcpy(my_packet+16, buffer, bytes); } // Finally we copy the data
-		
-		counter+=1; // Increase the counter
-
-		free(message); // We don't need the checksum bytes anymore since we already calculated
-	}
-	
-	fclose(fptr);
+static uint32_t packet_bytes(uint8_t* packet)
+{ // Get the length of the pack quickly from its header
+	uint32_t length = 0;
+	memcpy(&length, packet+8, sizeof(uint32_t));
+	return ntohl(length);
 }
 
-static void generic_send(int socket, int i)
+static void generic_send(struct stream* st, unsigned int i)
 {
-	size_t length = 0; memcpy(&length, packet_list[i]+8, sizeof(uint32_t)); length = ntohl(length); // Get the length of the pack quickly so we can call sendto
-	if (isLogging) { fprintf(writeFile, "Packet sent; "); printPack(packet_list[i]); }
-	//send_packet(socket, packet_list[i], length, (struct sockaddr*)&dest_addr,(socklen_t)sizeof(dest_addr)); // For unreliable sending. Check UnreliableChannel
-	sendto(socket, packet_list[i], length, 0, (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr)); // 0 flags
+	uint8_t* packet = st->slots[i % window].packet; // The packet was built when it entered the window
+	uint32_t length = packet_bytes(packet);
+	if (isLogging) { trace_packet(TRACE_SENT, packet, 0); }
+	batch_send(&st->sendBatch, packet, length, (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr)); // Goes out with the next flush
+	st->stats.packetsSent+=1;
 }
 
-static int checkChecksum(uint8_t* buffer, unsigned int* storeCalc)
-{ // Check the checksum sent in the ACK packet. This check is not necessary for reasons listed in receiveThis(), but its good for logging purposes
-	uint8_t* data = calloc(12, sizeof(uint8_t));
-
+static int checkChecksum(uint8_t* buffer, size_t received, unsigned int* storeCalc)
+{ // Check the checksum sent in the ACK packet. With several packets in flight a corrupt ACK could name the wrong packet, so only valid ACKs are used
 	uint32_t type = 0;
 	uint32_t seqNum = 0;
 	uint32_t length = 0;
 	uint32_t checksum = 0;
+	uint32_t session = 0;
 
 	memcpy(&type, buffer, sizeof(uint32_t));
 	memcpy(&seqNum, buffer+4, sizeof(uint32_t));
 	memcpy(&length, buffer+8, sizeof(uint32_t));
 	memcpy(&checksum, buffer+12, sizeof(uint32_t));
+	memcpy(&session, buffer+16, sizeof(uint32_t));
 
 	type = ntohl(type);
 	seqNum = ntohl(seqNum);
 	length = ntohl(length);
+	session = ntohl(session);
 
-	memcpy(data, &type, sizeof(uint32_t));
-	memcpy(data+4, &seqNum, sizeof(uint32_t));
-	memcpy(data+8, &length, sizeof(uint32_t));
+	if (length < HEADER_BYTES || length > received) { *storeCalc = 0; return 0; } // The length itself is damaged
 
-	unsigned int crc = crc32(data, 12);
+	uint32_t crc = crc32_begin();
+	crc = crc32_update(crc, &type, sizeof(uint32_t));
+	crc = crc32_update(crc, &seqNum, sizeof(uint32_t));
+	crc = crc32_update(crc, &length, sizeof(uint32_t));
+	crc = crc32_update(crc, &session, sizeof(uint32_t));
+	crc = crc32_update(crc, buffer+HEADER_BYTES, length-HEADER_BYTES);
+	crc = crc32_end(crc);
 	*storeCalc = crc; // ntohl not required
-	free(data);
 	return (crc == ntohl(checksum));
 }
 
-static int receiveThis(int socket, int seq)
+static uint64_t now_us(void)
+{ // Monotonic clock in microseconds, used for all of the timers. Logged events are stamped with the latest reading
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	uint64_t now = (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+	if (isLogging) { trace_clock(now); }
+	return now;
+}
+
+static void heap_swap(struct stream* st, unsigned int i, unsigned int j)
 {
-	struct pollfd fds;
-	fds.fd = socket;
-	fds.events = POLLIN; // Make a poll to check if data has arrived to the socket within 500ms of sending
-	int activity;
-	
-	reset_poll:
-	activity = poll(&fds, 1, 500);  // If no reponse within 500ms, send the packet again and wait again for a reply.
-	if (activity <= 0) { 
-		// Amount of times we've attempted sending a packet and gotten no response
-		if (attempts == 5) { printf("No response after 5 attempts\n"); return 0; }
-		attempts+=1;
-		if (isLogging) { fprintf(writeFile, "Timeout for packet seqNum=%u... Resending\n\n", seq); }
-		generic_send(socket, seq);
-		goto reset_poll;
-	}
-	else // If the destination host is not receiving then this will loop forever
-	{ 
-		// We don't care about checksums because the Receiver ignores invalid checksums, 
-		// and so if the Receiver sends a message to us, it must have definitely received the packet. Also we force sending in order.
-		// So an ACK for a different sequence number other than one we're expecting can't arrive.
-		attempts = 0; // Amount of times we've attempted sending a packet and gotten no response
-		uint8_t responseBuf[1472] = {0};
-		//recv_packet(socket, responseBuf, 1472, NULL, NULL); // For unreliable receiving. See Unreliable Channel.
-		recvfrom(socket, responseBuf, 1472, 0, NULL, NULL);
+	struct slot* tmp = st->timerHeap[i];
+	st->timerHeap[i] = st->timerHeap[j];
+	st->timerHeap[j] = tmp;
+	st->timerHeap[i]->heapPos = i;
+	st->timerHeap[j]->heapPos = j;
+}
+
+static void heap_fix(struct stream* st, unsigned int i)
+{ // Restore the heap order around position i after its deadline changed or it was moved
+	struct slot** heap = st->timerHeap;
+	while (i && heap[i]->deadline < heap[(i-1)/2]->deadline) { heap_swap(st, i, (i-1)/2); i = (i-1)/2; }
+	while (1) {
+		unsigned int least = i, l = 2*i+1, r = 2*i+2;
+		if (l < st->timerCount && heap[l]->deadline < heap[least]->deadline) { least = l; }
+		if (r < st->timerCount && heap[r]->deadline < heap[least]->deadline) { least = r; }
+		if (least == i) { break; }
+		heap_swap(st, i, least);
+		i = least;
+	}
+}
+
+static void arm_timer(struct stream* st, struct slot* s, uint64_t now)
+{ // (Re)start the timer of a packet, each packet has its own deadline
+	s->deadline = now + st->rto;
+	if (s->heapPos < 0) {
+		s->heapPos = st->timerCount;
+		st->timerHeap[st->timerCount++] = s;
+	}
+	heap_fix(st, s->heapPos);
+}
+
+static void disarm_timer(struct stream* st, struct slot* s)
+{ // Stop the timer of an ACKed packet
+	if (s->heapPos < 0) { return; }
+	unsigned int i = s->heapPos;
+	s->heapPos = -1;
+	st->timerCount-=1;
+	if (i == st->timerCount) { return; }
+	st->timerHeap[i] = st->timerHeap[st->timerCount]; // Move the last timer into the hole
+	st->timerHeap[i]->heapPos = i;
+	heap_fix(st, i);
+}
+
+static void rtt_sample(struct stream* st, uint64_t rtt)
+{ // Jacobson/Karels: SRTT and RTTVAR are exponentially weighted, RTO = SRTT + 4*RTTVAR (RFC 6298) + the peer's ACK delay (RFC 9002)
+	if (!st->srtt) {
+		st->srtt = rtt;
+		st->rttvar = rtt/2;
+	} else {
+		uint64_t err = (st->srtt > rtt) ? st->srtt-rtt : rtt-st->srtt;
+		st->rttvar = (3*st->rttvar + err)/4;
+		st->srtt = (7*st->srtt + rtt)/8;
+	}
+	st->rto = st->srtt + 4*st->rttvar + PEER_ACK_DELAY_US; // A fresh sample also clears any backoff
+	if (st->rto < MIN_RTO_US) { st->rto = MIN_RTO_US; }
+	if (st->rto > MAX_RTO_US) { st->rto = MAX_RTO_US; }
+}
+
+static uint64_t giveup_us(struct stream* st)
+{ // How long we wait without any ACK before deciding the Receiver is gone. Scales with the measured RTT
+	if (!st->srtt) { return GIVEUP_MIN_US; } // Nothing measured yet, keep the old 2.5 seconds
+	uint64_t base_rto = st->srtt + 4*st->rttvar; // Without the backoff
+	return (base_rto*GIVEUP_RTOS > GIVEUP_MIN_US) ? base_rto*GIVEUP_RTOS : GIVEUP_MIN_US;
+}
+
+static unsigned int group_size(struct stream* st)
+{ // Chunks the next parity group covers. -f auto keeps the expected losses per group near FEC_TARGET_LOSSES, so one
+	// parity packet almost always repairs all of them, and stops sending parity on a link that hardly loses anything
+	if (!fecAuto) { return fecGroup; }
+	if (st->lossRate < FEC_OFF_LOSS) { return 0; }
+	double n = FEC_TARGET_LOSSES/st->lossRate - 1;
+	return (n < FEC_MIN_GROUP) ? FEC_MIN_GROUP : (n > FEC_MAX_GROUP) ? FEC_MAX_GROUP : (unsigned int)n;
+}
+
+static void count_sent(struct stream* st)
+{ // One more new packet for the loss rate, a sample is taken every FEC_SAMPLE of them
+	if (!fecAuto || ++st->lossSent < FEC_SAMPLE) { return; }
+	double rate = (double)st->lossSeen/st->lossSent;
+	st->lossRate = st->lossSamples++ ? (3*st->lossRate + rate)/4 : rate;
+	st->lossSent = st->lossSeen = 0;
+}
+
+static void count_loss(struct stream* st, struct slot* s)
+{ // A packet went missing. Counted once, whether its parity repairs it or it has to be resent
+	if (!fecAuto || s->missed) { return; }
+	s->missed = 1;
+	st->lossSeen+=1;
+}
+
+static void send_parity(struct stream* st)
+{ // The XOR of every chunk of the group, sent once right after the last one and never resent. The Receiver rebuilds
+	// one missing chunk of the group from it and the others, so that loss costs no retransmission round trip
+	if (st->parityNext % PARITY_RING == 0) { batch_flush(&st->sendBatch); } // The batch may still point at the packet about to be reused
+	uint8_t* packet = st->parityRing + (size_t)(st->parityNext++ % PARITY_RING)*maxPacket;
+	make_packet(packet, TYPE_PARITY | (st->groupEnd-st->groupFirst) << PARITY_COUNT_SHIFT, st->groupFirst, st->parity, st->groupBytes);
+	if (isLogging) { trace_packet(TRACE_SENT, packet, 0); }
+	batch_send(&st->sendBatch, packet, packet_bytes(packet), (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr));
+	st->stats.paritySent+=1;
+	uint64_t now = now_us();
+	struct cc_tx tx;
+	cc_on_send(&st->cc, now, packet_bytes(packet), &tx, 1); // Paced like any packet, but never ACKed, so never in flight
+	for (unsigned int q = st->groupFirst; q < st->groupEnd; q++) { // Their holes now wait for the repair before they are resent
+		struct slot* s = &st->slots[q % window];
+		if (s->seq == q && s->groupEnd == st->groupEnd) { s->repairAt = now; }
+	}
+}
+
+static void add_to_group(struct stream* st, unsigned int seq, struct slot* s)
+{ // Fold a chunk that just entered the window into the parity of its group, the data is still in cache. s is NULL for a
+	// chunk the Receiver already has, it counts all the same since the Receiver can read it back from its file
+	if (!st->groupEnd) {
+		unsigned int n = group_size(st);
+		if (!n) { return; } // No parity for now
+		st->groupFirst = seq;
+		st->groupEnd = (st->fin-seq < n) ? st->fin : seq+n;
+		st->groupSent = 0;
+	}
+	size_t offset = (size_t)seq*chunk;
+	size_t bytes = (fileSize-offset < chunk) ? fileSize-offset : chunk;
+	uint32_t type = 0;
+	if (s) { memcpy(&type, s->packet, sizeof(uint32_t)); }
+	int inPacket = s && treeMode && !(ntohl(type) & FLAG_COMPRESSED); // A chunk of the tree sent as is was just read into its packet
+	const uint8_t* data = inPacket ? s->packet+HEADER_BYTES : chunk_data(&st->reader, offset, bytes, st->chunkBuf);
+	if (seq == st->groupFirst) { memcpy(st->parity, data, bytes); st->groupBytes = bytes; } // Only the file's last chunk is shorter, and it ends its group
+	else { xor_into(st->parity, data, bytes); }
+	if (s) { s->groupEnd = st->groupEnd; st->groupSent+=1; }
+	if (seq+1 < st->groupEnd) { return; }
+	if (st->groupSent) { send_parity(st); }
+	st->groupEnd = 0;
+}
+
+static int skipped(struct stream* st, unsigned int seq)
+{ // The Receiver already has this chunk
+	return st->skip && seq < st->fin && (st->skip[(seq-st->first)/8] >> ((seq-st->first)%8) & 1);
+}
+
+static void skip_chunk(struct stream* st)
+{ // A chunk the Receiver already has counts as ACKed as soon as it enters the window, it is never built or sent
+	unsigned int seq = st->nextSeq++;
+	st->stats.chunksSkipped+=1;
+	if (st->parity) { add_to_group(st, seq, NULL); }
+	if (st->base == seq) { st->base+=1; return; } // Nothing in flight before it, the window just moves on
+	struct slot* s = &st->slots[seq % window];
+	s->seq = seq;
+	s->acked = 1;
+	s->attempts = 0;
+	s->bytes = 0;
+	memset(&s->tx, 0, sizeof(s->tx));
+}
+
+static void send_window(struct stream* st, unsigned int seq, uint32_t flags)
+{ // Build a packet on demand as it enters the window, send it for the first time and start its timer
+	struct slot* s = &st->slots[seq % window];
+	s->seq = seq;
+	s->acked = 0;
+	s->attempts = 0;
+	s->groupEnd = 0;
+	s->repairAt = 0;
+	s->missed = 0;
+	if (st->ahead) { __atomic_store_n(&st->aheadBase, seq, __ATOMIC_RELEASE); } // Frees the entry of the chunk before it
+	build_packet(st, seq, flags, s->packet);
+	generic_send(st, seq);
+	s->sentAt = now_us();
+	s->bytes = packet_bytes(s->packet);
+	cc_on_send(&st->cc, s->sentAt, s->bytes, &s->tx, 0);
+	arm_timer(st, s, s->sentAt);
+	if (seq < st->fin) { count_sent(st); }
+	if (st->parity && seq < st->fin) { add_to_group(st, seq, s); }
+}
+
+static void mark_acked(struct stream* st, unsigned int seq, unsigned int* count)
+{ // Record a packet an ACK covers for the first time
+	struct slot* s = &st->slots[seq % window];
+	if (s->acked) { return; } // Duplicate, an earlier ACK already counted
+	s->acked = 1;
+	disarm_timer(st, s);
+	st->newlyAcked[(*count)++] = s;
+	if (seq >= st->highAcked) { st->highAcked = seq+1; }
+	if (s->tx.sentAt > st->rackSentAt) { st->rackSentAt = s->tx.sentAt; }
+}
+
+static void log_window(struct stream* st)
+{ // A window event whenever the congestion window changed, after the ACKs and losses that changed it
+	if (st->cc.cwnd == st->loggedCwnd) { return; }
+	st->loggedCwnd = st->cc.cwnd;
+	uint32_t inflight = (st->cc.inflight < UINT32_MAX) ? st->cc.inflight : UINT32_MAX;
+	trace_event(TRACE_WINDOW, 0, st->base, inflight, 0, (st->cc.cwnd < UINT32_MAX) ? st->cc.cwnd : UINT32_MAX);
+}
+
+static void publish_stats(struct stream* st, uint64_t now)
+{ // Hand a copy of the stream's stats to the reporting thread, a few times per report interval (METRICS_PUBLISHES)
+	st->stats.cwnd = st->cc.cwnd;
+	st->stats.inflight = st->cc.inflight;
+	st->stats.srtt = st->srtt;
+	st->stats.rto = st->rto;
+	pthread_mutex_lock(&statsLock);
+	published[st->index] = st->stats;
+	pthread_mutex_unlock(&statsLock);
+	st->publishAt = now + (uint64_t)statsEvery*1000/METRICS_PUBLISHES;
+}
+
+static void add_stats(struct stream_stats* into, const struct stream_stats* s)
+{ // Counters and histograms add up, of the gauges the window ones add up and the timing ones keep the slowest stream's
+	into->packetsSent += s->packetsSent;
+	into->fastRetransmits += s->fastRetransmits;
+	into->timeouts += s->timeouts;
+	into->acks += s->acks;
+	into->acksCorrupt += s->acksCorrupt;
+	into->chunksCompressed += s->chunksCompressed;
+	into->bytesSaved += s->bytesSaved;
+	into->chunksSkipped += s->chunksSkipped;
+	into->paritySent += s->paritySent;
+	into->bytesAcked += s->bytesAcked;
+	into->cwnd = (into->cwnd == UINT64_MAX || s->cwnd == UINT64_MAX) ? UINT64_MAX : into->cwnd + s->cwnd; // Without congestion control it is unlimited
+	into->inflight += s->inflight;
+	if (s->srtt > into->srtt) { into->srtt = s->srtt; }
+	if (s->rto > into->rto) { into->rto = s->rto; }
+	hist_merge(&into->rtt, &s->rtt);
+	hist_merge(&into->delivery, &s->delivery);
+}
+
+static int report_stats(char* buf, size_t cap, int final)
+{ // The JSON line of the metrics (see Metrics.h), over every stream. Goodput is of the last interval and of the whole run
+	static struct stream_stats total; // Only the reporting thread calls this
+	static uint64_t lastAt = 0, lastBytes = 0;
+	memset(&total, 0, sizeof(total));
+	pthread_mutex_lock(&statsLock);
+	for (unsigned int i = 0; i < numStreams; i++) { add_stats(&total, &published[i]); }
+	pthread_mutex_unlock(&statsLock);
+	uint64_t now = now_us();
+	double seconds = (now-startedAt)/1e6;
+	double interval = (now-(lastAt ? lastAt : startedAt))/1e6;
+	double progress = (double)(total.bytesAcked + (uint64_t)total.chunksSkipped*chunk)/fileSize;
+	char cwnd[24] = "null";
+	if (total.cwnd != UINT64_MAX) { snprintf(cwnd, sizeof(cwnd), "%llu", (unsigned long long)total.cwnd); }
+	int n = snprintf(buf, cap, "{\"time\":%.3f,\"role\":\"sender\",\"final\":%s,\"progress\":%.4f,\"bytes_acked\":%llu,"
+		"\"goodput_mbps\":%.2f,\"average_mbps\":%.2f,\"packets_sent\":%lu,\"resent\":%lu,\"fast_retransmits\":%lu,\"timeouts\":%lu,"
+		"\"acks\":%lu,\"corrupt_acks\":%lu,\"parity_sent\":%lu,\"chunks_skipped\":%lu,\"chunks_compressed\":%lu,"
+		"\"cwnd_bytes\":%s,\"inflight_bytes\":%llu,\"srtt_us\":%llu,\"rto_us\":%llu,\"rtt_us\":",
+		seconds, final ? "true" : "false", (progress < 1) ? progress : 1, total.bytesAcked,
+		interval > 0 ? (total.bytesAcked-lastBytes)*8/interval/1e6 : 0, seconds > 0 ? total.bytesAcked*8/seconds/1e6 : 0,
+		total.packetsSent, total.fastRetransmits+total.timeouts, total.fastRetransmits, total.timeouts,
+		total.acks, total.acksCorrupt, total.paritySent, total.chunksSkipped, total.chunksCompressed,
+		cwnd, (unsigned long long)total.inflight, (unsigned long long)total.srtt, (unsigned long long)total.rto);
+	n += hist_json(buf+n, cap-n, &total.rtt);
+	n += snprintf(buf+n, cap-n, ",\"delivery_us\":");
+	n += hist_json(buf+n, cap-n, &total.delivery);
+	n += snprintf(buf+n, cap-n, "}");
+	lastAt = now;
+	lastBytes = total.bytesAcked;
+	return n;
+}
+
+static void fast_retransmit(struct stream* st)
+{ // Resend the holes the selective ACKs revealed without waiting for their timers (RACK-like). A hole only counts once a
+	// packet sent after its last transmission got through, which limits every hole to one resend per round trip. It is
+	// lost when a packet DUPTHRESH past it was ACKed, or when it is a quarter RTT overdue, for flights too short for that
+	uint64_t now = now_us();
+	uint64_t overdue = st->srtt + st->srtt/4;
+	st->lossCheckAt = 0;
+	for (unsigned int seq = st->base; seq < st->highAcked; seq++) {
+		struct slot* s = &st->slots[seq % window];
+		if (s->acked || s->tx.sentAt >= st->rackSentAt) { continue; }
+		if (seq+DUPTHRESH >= st->highAcked && now < s->tx.sentAt+overdue) { // Might only be reordered, look again when it is overdue
+			if (!st->lossCheckAt || s->tx.sentAt+overdue < st->lossCheckAt) { st->lossCheckAt = s->tx.sentAt+overdue; }
+			continue;
+		}
+		count_loss(st, s);
+		if (s->groupEnd && !s->attempts) { // The parity of its group may still rebuild it, a resend would only arrive after that
+			if (!s->repairAt && s->groupEnd <= st->base+window) { continue; } // The parity goes out with the last chunk of the group
+			if (s->repairAt && st->rackSentAt <= s->repairAt && now < s->repairAt+overdue) { // Nothing sent after the parity was ACKed yet
+				if (!st->lossCheckAt || s->repairAt+overdue < st->lossCheckAt) { st->lossCheckAt = s->repairAt+overdue; }
+				continue;
+			}
+		}
+		if (s->attempts < UINT8_MAX) { s->attempts+=1; }
+		st->stats.fastRetransmits+=1;
+		if (isLogging) { trace_event(TRACE_FAST_RETRANSMIT, 0, seq, 0, 0, 0); }
+		cc_on_loss(&st->cc, now, &s->tx, 0);
+		cc_on_send(&st->cc, now, s->bytes, &s->tx, 1);
+		generic_send(st, seq);
+		arm_timer(st, s, now);
+	}
+}
 
+static void receiveAcks(struct stream* st)
+{ // Drain every ACK waiting on the socket. Each ACK covers everything below its seqNum, plus a bitmap of the packets
+	// received past the first hole: bit i (LSB first) is seqNum+1+i
+	uint8_t* responseBuf = NULL;
+	size_t received = 0;
+	if (isLogging) { now_us(); } // The ACKs are logged with the time they were read, not the time before the wait
+	while (batch_recv(&st->ackBatch, 0) > 0) // The socket is non-blocking, so this stops once it is empty
+	while (batch_next(&st->ackBatch, &responseBuf, &received, NULL, NULL))
+	{
+		if (received < HEADER_BYTES) { continue; } // Too short to even hold a header
 		unsigned int checksum_calc = 0;
-		int result = checkChecksum(responseBuf, &checksum_calc);
-		if (isLogging) { 
-			fprintf(writeFile, "Packet received; "); printPack(responseBuf); fprintf(writeFile, "checksum_calculated=%x; ", checksum_calc);
-			fprintf(writeFile, "status="); result ? fprintf(writeFile, "NOT_CORRUPT\n\n") : fprintf(writeFile, "CORRUPT\n\n");
+		int result = checkChecksum(responseBuf, received, &checksum_calc);
+		if (isLogging) { trace_packet(result ? TRACE_RECEIVED_OK : TRACE_CORRUPT, responseBuf, checksum_calc); }
+		// With several packets in flight a corrupt ACK could name the wrong packet, so it must be ignored
+		if (!result) { st->stats.acksCorrupt+=1; continue; }
+
+		uint32_t type = 0; memcpy(&type, responseBuf, sizeof(uint32_t)); type = ntohl(type);
+		uint32_t seq = 0; memcpy(&seq, responseBuf+4, sizeof(uint32_t)); seq = ntohl(seq);
+		uint32_t session = 0; memcpy(&session, responseBuf+16, sizeof(uint32_t));
+		if ((type & TYPE_MASK) != TYPE_ACK || ntohl(session) != sessionId) { continue; } // A late SYNACK duplicate, or a stray ACK of an earlier run
+		st->stats.acks+=1;
+		if (seq < st->base) { continue; } // An older ACK overtaken by a newer one
+		if (seq > st->nextSeq) { // The Receiver counts the chunks it already had, which we may not have reached yet. Anything else is bogus
+			unsigned int q = st->nextSeq;
+			while (q < seq && skipped(st, q)) { q+=1; }
+			if (q != seq) { continue; }
+		}
+
+		unsigned int count = 0;
+		for (unsigned int q = st->base; q < seq && q < st->nextSeq; q++) { mark_acked(st, q, &count); } // Cumulative part
+		uint8_t* sack = responseBuf+HEADER_BYTES;
+		uint32_t sackBits = (packet_bytes(responseBuf)-HEADER_BYTES)*8; // checkChecksum made sure the length is sane
+		for (uint32_t i = 0; i < sackBits && seq+1+i < st->nextSeq; i++) {
+			if (sack[i/8] & (1 << (i%8))) { mark_acked(st, seq+1+i, &count); }
+		}
+		if ((type & (FLAG_PENDING | FLAG_REFUSED)) && seq == st->fin && st->base == st->fin) { // Only the FIN is left
+			st->lastAck = now_us(); // The Receiver is alive, however long it takes
+			st->storing = (type & FLAG_PENDING) != 0;
+			st->slots[st->fin % window].attempts = 1; // Its ACK waits for the file, so it gives no RTT sample
+			st->storeFailed = (type & FLAG_REFUSED) != 0;
+			continue;
+		}
+		if (!count) { continue; } // Nothing new
+
+		st->lastAck = now_us();
+		struct slot* newest = NULL; // One RTT sample per ACK, from the latest packet it covers. Older ones waited for the delayed ACK
+		for (unsigned int i = 0; i < count; i++) {
+			struct slot* s = st->newlyAcked[i];
+			if (!s->attempts && (!newest || s->sentAt > newest->sentAt)) { newest = s; } // Karn's rule: a resent packet could be either copy
+		}
+		uint64_t rtt = newest ? st->lastAck - newest->sentAt : 0;
+		if (rtt) { rtt_sample(st, rtt); hist_add(&st->stats.rtt, rtt); }
+		for (unsigned int i = 0; i < count; i++) {
+			struct slot* s = st->newlyAcked[i];
+			cc_on_ack(&st->cc, st->lastAck, s->bytes, &s->tx, (s == newest) ? rtt : 0);
+			hist_add(&st->stats.delivery, st->lastAck - s->sentAt);
+			size_t offset = (size_t)s->seq*chunk; // The chunk as it is in the file, compressed or not
+			if (s->seq < st->fin) { st->stats.bytesAcked += (fileSize-offset < chunk) ? fileSize-offset : chunk; }
+		}
+		while (st->base < st->nextSeq && st->slots[st->base % window].acked) { st->base+=1; } // Slide the window past every ACKed packet
+	}
+	fast_retransmit(st);
+	if (isLogging) { log_window(st); }
+}
+
+static int checkTimers(struct stream* st)
+{ // Resend every packet whose timer expired. Returns 0 if the Receiver stopped answering altogether
+	uint64_t now = now_us();
+	if (st->timerCount && now - st->lastAck >= giveup_us(st)) {
+		printf("No response for %llu ms (stripe %u)\n", (unsigned long long)(now-st->lastAck)/1000, st->index);
+		return 0;
+	}
+
+	while (st->timerCount && st->timerHeap[0]->deadline <= now)
+	{
+		struct slot* s = st->timerHeap[0];
+		if (st->storing) { // Only the FIN is left, and nothing was lost: ask again whether the file is stored
+			generic_send(st, s->seq);
+			s->deadline = now + STORE_POLL_US;
+			heap_fix(st, s->heapPos);
+			continue;
 		}
+		if (st->lastAck > s->tx.sentAt && st->lastAck + st->rto > now) { // ACKs of new data restart the timers (RFC 6298 5.3), a
+			arm_timer(st, s, st->lastAck); // late flight is not lost while its ACKs are still coming. A hole among them is RACK's
+			continue;
+		}
+		if (now >= st->backoffUntil) { // Exponential backoff, at most once per RTO so a burst of losses only doubles it once
+			st->rto = (2*st->rto < MAX_RTO_US) ? 2*st->rto : MAX_RTO_US;
+			st->backoffUntil = now + st->rto;
+		}
+		count_loss(st, s);
+		if (s->attempts < UINT8_MAX) { s->attempts+=1; }
+		st->stats.timeouts+=1;
+		if (isLogging) { trace_event(TRACE_TIMEOUT, 0, s->seq, 0, 0, st->rto); }
+		cc_on_loss(&st->cc, now, &s->tx, now - st->lastAck >= st->rto); // Severe when nothing at all was ACKed for a whole RTO
+		cc_on_send(&st->cc, now, s->bytes, &s->tx, 1);
+		generic_send(st, s->seq);
+		arm_timer(st, s, now);
 	}
+	if (isLogging) { log_window(st); }
+	return 1;
+}
+
+static int nextTimeout(struct stream* st, struct timespec* ts, uint64_t sendAt)
+{ // Time until the earliest timer fires, we give up, or the pacer releases the next packet (sendAt, 0 if none waits), for ppoll().
+	// Returns 0 if there is nothing to wait for
+	if (!st->timerCount && !sendAt) { return 0; }
+	uint64_t now = now_us();
+	uint64_t deadline = st->timerCount ? st->timerHeap[0]->deadline : sendAt;
+	if (st->timerCount && st->lastAck + giveup_us(st) < deadline) { deadline = st->lastAck + giveup_us(st); } // A backed off timer may fire long after that
+	if (sendAt && sendAt < deadline) { deadline = sendAt; }
+	if (st->lossCheckAt && st->lossCheckAt < deadline) { deadline = st->lossCheckAt; }
+	uint64_t wait = (deadline > now) ? deadline-now : 0;
+	ts->tv_sec = wait/1000000;
+	ts->tv_nsec = (wait%1000000)*1000;
 	return 1;
 }
 
+static void put32(uint8_t* p, uint32_t v) { v = htonl(v); memcpy(p, &v, sizeof(uint32_t)); }
+
+static const unsigned int mtuPlateaus[] = { 65535, 32000, 17914, 9000, 4352, 2002 }; // Common MTUs above Ethernet (RFC 1191 plateaus and jumbo frames)
+
+static unsigned int probe_path(void)
+{ // DPLPMTUD-style (RFC 8899) search for the largest packet that reaches the Receiver, done once before the SYNs since it
+	// fixes how the file is split. Padding only probes, one per plateau up to -m and the route's MTU, go out with DF set
+	// and the base size last: once a probe is answered, the larger ones sent before it had their chance too (give or
+	// take a quarter RTT of jitter). The Receiver only answers sizes it accepts. Returns the largest packet answered,
+	// the base size when probing can't help, 0 if the Receiver never answered
+	unsigned int base = ((mtuCap < BASE_MTU) ? mtuCap : BASE_MTU) - IP_UDP_BYTES;
+	if (fileSize <= base-HEADER_BYTES) { return base; } // One packet holds all of it
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(sock != -1);
+	int pmtud = IP_PMTUDISC_PROBE; // Set DF and never fragment, whatever path MTU the kernel has cached
+	setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &pmtud, sizeof(pmtud));
+	assert(connect(sock, (struct sockaddr*)&dest_addr, sizeof(dest_addr)) == 0); // IP_MTU needs the route
+	fcntl(sock, F_SETFL, O_NONBLOCK);
+	int routeMtu = 0;
+	socklen_t optLen = sizeof(routeMtu);
+	unsigned int limit = mtuCap; // Packets beyond the interface MTU would only fail with EMSGSIZE
+	if (getsockopt(sock, IPPROTO_IP, IP_MTU, &routeMtu, &optLen) == 0 && routeMtu > 0 && (unsigned int)routeMtu < limit) { limit = routeMtu; }
+
+	unsigned int sizes[sizeof(mtuPlateaus)/sizeof(mtuPlateaus[0]) + 2];
+	unsigned int n = 0;
+	if (limit > BASE_MTU) { sizes[n++] = limit-IP_UDP_BYTES; }
+	for (unsigned int i = 0; i < sizeof(mtuPlateaus)/sizeof(mtuPlateaus[0]); i++) {
+		if (mtuPlateaus[i] < limit && mtuPlateaus[i] > BASE_MTU) { sizes[n++] = mtuPlateaus[i]-IP_UDP_BYTES; }
+	}
+	if (!n) { close(sock); return base; } // Nothing larger to look for, as on most Internet paths
+	sizes[n++] = base;
+
+	uint8_t* padding = calloc(1, sizes[0]);
+	uint8_t* probes = malloc((size_t)n*sizes[0]); // Every probe keeps its buffer until the flush
+	assert(padding && probes);
+	for (unsigned int i = 0; i < n; i++) { make_packet(probes+(size_t)i*sizes[0], TYPE_PROBE, sizes[i], padding, sizes[i]-HEADER_BYTES); }
+	struct send_batch sendBatch;
+	struct recv_batch ackBatch;
+	batch_send_init(&sendBatch, sock, 0); // One datagram per probe, GSO would merge them
+	batch_recv_init(&ackBatch, sock, MAX_ACK, batched);
+
+	struct pollfd fds = { .fd = sock, .events = POLLIN };
+	unsigned int best = 0;
+	uint64_t rto = INITIAL_RTO_US, start = now_us(), doneAt = 0;
+	while (!doneAt && now_us() - start < GIVEUP_MIN_US) {
+		for (unsigned int i = 0; i < n; i++) {
+			if (isLogging) { trace_packet(TRACE_SENT, probes+(size_t)i*sizes[0], 0); }
+			batch_send(&sendBatch, probes+(size_t)i*sizes[0], sizes[i], (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr));
+		}
+		batch_flush(&sendBatch);
+		uint64_t sentAt = now_us();
+		uint64_t until = sentAt + rto;
+		if (until > start + GIVEUP_MIN_US) { until = start + GIVEUP_MIN_US; }
+
+		uint64_t now;
+		while ((now = now_us()) < (doneAt ? doneAt : until)) {
+			uint64_t wait = (doneAt ? doneAt : until) - now;
+			struct timespec ts = { wait/1000000, (wait%1000000)*1000 };
+			if (ppoll(&fds, 1, &ts, NULL) <= 0) { continue; }
+			uint8_t* responseBuf = NULL;
+			size_t received = 0;
+			while (batch_recv(&ackBatch, 0) > 0)
+			while (batch_next(&ackBatch, &responseBuf, &received, NULL, NULL)) {
+				unsigned int checksum_calc = 0;
+				if (received < HEADER_BYTES || !checkChecksum(responseBuf, received, &checksum_calc)) { continue; }
+				uint32_t type = 0; memcpy(&type, responseBuf, sizeof(uint32_t));
+				uint32_t size = 0; memcpy(&size, responseBuf+4, sizeof(uint32_t));
+				uint32_t session = 0; memcpy(&session, responseBuf+16, sizeof(uint32_t));
+				if (ntohl(type) != TYPE_PROBEACK || ntohl(session) != sessionId) { continue; }
+				if (isLogging) { trace_packet(TRACE_RECEIVED, responseBuf, 0); }
+				if (ntohl(size) > best && ntohl(size) <= sizes[0]) { best = ntohl(size); }
+				if (!doneAt) { doneAt = now_us() + (now_us()-sentAt)/4; }
+			}
+		}
+		rto = (2*rto < MAX_RTO_US) ? 2*rto : MAX_RTO_US; // Nothing came back, back off like the SYN
+	}
+	if (isLogging) { trace_event(TRACE_PATH_MTU, 0, 0, 0, 0, best); }
+	batch_recv_free(&ackBatch);
+	free(probes);
+	free(padding);
+	close(sock);
+	return best;
+}
+
+static int handshake(struct stream* st)
+{ // Send the SYN (with the file size, so the Receiver can preallocate) until the SYNACK arrives. Its round trip is also our first RTT sample
+	// Payload: file size (hi, lo), stripe index, stripe count, first DATA seq and FIN seq of the stripe, chunk size, file version (hi, lo), then the file name
+	uint8_t syn[SYN_BYTES+MAX_NAME];
+	uint8_t info[SYN_BYTES-HEADER_BYTES+MAX_NAME];
+	size_t nameLen = strlen(fileName);
+	put32(info, (uint64_t)fileSize >> 32);
+	put32(info+4, (uint64_t)fileSize & 0xFFFFFFFF);
+	put32(info+8, st->index);
+	put32(info+12, numStreams);
+	put32(info+16, st->first);
+	put32(info+20, st->fin);
+	put32(info+24, chunk);
+	put32(info+28, fileVersion >> 32);
+	put32(info+32, fileVersion & 0xFFFFFFFF);
+	memcpy(info+36, fileName, nameLen);
+	size_t synBytes = SYN_BYTES+nameLen;
+	make_packet(syn, TYPE_SYN | (delta ? FLAG_DELTA : 0) | (treeMode ? FLAG_TREE : 0), st->first, info, synBytes-HEADER_BYTES);
+
+	struct pollfd fds;
+	fds.fd = st->socket;
+	fds.events = POLLIN;
+	int resent = 0;
+	uint64_t start = now_us();
+	while (now_us() - start < giveup_us(st))
+	{
+		if (isLogging) { trace_packet(TRACE_SENT, syn, 0); }
+		batch_send(&st->sendBatch, syn, synBytes, (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr));
+		batch_flush(&st->sendBatch);
+		uint64_t sentAt = now_us();
+		uint64_t until = sentAt + st->rto; // Resend then, unless it is time to give up first
+		if (until > start + giveup_us(st)) { until = start + giveup_us(st); }
+
+		uint64_t now;
+		while ((now = now_us()) < until) {
+			uint64_t wait = until - now;
+			struct timespec ts = { wait/1000000, (wait%1000000)*1000 };
+			if (ppoll(&fds, 1, &ts, NULL) <= 0) { continue; }
+			uint8_t* responseBuf = NULL;
+			size_t received = 0;
+			while (batch_recv(&st->ackBatch, 0) > 0)
+			while (batch_next(&st->ackBatch, &responseBuf, &received, NULL, NULL)) {
+				unsigned int checksum_calc = 0;
+				if (received < HEADER_BYTES || !checkChecksum(responseBuf, received, &checksum_calc)) { continue; }
+				uint32_t type = 0; memcpy(&type, responseBuf, sizeof(uint32_t));
+				uint32_t session = 0; memcpy(&session, responseBuf+16, sizeof(uint32_t));
+				if ((ntohl(type) & TYPE_MASK) != TYPE_SYNACK || ntohl(session) != sessionId) { continue; }
+				if (isLogging) { trace_packet(TRACE_RECEIVED, responseBuf, 0); }
+				if (ntohl(type) & FLAG_REFUSED) {
+					uint32_t reason = 0; if (received >= HEADER_BYTES+4) { memcpy(&reason, responseBuf+HEADER_BYTES, sizeof(uint32_t)); reason = ntohl(reason); }
+					if (reason == REFUSE_NOT_DIR) { printf("The Receiver refused the transfer (stripe %u): a directory needs an output directory\n", st->index); }
+					else if (reason == REFUSE_NAME) { printf("The Receiver refused the transfer (stripe %u): %s is not a valid name there\n", st->index, fileName); }
+					else { printf("The Receiver refused the transfer (stripe %u)\n", st->index); }
+					return 0;
+				}
+				st->peerHasMap = (ntohl(type) & FLAG_HAS_MAP) != 0;
+				st->lastAck = now_us();
+				if (!resent) { rtt_sample(st, st->lastAck - sentAt); } // Karn's rule applies to the SYN too
+				return 1;
+			}
+		}
+		resent = 1;
+		st->rto = (2*st->rto < MAX_RTO_US) ? 2*st->rto : MAX_RTO_US; // Nothing came back, back off like any other timeout
+		if (isLogging) { trace_event(TRACE_SYN_TIMEOUT, 0, 0, 0, 0, st->rto); }
+	}
+	printf("No response to the SYN (stripe %u)\n", st->index);
+	return 0;
+}
+
+static void build_map_request(struct stream* st, unsigned int page, uint8_t* req)
+{ // MAPREQ for one page of the stripe: the number of chunks, then with -r the signature of every one of them
+	uint8_t info[4+MAP_PAGE*SIG_BYTES];
+	unsigned int seq = st->first + page*mapPage;
+	unsigned int count = (st->fin-seq < mapPage) ? st->fin-seq : mapPage;
+	size_t bytes = 4;
+	put32(info, count);
+	for (unsigned int i = 0; delta && i < count; i++, bytes += SIG_BYTES) {
+		size_t offset = (size_t)(seq+i)*chunk;
+		size_t len = (fileSize-offset < chunk) ? fileSize-offset : chunk;
+		const uint8_t* data = chunk_data(&st->reader, offset, len, st->chunkBuf);
+		put32(info+bytes, rolling_sum(data, len));
+		put32(info+bytes+4, crc32(data, len));
+	}
+	make_packet(req, TYPE_MAPREQ, seq, info, bytes);
+}
+
+static int fetch_map(struct stream* st)
+{ // Ask the Receiver which chunks of the stripe it already has, a page of chunks per MAPREQ. Its MAP answers are bitmaps,
+	// and those chunks are never sent. Only the oldest request is resent on a timeout, the others are probably queued
+	// behind it while the Receiver reads its file, and the timeout grows with how long the answers take
+	unsigned int span = st->fin-st->first;
+	unsigned int pages = (span+mapPage-1)/mapPage;
+	uint8_t* skip = calloc(span/8+1, 1);
+	uint8_t* answered = calloc(pages+1, 1);
+	uint8_t* requests = malloc((size_t)MAP_INFLIGHT*maxPacket); // Requests in flight, they stay queued until the flush
+	uint64_t sentAt[MAP_INFLIGHT];
+	assert(skip && answered && requests);
+	struct pollfd fds;
+	fds.fd = st->socket;
+	fds.events = POLLIN;
+	uint64_t timeout = st->rto;
+	uint64_t lastHeard = now_us();
+	unsigned int low = 0, next = 0; // Oldest unanswered page, first page never asked for
+	while (low < pages) {
+		uint64_t now = now_us();
+		for (; next < pages && next < low+MAP_INFLIGHT; next++) {
+			uint8_t* req = requests + (size_t)(next % MAP_INFLIGHT)*maxPacket;
+			build_map_request(st, next, req);
+			if (isLogging) { trace_packet(TRACE_SENT, req, 0); }
+			batch_send(&st->sendBatch, req, packet_bytes(req), (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr));
+			sentAt[next % MAP_INFLIGHT] = now;
+		}
+		if (now - sentAt[low % MAP_INFLIGHT] >= timeout) {
+			uint8_t* req = requests + (size_t)(low % MAP_INFLIGHT)*maxPacket;
+			batch_send(&st->sendBatch, req, packet_bytes(req), (struct sockaddr*)&dest_addr, (socklen_t)sizeof(dest_addr));
+			sentAt[low % MAP_INFLIGHT] = now;
+			timeout = (2*timeout < MAX_RTO_US) ? 2*timeout : MAX_RTO_US;
+			if (isLogging) { trace_event(TRACE_MAPREQ_TIMEOUT, 0, st->first + low*mapPage, 0, 0, 0); }
+		}
+		batch_flush(&st->sendBatch);
+		if (now - lastHeard >= giveup_us(st)) {
+			printf("No response to the map requests (stripe %u)\n", st->index);
+			free(requests); free(answered); free(skip);
+			return 0;
+		}
+
+		uint64_t until = sentAt[low % MAP_INFLIGHT] + timeout;
+		if (lastHeard + giveup_us(st) < until) { until = lastHeard + giveup_us(st); }
+		uint64_t wait = (until > now) ? until-now : 0;
+		struct timespec ts = { wait/1000000, (wait%1000000)*1000 };
+		if (ppoll(&fds, 1, &ts, NULL) <= 0) { continue; }
+		uint8_t* responseBuf = NULL;
+		size_t received = 0;
+		while (batch_recv(&st->ackBatch, 0) > 0)
+		while (batch_next(&st->ackBatch, &responseBuf, &received, NULL, NULL)) {
+			unsigned int checksum_calc = 0;
+			if (received < HEADER_BYTES || !checkChecksum(responseBuf, received, &checksum_calc)) { continue; }
+			uint32_t type = 0; memcpy(&type, responseBuf, sizeof(uint32_t));
+			uint32_t seq = 0; memcpy(&seq, responseBuf+4, sizeof(uint32_t)); seq = ntohl(seq);
+			uint32_t session = 0; memcpy(&session, responseBuf+16, sizeof(uint32_t));
+			if (ntohl(type) != TYPE_MAP || ntohl(session) != sessionId || seq < st->first || (seq-st->first) % mapPage) { continue; }
+			unsigned int page = (seq-st->first)/mapPage;
+			unsigned int count = (st->fin-seq < mapPage) ? st->fin-seq : mapPage;
+			if (page < low || page >= next || answered[page] || packet_bytes(responseBuf)-HEADER_BYTES != (count+7)/8) { continue; }
+			if (isLogging) { trace_packet(TRACE_RECEIVED, responseBuf, 0); }
+			for (unsigned int i = 0; i < count; i++) {
+				unsigned int bit = seq-st->first+i;
+				if (responseBuf[HEADER_BYTES+i/8] & (1 << (i%8))) { skip[bit/8] |= 1 << (bit%8); }
+			}
+			answered[page] = 1;
+			lastHeard = now_us();
+			uint64_t took = lastHeard - sentAt[page % MAP_INFLIGHT];
+			if (2*took > timeout) { timeout = 2*took; }
+		}
+		while (low < next && answered[low]) { low+=1; }
+	}
+	st->lastAck = lastHeard;
+	__atomic_store_n(&st->skip, skip, __ATOMIC_RELEASE); // The compressors leave these chunks alone from now on
+	free(requests);
+	free(answered);
+	return 1;
+}
+
+static int transfer(struct stream* st)
+{ // Selective repeat: keep up to window packets in flight, each with its own timer, and resend only the ones that time out
+	struct pollfd fds;
+	fds.fd = st->socket;
+	fds.events = POLLIN;
+
+	while (st->base <= st->fin)
+	{
+		// The FIN is only sent once every DATA packet has been ACKed, since the Receiver exits as soon as it has every FIN
+		unsigned int limit = (st->base == st->fin) ? st->fin+1 : st->fin;
+		uint64_t now = now_us();
+		if (statsEvery && now >= st->publishAt) { publish_stats(st, now); }
+		// The send window bounds what the Receiver can hold, the congestion window what the network can, and the pacer spreads it out
+		while (st->nextSeq < limit && st->nextSeq < st->base+window) {
+			if (skipped(st, st->nextSeq)) {
+				skip_chunk(st);
+				if (st->base == st->fin) { limit = st->fin+1; } // Skipping the rest of the stripe lets the FIN go right away
+				continue;
+			}
+			if (!cc_can_send(&st->cc, now, maxPacket)) { break; }
+			unsigned int seq = st->nextSeq++;
+			// The last packet the windows let through asks for an immediate ACK. A flight shorter than the Receiver's
+			// ACK interval would otherwise wait for its delayed ACK timer every round trip
+			int last = (st->nextSeq >= limit || st->nextSeq >= st->base+window || cc_window_full(&st->cc, 2*maxPacket));
+			send_window(st, seq, last ? FLAG_ACK_NOW : 0);
+		}
+		batch_flush(&st->sendBatch); // New packets and any resends go out in as few system calls as possible
+		if (st->ahead) { wake_compressors(); }
+
+		uint64_t sendAt = 0; // Only the pacer holds back the next packet, wake up for it
+		if (st->nextSeq < limit && st->nextSeq < st->base+window && cc_can_send(&st->cc, cc_next_send(&st->cc), maxPacket)) { sendAt = cc_next_send(&st->cc); }
+		struct timespec ts;
+		int activity = ppoll(&fds, 1, nextTimeout(st, &ts, sendAt) ? &ts : NULL, NULL); // Wait for an ACK, the earliest timer or the pacer
+		if (activity > 0) { receiveAcks(st); release_pages(st); }
+		else if (st->lossCheckAt && now_us() >= st->lossCheckAt) { fast_retransmit(st); }
+		if (st->storeFailed) { printf("The Receiver could not store the file (stripe %u)\n", st->index); return 0; }
+		if (!checkTimers(st)) { return (st->base == st->fin && !st->storing); } // The Receiver exits once it ACKs the last FIN, so that ACK may be gone for good. Not while it was still storing the file
+	}
+	return 1;
+}
+
+static void* run_stream(void* arg)
+{ // Thread body: announce the stripe, then send every packet of it through its own sliding window
+	struct stream* st = arg;
+	st->sent = handshake(st) && (!st->peerHasMap || fetch_map(st)) && transfer(st);
+	if (statsEvery) { publish_stats(st, now_us()); } // Its final numbers
+	return NULL;
+}
+
+static void init_stream(struct stream* st, unsigned int index)
+{ // Stripes are contiguous ranges of sequence numbers of (almost) equal length, so each one is a sequential region of the file
+	st->index = index;
+	st->first = (uint64_t)num_packs*index/numStreams;
+	st->fin = (uint64_t)num_packs*(index+1)/numStreams;
+	st->endBytes = ((size_t)st->fin*chunk < fileSize) ? (size_t)st->fin*chunk : fileSize;
+	st->releasedBytes = ((size_t)st->first*chunk) & ~(size_t)(sysconf(_SC_PAGESIZE)-1);
+	st->base = st->nextSeq = st->first;
+	st->aheadBase = st->compressNext = st->first;
+	st->rto = INITIAL_RTO_US;
+	cc_init(&st->cc, ccAlgo, maxPacket);
+
+	st->slots = calloc(window, sizeof(struct slot)); // State for every packet in the send window
+	st->timerHeap = calloc(window, sizeof(struct slot*)); // At most one armed timer per slot
+	st->newlyAcked = calloc(window, sizeof(struct slot*));
+	st->packetRing = malloc((size_t)window*maxPacket); // The only packet memory we ever use, whatever the file size
+	assert(st->slots && st->timerHeap && st->newlyAcked && st->packetRing);
+	for (unsigned int i = 0; i < window; i++) {
+		st->slots[i].packet = st->packetRing + (size_t)i*maxPacket;
+		st->slots[i].heapPos = -1;
+	}
+	if (fecGroup || fecAuto) {
+		st->parity = malloc(chunk);
+		st->parityRing = malloc((size_t)PARITY_RING*maxPacket);
+		assert(st->parity && st->parityRing);
+	}
+	tree_reader_init(&st->reader);
+	if (treeMode) {
+		st->chunkBuf = malloc(chunk);
+		assert(st->chunkBuf);
+	}
+	if (compressThreads) {
+		st->ahead = calloc(window, sizeof(struct ahead));
+		st->aheadRing = malloc((size_t)window*chunk);
+		assert(st->ahead && st->aheadRing);
+		for (unsigned int i = 0; i < window; i++) { st->ahead[i].data = st->aheadRing + (size_t)i*chunk; }
+	}
+
+	st->socket = socket(AF_INET, SOCK_DGRAM, 0); // Make the sender socket (AF_INET for IPv4 communication domain, SOCK_DGRAM for UDP, 0 is automatic protocol)
+	assert(st->socket != -1);
+	fcntl(st->socket, F_SETFL, O_NONBLOCK); // poll() tells us when ACKs are waiting, reads must never block
+	batch_send_init(&st->sendBatch, st->socket, batched);
+	batch_recv_init(&st->ackBatch, st->socket, MAX_ACK, batched);
+}
+
+static void free_stream(struct stream* st)
+{
+	batch_recv_free(&st->ackBatch);
+	close(st->socket);
+	free(st->packetRing);
+	free(st->aheadRing);
+	free(st->ahead);
+	free(st->skip);
+	free(st->parityRing);
+	free(st->parity);
+	free(st->newlyAcked);
+	free(st->timerHeap);
+	free(st->slots);
+	tree_reader_close(&st->reader);
+	free(st->chunkBuf);
+}
+
 int main(int argc, char* argv[])
 {
+	int opt;
+	while ((opt = getopt(argc, argv, "w:bs:c:u:m:z:rf:p:x:")) != -1) { // Options come before the positional arguments
+		switch (opt) {
+			case 'w': window = atoi(optarg); break; // Amount of packets allowed in flight at once (per stripe)
+			case 'b': batched = 0; break; // One system call per packet, for comparison
+			case 'u': assert(unreliable_setup(optarg)); break; // Impair everything we send, see UnreliableChannel.h
+			case 's': numStreams = atoi(optarg); break; // Split the file into this many stripes, sent in parallel
+			case 'c': assert(cc_algo_parse(optarg, &ccAlgo)); break; // Congestion controller: none, reno or bbr
+			case 'm': mtuCap = atoi(optarg); break; // Largest MTU to probe for, below 1500 it is used as is
+			case 'z': compressThreads = atoi(optarg); break; // Compress chunks on this many threads ahead of the windows
+			case 'r': delta = 1; break; // Only send the chunks that differ from the file the Receiver already has
+			case 'f': if (!strcmp(optarg, "auto")) { fecAuto = 1; } else { fecGroup = atoi(optarg); } break; // A parity packet per this many chunks, or sized by the loss rate
+			case 'p': statsEvery = atoi(optarg); statsPrint = 1; break; // Print a JSON stats line to stderr every this many ms
+			case 'x': statsSocket = optarg; break; // Serve the latest stats line on this UNIX socket
+			default: assert(0);
+		}
+	}
+	assert(window > 0);
+	assert(numStreams > 0 && numStreams <= MAX_STREAMS);
+	assert(compressThreads <= MAX_COMPRESSORS);
+	assert(!fecGroup || (fecGroup >= FEC_MIN_GROUP && fecGroup <= FEC_MAX_GROUP));
+	assert(mtuCap >= 576 && mtuCap <= 65535); // The smallest datagram every IPv4 host must take, and the largest there is
+	assert(!statsPrint || statsEvery > 0);
+	if (statsSocket && !statsEvery) { statsEvery = METRICS_DEFAULT_MS; }
+	argc -= optind-1; argv += optind-1; // Shift so the positional arguments keep their usual indices
+
 	assert(argc == 4 || argc == 5); // Assert that we have the correct number of arguments
 	isLogging = (argc == 4) ? 0 : 1;
 
@@ -219,33 +1230,71 @@ int main(int argc, char* argv[])
 	char* in_file_name = argv[3]; // Get the file name to read from
 	char* log_file = NULL; if(isLogging) { log_file = argv[4]; }
 
-	num_packs = packetsToSend(in_file_name); // Get the number of packets/segments the file can be divided itno
-	assert(num_packs);
-	num_packs+=1; // +1 for FIN packet
-
-	packet_list = calloc(num_packs, sizeof(uint8_t*)); // Make a list of pointers for each packet (pointer). +1 for FINALITY
-	assert(packet_list); // Assert that it actually exists
-	init_packets(in_file_name); // Finally load the packets with the data
-
-	int senderSocket = socket(AF_INET, SOCK_DGRAM, 0); // Make the sender socket (AF_INET for IPv4 communication domain, SOCK_DGRAM for UDP, 0 is automatic protocol)
+	map_file(in_file_name); // Map the file without reading it
+	char rootPath[PATH_MAX];
+	if (treeMode) { assert(realpath(in_file_name, rootPath)); in_file_name = rootPath; } // A tree is named after its directory, also for "." or "dir/"
+	fileName = strrchr(in_file_name, '/') ? strrchr(in_file_name, '/')+1 : in_file_name; // The Receiver only gets the base name
+	assert(fileName[0] && strlen(fileName) <= MAX_NAME);
 
 	dest_addr.sin_family = AF_INET; // For the sockaddr_in
 	dest_addr.sin_port = htons(recvrPort); // The port we will send to (convert to network order)
 	dest_addr.sin_addr.s_addr = htonl(parsedIP); // The IP we will send to (convert to network order)
 
-	init_random(); // Seed the random values for unreliable sending/receiving later (if used)
-	if (isLogging) { writeFile = fopen(log_file, "w"); assert(writeFile); } // Open log file for writing
+	startedAt = now_us();
+	sessionId = (uint32_t)(startedAt ^ ((uint64_t)getpid() << 20));
+	if (isLogging) { assert(trace_open(log_file)); } // Create the log file, events are written to it in the background
 
-	unsigned int i;
-	for(i = 0; i < num_packs; i++) // Iterate over all packets in the packet list
-	{
-		generic_send(senderSocket, i); // Generically send it using the seq number
-		if(!receiveThis(senderSocket, i)) { break; } // Finally we will force a reply from the server
+	maxPacket = probe_path(); // Every stripe uses the same chunk size, the Receiver places chunk seq at seq * chunk
+	if (!maxPacket) { printf("No response to the path MTU probes\nSender has not sent all packets\n"); return 1; }
+	chunk = maxPacket-HEADER_BYTES;
+	num_packs = (fileSize+chunk-1)/chunk; // Get the number of packets/segments the file can be divided into
+	if (delta && (chunk-4)/SIG_BYTES < mapPage) { mapPage = (chunk-4)/SIG_BYTES; } // The count and the signatures fill one packet
+	if (numStreams > num_packs) { numStreams = num_packs; } // Every stripe carries at least one DATA packet
+
+	streams = calloc(numStreams, sizeof(struct stream));
+	assert(streams);
+	for (unsigned int i = 0; i < numStreams; i++) { init_stream(&streams[i], i); }
+	if (statsEvery) {
+		published = calloc(numStreams, sizeof(struct stream_stats));
+		assert(published);
+		assert(metrics_start(report_stats, statsEvery, statsPrint, statsSocket)); // The socket path must be free to bind
 	}
+	compressors = calloc(compressThreads ? compressThreads : 1, sizeof(pthread_t));
+	assert(compressors);
+	for (unsigned int i = 0; i < compressThreads; i++) { assert(pthread_create(&compressors[i], NULL, run_compressor, (void*)(uintptr_t)i) == 0); } // The first window is compressed during the handshake
+	for (unsigned int i = 1; i < numStreams; i++) { assert(pthread_create(&streams[i].thread, NULL, run_stream, &streams[i]) == 0); }
+	run_stream(&streams[0]); // The first stripe runs on the main thread
+	int sent = streams[0].sent;
+	for (unsigned int i = 1; i < numStreams; i++) { pthread_join(streams[i].thread, NULL); sent = sent && streams[i].sent; }
+	pthread_mutex_lock(&compressLock);
+	__atomic_store_n(&compressStop, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&compressWake);
+	pthread_mutex_unlock(&compressLock);
+	for (unsigned int i = 0; i < compressThreads; i++) { pthread_join(compressors[i], NULL); }
+	free(compressors);
+	double seconds = (now_us()-startedAt)/1e6;
+	if (statsEvery) { metrics_stop(); free(published); }
+	static struct stream_stats total; // Histograms are too large for the stack
+	for (unsigned int i = 0; i < numStreams; i++) { add_stats(&total, &streams[i].stats); }
 
-	char* response = ((i+1)>=num_packs) ? "Sender has successfully sent all packets\n" : "Sender has not sent all packets\n";
+	char* response = sent ? "Sender has successfully sent all packets\n" : "Sender has not sent all packets\n";
 	printf("%s", response);
-	if (isLogging) { fclose(writeFile); }
+	if (treeMode) { printf("Tree: %lu files in %lu directories, packed into %zu bytes\n", tree.files, tree.dirs+1, fileSize); } // The root counts too
+	printf("Packets sent: %lu (%lu resent) of up to %u data bytes\n", total.packetsSent, total.fastRetransmits+total.timeouts, chunk);
+	if (total.chunksSkipped) { printf("Chunks the Receiver already had: %lu of %u\n", total.chunksSkipped, num_packs); }
+	if (fecGroup || fecAuto) { printf("Parity packets sent: %lu\n", total.paritySent); }
+	if (compressThreads) { printf("Chunks compressed: %lu of %u (%llu bytes saved)\n", total.chunksCompressed, num_packs, total.bytesSaved); }
+	printf("Goodput: %.2f Mbit/s (%llu bytes in %.3f s)\n", total.bytesAcked*8/seconds/1e6, total.bytesAcked, seconds);
+	printf("Resends: %lu fast retransmits, %lu timeouts; %lu corrupt ACKs\n", total.fastRetransmits, total.timeouts, total.acksCorrupt);
+	char line[160];
+	hist_summary(line, sizeof(line), &total.rtt);
+	printf("RTT (us): %s\n", line);
+	hist_summary(line, sizeof(line), &total.delivery);
+	printf("Delivery (us): %s\n", line);
+	if (isLogging) { trace_close(); }
+	for (unsigned int i = 0; i < numStreams; i++) { free_stream(&streams[i]); }
+	free(streams);
+	if (treeMode) { tree_close(); } else { munmap(fileMap, fileSize); }
 
-	return 0;
+	return sent ? 0 : 1;
 }
@@ -0,0 +1,157 @@
+#include <stdio.h> // The log file
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h> // clock_gettime for the start of the log, nanosleep between flushes
+#include <pthread.h> // The flush thread
+#include <arpa/inet.h> // ntohl for the header fields of packets
+#include "Trace.h"
+// Every thread that records an event gets its own ring on its first one. Only that thread writes records into it and
+// advances head, only the flush thread reads them and advances tail, so a record costs a few stores and no atomic
+// read-modify-write. The flush thread takes whatever the rings hold on every pass and merges them by time.
+
+#define FLUSH_RECORDS (4096) // Records written per fwrite
+
+struct ring {
+	struct trace_record* recs; // TRACE_RING records
+	uint64_t head; // Records written so far, advanced by the thread the ring belongs to
+	uint64_t tail; // Records the flush thread took so far
+	uint64_t taken; // Records the flush thread copied in the current pass, tail once they are written out
+	uint64_t limit; // head when the current pass started
+	uint64_t dropped; // Records lost because the ring was full
+	struct ring* next;
+};
+
+static struct ring* rings = NULL; // Every ring, new ones are pushed at the front
+static pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER; // Only taken by a thread recording its first event
+static __thread struct ring* mine = NULL; // The ring of the calling thread
+static __thread uint64_t clockNow = 0; // The calling thread's latest trace_clock()
+static uint64_t start = 0; // Monotonic time (us) of trace_open
+static int stop = 0;
+static FILE* out = NULL;
+static pthread_t flusher;
+static struct trace_record pending[FLUSH_RECORDS]; // Only the flush thread uses it
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+static struct ring* new_ring(void)
+{
+	struct ring* r = calloc(1, sizeof(struct ring));
+	assert(r);
+	r->recs = malloc(TRACE_RING*sizeof(struct trace_record));
+	assert(r->recs);
+	pthread_mutex_lock(&ringLock);
+	r->next = rings;
+	__atomic_store_n(&rings, r, __ATOMIC_RELEASE); // The flush thread walks the list without the lock
+	pthread_mutex_unlock(&ringLock);
+	return r;
+}
+
+static void write_pending(struct ring* list, int n)
+{ // Write out what the pass copied, then hand the copied records back to their threads
+	if (n) { fwrite(pending, sizeof(struct trace_record), n, out); }
+	for (struct ring* r = list; r; r = r->next) { __atomic_store_n(&r->tail, r->taken, __ATOMIC_RELEASE); }
+}
+
+static int drain(void)
+{ // Write out every record written so far, the oldest of all rings first. Returns how many there were
+	struct ring* list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+	for (struct ring* r = list; r; r = r->next) {
+		r->limit = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		r->taken = r->tail;
+	}
+	int n = 0, total = 0;
+	for (;;) {
+		struct ring* oldest = NULL;
+		for (struct ring* r = list; r; r = r->next) {
+			if (r->taken == r->limit) { continue; }
+			if (!oldest || r->recs[r->taken % TRACE_RING].time < oldest->recs[oldest->taken % TRACE_RING].time) { oldest = r; }
+		}
+		if (!oldest) { break; }
+		pending[n++] = oldest->recs[oldest->taken++ % TRACE_RING];
+		total += 1;
+		if (n == FLUSH_RECORDS) { write_pending(list, n); n = 0; }
+	}
+	write_pending(list, n);
+	if (total) { fflush(out); } // A server runs until it is killed, every pass reaches the file
+	return total;
+}
+
+static void* run_flusher(void* arg)
+{
+	(void)arg;
+	struct timespec ts = { 0, TRACE_FLUSH_US*1000 };
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		if (drain() < TRACE_RING/4) { nanosleep(&ts, NULL); } // Right back if a ring may have filled up that much since the last pass
+	}
+	return NULL;
+}
+
+int trace_open(const char* path)
+{
+	out = fopen(path, "wb");
+	if (!out) { return 0; }
+	struct trace_header h;
+	memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+	h.recordBytes = sizeof(struct trace_record);
+	h.byteOrder = 0x01020304;
+	fwrite(&h, sizeof(h), 1, out);
+	start = now_us();
+	assert(pthread_create(&flusher, NULL, run_flusher, NULL) == 0);
+	return 1;
+}
+
+void trace_clock(uint64_t now)
+{
+	clockNow = now;
+}
+
+void trace_event(uint32_t event, uint32_t type, uint32_t seq, uint32_t len, uint32_t crc, uint32_t arg)
+{
+	struct ring* r = mine;
+	if (!r) { r = mine = new_ring(); }
+	uint64_t head = r->head;
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == TRACE_RING) { r->dropped+=1; return; } // Full, the flush thread fell behind
+	struct trace_record* rec = &r->recs[head % TRACE_RING];
+	rec->time = (clockNow > start) ? clockNow-start : 0; // 0 before the thread's first trace_clock()
+	rec->event = event;
+	rec->type = type;
+	rec->seq = seq;
+	rec->len = len;
+	rec->crc = crc;
+	rec->arg = arg;
+	__atomic_store_n(&r->head, head+1, __ATOMIC_RELEASE); // Publishes the record
+}
+
+void trace_packet(uint32_t event, const uint8_t* packet, uint32_t arg)
+{
+	uint32_t f[4];
+	memcpy(f, packet, sizeof(f)); // Type, seqnum, length and checksum, in network order
+	trace_event(event, ntohl(f[0]), ntohl(f[1]), ntohl(f[2]), ntohl(f[3]), arg);
+}
+
+void trace_close(void)
+{
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+	pthread_join(flusher, NULL);
+	drain(); // Whatever was recorded after its last pass
+	uint64_t lost = 0;
+	while (rings) {
+		struct ring* r = rings;
+		rings = r->next;
+		lost += r->dropped;
+		free(r->recs);
+		free(r);
+	}
+	mine = NULL;
+	if (lost) {
+		struct trace_record r = { now_us()-start, TRACE_DROPPED, 0, 0, 0, 0, lost > UINT32_MAX ? UINT32_MAX : (uint32_t)lost };
+		fwrite(&r, sizeof(r), 1, out);
+	}
+	fclose(out);
+}
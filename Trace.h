@@ -0,0 +1,58 @@
+#ifndef TRACE_H
+#define TRACE_H
+// Event tracing for the log files of the Sender and Receiver. Every event is a fixed size binary record, written into a
+// lock-free ring of the thread that recorded it. A background thread merges the rings in time order into the log file,
+// so the packet path never formats text, takes a lock or waits for the disk. When a ring is full, records are dropped
+// and counted rather than holding up the transfer. TraceDecode turns a log file back into the human-readable format.
+// Records are stamped with the latest time their thread read from the monotonic clock (trace_clock()). The packet loops
+// read it all the time anyway, and a clock read of its own would make up most of the cost of a record.
+#include <stdint.h>
+
+#define TRACE_MAGIC "RUDPTRC1" // First bytes of a log file
+#define TRACE_RING (1 << 14) // Records each thread's ring holds, about 16 ms of events at full speed over loopback
+#define TRACE_FLUSH_US (2000) // The flush thread drains the rings this often
+
+enum trace_event { // What the fields of a record mean for each event
+	TRACE_SENT, // type, seq, len, crc: header of a packet sent
+	TRACE_RECEIVED, // Header of a packet received that was checked elsewhere
+	TRACE_RECEIVED_OK, // Header of a packet received whose checksum matched
+	TRACE_CORRUPT, // Header of a packet received, arg: checksum calculated, which did not match
+	TRACE_FAST_RETRANSMIT, // seq: packet resent before its timer fired
+	TRACE_TIMEOUT, // seq: packet resent by its timer, arg: RTO (us)
+	TRACE_SYN_TIMEOUT, // arg: RTO (us)
+	TRACE_MAPREQ_TIMEOUT, // seq: first chunk of the page asked for again
+	TRACE_PATH_MTU, // arg: largest probe answered (bytes)
+	TRACE_WINDOW, // seq: send window base, len: bytes in flight, arg: congestion window (bytes, UINT32_MAX unlimited)
+	TRACE_SYN, // type, arg: file size (high, low), seq: stripes, len: chunk size, crc: session
+	TRACE_SYN_RESUMED, // Same as TRACE_SYN, for a transfer that resumes
+	TRACE_IN_WINDOW, // Header of a packet received whose checksum matched, arg: receive window base
+	TRACE_BELOW_WINDOW, // Same as TRACE_IN_WINDOW
+	TRACE_BEYOND_WINDOW, // Same as TRACE_IN_WINDOW
+	TRACE_REBUILT, // seq: chunk rebuilt from parity, arg: receive window base
+	TRACE_DROPPED, // arg: records lost to full rings, written once when the trace is closed
+	TRACE_EVENTS
+};
+
+struct trace_header { // Start of a log file
+	char magic[8];
+	uint32_t recordBytes; // sizeof(struct trace_record)
+	uint32_t byteOrder; // 0x01020304 as written, records are in the byte order of the machine that wrote them
+};
+
+struct trace_record {
+	uint64_t time; // us since trace_open()
+	uint32_t event;
+	uint32_t type;
+	uint32_t seq;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t arg;
+};
+
+int trace_open(const char* path); // Creates the log file and starts the flush thread. Returns 0 if the file can't be created
+void trace_clock(uint64_t now); // The calling thread read the monotonic clock (us), its next events happened then
+void trace_event(uint32_t event, uint32_t type, uint32_t seq, uint32_t len, uint32_t crc, uint32_t arg); // Any thread
+void trace_packet(uint32_t event, const uint8_t* packet, uint32_t arg); // Records the header fields of a packet
+void trace_close(void); // Writes out every record left and stops the flush thread. Every other thread that records must be done
+
+#endif
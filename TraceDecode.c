@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h> // getopt
+#include "Trace.h"
+// Decodes the binary log file of a Sender or Receiver (see Trace.h) into the human-readable log, one line per event.
+// Usage: ./TraceDecode [-t] [log-file]
+//   -t puts the time of every event (seconds since the log was opened) in front of it
+
+#define TYPE_MASK (0xFFFF) // The upper bits of TYPE are flags
+
+static const char* typeName(uint32_t type)
+{
+	static const char* typeNames[] = { "ACK", "DATA", "FIN", "SYN", "SYNACK", "PROBE", "PROBEACK", "MAPREQ", "MAP", "PARITY" };
+	type &= TYPE_MASK;
+	return (type < sizeof(typeNames)/sizeof(typeNames[0])) ? typeNames[type] : "UNKNOWN";
+}
+
+static void printPack(const struct trace_record* r)
+{ // Print header fields of the packet
+	printf("type=%s; seqNum=%u; length=%u; checksum=%x\n\n", typeName(r->type), r->seq, r->len, r->crc);
+}
+
+static void printRecord(const struct trace_record* r)
+{
+	switch (r->event) {
+		case TRACE_SENT: printf("Packet sent; "); printPack(r); break;
+		case TRACE_RECEIVED: printf("Packet received; "); printPack(r); break;
+		case TRACE_RECEIVED_OK: printf("Packet received; "); printPack(r); printf("checksum_calculated=%x; status=NOT_CORRUPT\n\n", r->crc); break;
+		case TRACE_CORRUPT: printf("Packet received; "); printPack(r); printf("checksum_calculated=%x; status=CORRUPT\n\n", r->arg); break;
+		case TRACE_FAST_RETRANSMIT: printf("Fast retransmit for packet seqNum=%u\n\n", r->seq); break;
+		case TRACE_TIMEOUT: printf("Timeout for packet seqNum=%u (rto=%uus)... Resending\n\n", r->seq, r->arg); break;
+		case TRACE_SYN_TIMEOUT: printf("Timeout for SYN (rto=%uus)... Resending\n\n", r->arg); break;
+		case TRACE_MAPREQ_TIMEOUT: printf("Timeout for MAPREQ seqNum=%u... Resending\n\n", r->seq); break;
+		case TRACE_PATH_MTU: printf("Path MTU probes: largest packet answered %u bytes\n\n", r->arg); break;
+		case TRACE_WINDOW:
+			if (r->arg == UINT32_MAX) { printf("Congestion window: unlimited; %u bytes in flight (Window base: %u)\n\n", r->len, r->seq); }
+			else { printf("Congestion window: %u bytes; %u bytes in flight (Window base: %u)\n\n", r->arg, r->len, r->seq); }
+			break;
+		case TRACE_SYN:
+		case TRACE_SYN_RESUMED:
+			printf("SYN for a file of %llu bytes in %u stripes of %u byte chunks (session %08x%s)\n", (unsigned long long)r->type << 32 | r->arg,
+				r->seq, r->len, r->crc, (r->event == TRACE_SYN_RESUMED) ? ", resuming" : "");
+			break;
+		case TRACE_IN_WINDOW:
+		case TRACE_BELOW_WINDOW:
+		case TRACE_BEYOND_WINDOW:
+			printf("Packet received; "); printPack(r); printf("checksum_calculated=%x; status=NOT_CORRUPT\n\n", r->crc);
+			if (r->event == TRACE_IN_WINDOW) { printf("Packet inside the window (Seq: %u, Window base: %u)\n", r->seq, r->arg); }
+			else if (r->event == TRACE_BELOW_WINDOW) { printf("Packet below the window (Seq: %u, Window base: %u); Resending ACK\n\n", r->seq, r->arg); }
+			else { printf("Packet beyond the window (Seq: %u, Window base: %u); Dropping\n\n", r->seq, r->arg); }
+			break;
+		case TRACE_REBUILT: printf("Chunk rebuilt from parity (Seq: %u, Window base: %u)\n\n", r->seq, r->arg); break;
+		case TRACE_DROPPED: printf("%u events were not logged, the trace ring was full\n\n", r->arg); break;
+		default: printf("Unknown event %u\n\n", r->event); break;
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	int times = 0;
+	int opt;
+	while ((opt = getopt(argc, argv, "t")) != -1) {
+		switch (opt) {
+			case 't': times = 1; break;
+			default: fprintf(stderr, "Usage: %s [-t] [log-file]\n", argv[0]); return 1;
+		}
+	}
+	FILE* in = (optind < argc) ? fopen(argv[optind], "rb") : stdin;
+	if (!in) { perror(argv[optind]); return 1; }
+
+	struct trace_header h;
+	if (fread(&h, sizeof(h), 1, in) != 1 || memcmp(h.magic, TRACE_MAGIC, sizeof(h.magic))) {
+		fprintf(stderr, "Not a trace log\n");
+		return 1;
+	}
+	if (h.byteOrder != 0x01020304 || h.recordBytes != sizeof(struct trace_record)) {
+		fprintf(stderr, "The log was written on a machine with another byte order or trace format\n");
+		return 1;
+	}
+
+	struct trace_record recs[4096];
+	size_t n;
+	while ((n = fread(recs, sizeof(struct trace_record), sizeof(recs)/sizeof(recs[0]), in)) > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (times) { printf("[%.6f] ", recs[i].time/1e6); }
+			printRecord(&recs[i]);
+		}
+	}
+	if (in != stdin) { fclose(in); }
+	return 0;
+}
@@ -0,0 +1,293 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h> // PATH_MAX
+#include <unistd.h> // pread, copy_file_range
+#include <fcntl.h> // openat and friends, the Receiver never follows a symlink in the tree
+#include <dirent.h> // scandir, the Sender walks every directory in name order
+#include <sys/stat.h>
+#include <arpa/inet.h> // htonl/ntohl for the manifest
+#include "Tree.h"
+// The Sender only keeps the manifest in memory. File data is read with pread when a chunk is built, so the tree can hold
+// any number of files without mapping them all, and every thread reads through its own tree_reader.
+
+struct entry {
+	char* path; // Relative to the root
+	uint32_t mode;
+	uint64_t size; // 0 for directories
+	uint64_t mtime; // ns
+	uint64_t offset; // Where its data starts in the stream
+};
+
+static char* rootDir = NULL;
+static struct entry* entries = NULL;
+static size_t entryCount = 0, entryCap = 0;
+static size_t* dataFiles = NULL; // Entries with data, by offset, so the file at any offset is a binary search away
+static size_t dataCount = 0;
+static uint8_t* manifest = NULL; // The start of the stream, header and entries
+static uint64_t manifestBytes = 0;
+
+static void put32(uint8_t* p, uint32_t v) { v = htonl(v); memcpy(p, &v, sizeof(uint32_t)); }
+static void put64(uint8_t* p, uint64_t v) { put32(p, v >> 32); put32(p+4, v & 0xFFFFFFFF); }
+static uint32_t get32(const uint8_t* p) { uint32_t v = 0; memcpy(&v, p, sizeof(uint32_t)); return ntohl(v); }
+static uint64_t get64(const uint8_t* p) { return (uint64_t)get32(p) << 32 | get32(p+4); }
+
+static void add_entry(const char* path, const struct stat* st)
+{
+	if (entryCount == entryCap) {
+		entryCap = entryCap ? 2*entryCap : 256;
+		entries = realloc(entries, entryCap*sizeof(struct entry));
+		assert(entries);
+	}
+	struct entry* e = &entries[entryCount++];
+	e->path = strdup(path);
+	assert(e->path);
+	e->mode = st->st_mode;
+	e->size = S_ISREG(st->st_mode) ? st->st_size : 0;
+	e->mtime = (uint64_t)st->st_mtim.tv_sec*1000000000 + st->st_mtim.tv_nsec;
+}
+
+static int walk(const char* rel, uint64_t* version)
+{ // Add everything below rel (the root if empty), depth first in name order. Returns 0 if the directory can't be read
+	char full[PATH_MAX];
+	assert(snprintf(full, sizeof(full), "%s%s%s", rootDir, rel[0] ? "/" : "", rel) < (int)sizeof(full));
+	struct dirent** names;
+	int n = scandir(full, &names, NULL, alphasort);
+	if (n < 0) { return 0; }
+	for (int i = 0; i < n; i++) {
+		const char* name = names[i]->d_name;
+		char path[PATH_MAX], child[PATH_MAX];
+		struct stat st;
+		if (!strcmp(name, ".") || !strcmp(name, "..")) { free(names[i]); continue; }
+		assert(snprintf(path, sizeof(path), "%s%s%s", rel, rel[0] ? "/" : "", name) < (int)sizeof(path));
+		assert(snprintf(child, sizeof(child), "%s/%s", rootDir, path) < (int)sizeof(child));
+		free(names[i]);
+		if (lstat(child, &st) == -1) { printf("Skipping %s: %s\n", child, strerror(errno)); continue; }
+		uint64_t mtime = (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+		if (mtime > *version) { *version = mtime; }
+		if (S_ISDIR(st.st_mode)) {
+			add_entry(path, &st);
+			if (!walk(path, version)) { printf("Skipping the contents of %s: %s\n", child, strerror(errno)); }
+		}
+		else if (S_ISREG(st.st_mode) && access(child, R_OK) == 0) { add_entry(path, &st); }
+		else { printf("Skipping %s: not a readable file or directory\n", child); } // Symlinks, devices, sockets
+	}
+	free(names);
+	return 1;
+}
+
+int tree_open(const char* dir, struct tree_info* info)
+{
+	struct stat st;
+	if (stat(dir, &st) == -1 || !S_ISDIR(st.st_mode)) { return 0; }
+	rootDir = strdup(dir);
+	assert(rootDir);
+	info->version = (uint64_t)st.st_mtim.tv_sec*1000000000 + st.st_mtim.tv_nsec;
+	if (!walk("", &info->version)) { return 0; }
+
+	manifestBytes = TREE_HEADER_BYTES;
+	for (size_t i = 0; i < entryCount; i++) { manifestBytes += TREE_ENTRY_BYTES + strlen(entries[i].path); }
+	manifest = malloc(manifestBytes);
+	dataFiles = malloc((entryCount ? entryCount : 1)*sizeof(size_t));
+	assert(manifest && dataFiles);
+	memcpy(manifest, TREE_MAGIC, 8);
+	put32(manifest+8, entryCount);
+	put32(manifest+12, 0);
+	put64(manifest+16, manifestBytes);
+	uint8_t* p = manifest+TREE_HEADER_BYTES;
+	uint64_t offset = manifestBytes;
+	info->files = info->dirs = 0;
+	for (size_t i = 0; i < entryCount; i++) {
+		struct entry* e = &entries[i];
+		size_t len = strlen(e->path);
+		put32(p, e->mode);
+		put32(p+4, len);
+		put64(p+8, e->size);
+		put64(p+16, e->mtime);
+		memcpy(p+TREE_ENTRY_BYTES, e->path, len);
+		p += TREE_ENTRY_BYTES+len;
+		e->offset = offset;
+		offset += e->size;
+		if (e->size) { dataFiles[dataCount++] = i; }
+		if (S_ISDIR(e->mode)) { info->dirs+=1; } else { info->files+=1; }
+	}
+	info->size = offset;
+	info->manifestBytes = manifestBytes;
+	return 1;
+}
+
+void tree_reader_init(struct tree_reader* r)
+{
+	r->fd = -1;
+	r->file = 0;
+}
+
+static size_t find_file(uint64_t offset)
+{ // The file whose data holds offset, which is past the manifest
+	size_t low = 0, high = dataCount;
+	while (high-low > 1) {
+		size_t mid = (low+high)/2;
+		if (entries[dataFiles[mid]].offset <= offset) { low = mid; } else { high = mid; }
+	}
+	return low;
+}
+
+void tree_read(struct tree_reader* r, uint64_t offset, uint8_t* out, size_t len)
+{ // A chunk may start in the manifest and run through any number of small files
+	while (len) {
+		size_t n;
+		if (offset < manifestBytes) {
+			n = (manifestBytes-offset < len) ? manifestBytes-offset : len;
+			memcpy(out, manifest+offset, n);
+		} else {
+			struct entry* e = &entries[dataFiles[r->file]];
+			size_t i = (r->fd != -1 && offset >= e->offset && offset < e->offset+e->size) ? r->file : find_file(offset); // Mostly the next chunk of the open file
+			e = &entries[dataFiles[i]];
+			uint64_t in = offset - e->offset;
+			n = (e->size-in < len) ? e->size-in : len;
+			if (r->fd == -1 || r->file != i) {
+				char full[PATH_MAX];
+				snprintf(full, sizeof(full), "%s/%s", rootDir, e->path);
+				if (r->fd != -1) { close(r->fd); }
+				r->fd = open(full, O_RDONLY);
+				r->file = i;
+			}
+			size_t got = 0;
+			while (r->fd != -1 && got < n) {
+				ssize_t k = pread(r->fd, out+got, n-got, in+got);
+				if (k <= 0) { break; }
+				got += k;
+			}
+			memset(out+got, 0, n-got); // The file shrank or went away since the walk, the size in the manifest still holds
+		}
+		offset += n;
+		out += n;
+		len -= n;
+	}
+}
+
+void tree_reader_close(struct tree_reader* r)
+{
+	if (r->fd != -1) { close(r->fd); }
+	r->fd = -1;
+}
+
+void tree_close(void)
+{
+	for (size_t i = 0; i < entryCount; i++) { free(entries[i].path); }
+	free(entries);
+	free(dataFiles);
+	free(manifest);
+	free(rootDir);
+	entries = NULL;
+	entryCount = entryCap = dataCount = 0;
+}
+
+static int valid_path(const char* path)
+{ // The path comes off the wire, so every component must stay inside the root
+	if (!path[0] || path[0] == '/') { return 0; }
+	for (const char* c = path; c; c = strchr(c, '/') ? strchr(c, '/')+1 : NULL) {
+		size_t len = strchr(c, '/') ? (size_t)(strchr(c, '/')-c) : strlen(c);
+		if (!len || (len == 1 && c[0] == '.') || (len == 2 && c[0] == '.' && c[1] == '.')) { return 0; }
+	}
+	return 1;
+}
+
+static int open_parent(int rootFd, char* path, const char** leaf, char* openPath, int* openFd)
+{ // The directory the last component of path goes in, opened one component at a time without following symlinks.
+	// Consecutive entries mostly share it, so the last one stays open (openPath, openFd). Returns -1 if it does not exist
+	char* slash = strrchr(path, '/');
+	*leaf = slash ? slash+1 : path;
+	size_t dirLen = slash ? (size_t)(slash-path) : 0;
+	if (*openFd != -1 && strlen(openPath) == dirLen && !memcmp(openPath, path, dirLen)) { return *openFd; }
+	if (*openFd != -1 && *openFd != rootFd) { close(*openFd); }
+	*openFd = -1;
+	int dirFd = rootFd;
+	for (char* c = path; c < path+dirLen; ) {
+		char* end = strchr(c, '/');
+		*end = '\0';
+		int next = openat(dirFd, c, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+		*end = '/';
+		if (dirFd != rootFd) { close(dirFd); }
+		if (next == -1) { return -1; }
+		dirFd = next;
+		c = end+1;
+	}
+	memcpy(openPath, path, dirLen);
+	openPath[dirLen] = '\0';
+	*openFd = dirFd;
+	return dirFd;
+}
+
+static int copy_range(int from, uint64_t offset, int to, uint64_t len)
+{ // Copied in the kernel (a reflink on filesystems that can), with reads and writes where that is not supported
+	loff_t in = offset;
+	while (len) {
+		ssize_t n = copy_file_range(from, &in, to, NULL, len, 0);
+		if (n <= 0) { break; }
+		len -= n;
+	}
+	uint8_t buf[65536];
+	while (len) {
+		ssize_t n = pread(from, buf, (len < sizeof(buf)) ? len : sizeof(buf), in);
+		if (n <= 0 || write(to, buf, n) != n) { return 0; }
+		in += n;
+		len -= n;
+	}
+	return 1;
+}
+
+int tree_unpack(int fd, uint64_t size, const char* root, unsigned long* files)
+{ // Files that are already there are overwritten, anything else in the root is left alone
+	uint8_t header[TREE_HEADER_BYTES];
+	if (size < TREE_HEADER_BYTES || pread(fd, header, sizeof(header), 0) != sizeof(header) || memcmp(header, TREE_MAGIC, 8)) { return 0; }
+	uint32_t count = get32(header+8);
+	uint64_t bytes = get64(header+16);
+	if (bytes > size || (uint64_t)count*TREE_ENTRY_BYTES > bytes-TREE_HEADER_BYTES) { return 0; }
+	uint8_t* m = malloc(bytes);
+	assert(m);
+	if (pread(fd, m, bytes, 0) != (ssize_t)bytes) { free(m); return 0; }
+	if (mkdir(root, 0755) == -1 && errno != EEXIST) { free(m); return 0; }
+	int rootFd = open(root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if (rootFd == -1) { free(m); return 0; }
+
+	char path[PATH_MAX], openPath[PATH_MAX];
+	int openFd = -1;
+	int ok = 1;
+	uint64_t pos = TREE_HEADER_BYTES, data = bytes;
+	*files = 0;
+	for (uint32_t i = 0; ok && i < count; i++) {
+		ok = 0;
+		if (bytes-pos < TREE_ENTRY_BYTES) { break; }
+		uint32_t mode = get32(m+pos);
+		uint32_t len = get32(m+pos+4);
+		uint64_t fileSize = get64(m+pos+8);
+		uint64_t mtime = get64(m+pos+16);
+		if (len >= sizeof(path) || bytes-pos-TREE_ENTRY_BYTES < len || fileSize > size-data) { break; }
+		memcpy(path, m+pos+TREE_ENTRY_BYTES, len);
+		path[len] = '\0';
+		pos += TREE_ENTRY_BYTES+len;
+		if (memchr(path, '\0', len) || !valid_path(path)) { break; }
+		const char* leaf;
+		int dirFd = open_parent(rootFd, path, &leaf, openPath, &openFd);
+		if (dirFd == -1) { break; }
+		if (S_ISDIR(mode)) { // Always writable by us, or its files could not be created
+			ok = (mkdirat(dirFd, leaf, (mode & 0777) | 0700) == 0 || errno == EEXIST);
+			continue;
+		}
+		if (!S_ISREG(mode)) { break; }
+		int out = openat(dirFd, leaf, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW, mode & 0777);
+		if (out == -1) { break; }
+		struct timespec times[2] = { { mtime/1000000000, mtime%1000000000 }, { mtime/1000000000, mtime%1000000000 } };
+		ok = copy_range(fd, data, out, fileSize) && fchmod(out, mode & 0777) == 0 && futimens(out, times) == 0; // The mode also for a file that was already there
+		close(out);
+		data += fileSize;
+		*files+=1;
+	}
+	if (openFd != -1 && openFd != rootFd) { close(openFd); }
+	close(rootFd);
+	free(m);
+	return ok && pos == bytes && data == size;
+}
@@ -0,0 +1,41 @@
+#ifndef TREE_H
+#define TREE_H
+// Directory transfers. The Sender packs a directory tree into one stream: a manifest of every directory and regular file
+// (path, mode, size, modification time), then the data of every file back to back, in manifest order. The stream is sent
+// like any file, so small files share packets and the whole tree is one session, with its stripes, parity and resuming.
+// The Receiver holds the stream in its part file and recreates the tree from it once the stream is complete.
+//
+// Stream layout, numbers in network order:
+//   header:  "RUFSTRE1", entry count (4), reserved (4), manifest bytes including the header (8)
+//   entry:   mode (4, the st_mode type and permission bits), path bytes (4), size (8), modification time (8, ns), path
+//   data:    the files' bytes, nothing between them
+// Paths are relative to the tree's root, '/' separated, and every directory comes before what is in it.
+#include <stddef.h>
+#include <stdint.h>
+
+#define TREE_MAGIC "RUFSTRE1"
+#define TREE_HEADER_BYTES (24)
+#define TREE_ENTRY_BYTES (24) // Fixed part of an entry, the path follows
+
+struct tree_info {
+	uint64_t size; // Bytes of the packed stream
+	uint64_t version; // Latest modification time (ns) in the tree, it changes whenever a file or a directory listing does
+	uint64_t manifestBytes;
+	unsigned long files;
+	unsigned long dirs;
+};
+
+struct tree_reader { // The file a thread read last, kept open so a large file is not reopened for every chunk
+	int fd; // -1 if none
+	size_t file;
+};
+
+int tree_open(const char* dir, struct tree_info* info); // Sender: walk dir and build the manifest. Returns 0 if dir can't be read
+void tree_reader_init(struct tree_reader* r);
+void tree_read(struct tree_reader* r, uint64_t offset, uint8_t* out, size_t len); // Bytes of the packed stream. Every thread uses its own reader
+void tree_reader_close(struct tree_reader* r);
+void tree_close(void);
+
+int tree_unpack(int fd, uint64_t size, const char* root, unsigned long* files); // Receiver: recreate the tree packed in fd under root. Returns 0 if the manifest is damaged or a file can't be written
+
+#endif
@@ -1,28 +1,209 @@
 #include <arpa/inet.h>
+#include <assert.h>
 #include <stdlib.h>
-#include <time.h>
+#include <string.h>
+#include "UnreliableChannel.h"
 
-static double probability = 0.8; // Edit here to change rate of channel errors
+#define REORDER_HOLD_US (1000) // A reordered packet is held back this much longer than the delay
+#define DEFAULT_QUEUE_BYTES (256*1024)
+#define MAX_SEND_BYTES (65536) // Largest packet send_packet() can impair, it works on a copy
 
-void init_random() { srand(time(NULL)); } // Seed random
+static struct channel_config processCfg; // What unreliable_setup() configured for this process
+static int processActive = 0;
+static uint64_t processStreams = 0; // Channels handed out so far
 
-ssize_t recv_packet(int socket, uint8_t* buffer, size_t length, struct sockaddr* senderAddr, socklen_t* addrLen)
+static uint64_t splitmix(uint64_t* x)
+{ // Turns any seed, even 0 or 1, into well mixed generator state
+	uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static uint64_t next_random(struct channel* ch)
+{ // xorshift64*
+	ch->rng ^= ch->rng >> 12;
+	ch->rng ^= ch->rng << 25;
+	ch->rng ^= ch->rng >> 27;
+	return ch->rng * 0x2545F4914F6CDD1DULL;
+}
+
+static double uniform(struct channel* ch) { return (next_random(ch) >> 11) * (1.0/9007199254740992.0); } // [0, 1)
+
+static int parse_scaled(const char* s, const char* const units[], const uint64_t scales[], uint64_t* out)
+{ // A number with an optional unit suffix from units (scaled by the matching entry of scales)
+	char* end = NULL;
+	double v = strtod(s, &end);
+	if (end == s || v < 0) { return 0; }
+	uint64_t scale = 1;
+	if (*end) {
+		int i = 0;
+		while (units[i] && strcmp(end, units[i])) { i+=1; }
+		if (!units[i]) { return 0; }
+		scale = scales[i];
+	}
+	*out = (uint64_t)(v*scale);
+	return 1;
+}
+
+static int parse_time(const char* s, uint64_t* us)
+{
+	static const char* const units[] = { "us", "ms", "s", NULL };
+	static const uint64_t scales[] = { 1, 1000, 1000000 };
+	return parse_scaled(s, units, scales, us);
+}
+
+static int parse_size(const char* s, uint64_t* n)
 {
-	ssize_t bytes = recvfrom(socket, buffer, length, 0, senderAddr, addrLen);
-	if (bytes>0) {  // +1 is so we don't include 1.0. If we want to turn off probability then we set to 1.0 since shamiko will never be 1
-		double shamiko = (double)rand() / (RAND_MAX+1.0);
-		if (shamiko > probability) { // %40 of the time corrupt everything in the message
-			for (int i=0;i<length;i++) { buffer[i] += 1; }
-		}	// Let's see what this does
+	static const char* const units[] = { "k", "m", "g", NULL };
+	static const uint64_t scales[] = { 1000, 1000000, 1000000000 };
+	return parse_scaled(s, units, scales, n);
+}
+
+static int parse_bytes(const char* s, uint64_t* n)
+{
+	static const char* const units[] = { "k", "m", NULL };
+	static const uint64_t scales[] = { 1024, 1024*1024 };
+	return parse_scaled(s, units, scales, n);
+}
+
+static int parse_prob(const char* s, double* p)
+{
+	char* end = NULL;
+	*p = strtod(s, &end);
+	return end != s && *end == '\0' && *p >= 0 && *p <= 1;
+}
+
+static int parse_dup(char* s, struct channel_config* cfg)
+{ // P[:T]
+	char* lag = strchr(s, ':');
+	if (lag) { *lag++ = '\0'; }
+	return parse_prob(s, &cfg->dup) && (!lag || parse_time(lag, &cfg->dupLagUs));
+}
+
+static int parse_ge(char* s, struct channel_config* cfg)
+{ // P:R[:H[:K]]
+	double v[4] = { 0, 0, 1, 0 };
+	int n = 0;
+	char* save = NULL;
+	for (char* part = strtok_r(s, ":", &save); part; part = strtok_r(NULL, ":", &save)) {
+		if (n == 4 || !parse_prob(part, &v[n])) { return 0; }
+		n+=1;
 	}
-	return bytes;
+	if (n < 2 || v[0] <= 0) { return 0; }
+	cfg->geP = v[0];
+	cfg->geR = v[1];
+	cfg->geBadLoss = v[2];
+	cfg->geGoodLoss = v[3];
+	return 1;
 }
 
+int channel_parse(const char* spec, struct channel_config* cfg)
+{
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->queueBytes = DEFAULT_QUEUE_BYTES;
+	cfg->seed = 1;
+	char* copy = strdup(spec);
+	assert(copy);
+	int ok = 1;
+	char* save = NULL;
+	for (char* item = strtok_r(copy, ",", &save); item && ok; item = strtok_r(NULL, ",", &save)) {
+		char* value = strchr(item, '=');
+		if (!value) { ok = 0; break; }
+		*value++ = '\0';
+		if (!strcmp(item, "loss")) { ok = parse_prob(value, &cfg->loss); }
+		else if (!strcmp(item, "ge")) { ok = parse_ge(value, cfg); }
+		else if (!strcmp(item, "delay")) { ok = parse_time(value, &cfg->delayUs); }
+		else if (!strcmp(item, "jitter")) { ok = parse_time(value, &cfg->jitterUs); }
+		else if (!strcmp(item, "rate")) { ok = parse_size(value, &cfg->rateBps) && cfg->rateBps > 0; }
+		else if (!strcmp(item, "queue")) { ok = parse_bytes(value, &cfg->queueBytes); }
+		else if (!strcmp(item, "reorder")) { ok = parse_prob(value, &cfg->reorder); }
+		else if (!strcmp(item, "dup")) { ok = parse_dup(value, cfg); }
+		else if (!strcmp(item, "corrupt")) { ok = parse_prob(value, &cfg->corrupt); }
+		else if (!strcmp(item, "seed")) { char* end = NULL; cfg->seed = strtoull(value, &end, 10); ok = (end != value && *end == '\0'); }
+		else { ok = 0; }
+	}
+	free(copy);
+	return ok;
+}
+
+int channel_timed(const struct channel_config* cfg)
+{
+	return cfg->delayUs || cfg->jitterUs || cfg->rateBps || cfg->reorder > 0 || cfg->dupLagUs;
+}
+
+void channel_init(struct channel* ch, const struct channel_config* cfg, uint64_t stream)
+{
+	memset(ch, 0, sizeof(*ch));
+	ch->cfg = *cfg;
+	uint64_t x = cfg->seed ^ (stream * 0xD1B54A32D192ED03ULL);
+	ch->rng = splitmix(&x);
+	if (!ch->rng) { ch->rng = 1; } // xorshift never leaves 0
+}
+
+unsigned int channel_apply(struct channel* ch, uint64_t now, uint8_t* packet, size_t len, uint64_t deliverAt[2])
+{ // Every decision draws from the generator in the same order, whatever the configuration, so turning one impairment
+	// on or off does not change the losses the others produce
+	const struct channel_config* cfg = &ch->cfg;
+	ch->packets+=1;
+	double u[8]; // loss, ge transition, ge loss, jitter, reorder, corruption, corrupted bit, duplicate
+	for (int i = 0; i < 8; i++) { u[i] = uniform(ch); }
+
+	int lost = (u[0] < cfg->loss);
+	if (cfg->geP > 0) { // Move between the states, then lose with the loss rate of the state we are in
+		ch->bad = ch->bad ? !(u[1] < cfg->geR) : (u[1] < cfg->geP);
+		if (u[2] < (ch->bad ? cfg->geBadLoss : cfg->geGoodLoss)) { lost = 1; }
+	}
+	if (lost) { ch->dropped+=1; return 0; }
 
-ssize_t send_packet(int socket, const void* message, size_t length, const struct sockaddr* dest_addr, socklen_t dest_len)
+	uint64_t at = now;
+	if (cfg->rateBps) { // The bottleneck sends one packet after the other, and drops what would overflow its queue
+		uint64_t start = (ch->linkFree > now) ? ch->linkFree : now;
+		uint64_t queued = (start-now) * cfg->rateBps / 8000000;
+		if (queued + len > cfg->queueBytes) { ch->overflows+=1; return 0; }
+		ch->linkFree = start + (uint64_t)len*8000000/cfg->rateBps;
+		at = ch->linkFree;
+	}
+	at += cfg->delayUs;
+	if (cfg->jitterUs) {
+		uint64_t spread = (uint64_t)(u[3] * (2*cfg->jitterUs+1));
+		at = (at+spread > cfg->jitterUs) ? at+spread-cfg->jitterUs : 0;
+		if (at < now) { at = now; }
+	}
+	if (u[4] < cfg->reorder) { at += cfg->delayUs + REORDER_HOLD_US; ch->reordered+=1; }
+
+	if (u[5] < cfg->corrupt && len) {
+		uint64_t bit = (uint64_t)(u[6] * len*8);
+		packet[bit/8] ^= (uint8_t)(1 << (bit%8));
+		ch->corrupted+=1;
+	}
+	deliverAt[0] = at;
+	if (u[7] < cfg->dup) { deliverAt[1] = at + cfg->dupLagUs; ch->duplicated+=1; return 2; }
+	return 1;
+}
+
+int unreliable_setup(const char* spec)
 {
-	ssize_t bytes = -1; // On sendto error, -1 is returned
-	double momo = (double)rand() / (RAND_MAX+1.0);
-	if (momo < probability) { bytes = sendto(socket, message, length, 0, dest_addr, dest_len); } // %60 of the time actually send the packet, the other 40 don't even send
+	if (!channel_parse(spec, &processCfg) || channel_timed(&processCfg)) { return 0; }
+	processActive = 1;
+	return 1;
+}
+
+int unreliable_active(void) { return processActive; }
+
+void unreliable_open(struct channel* ch)
+{ // Sockets are opened in a fixed order, so each one sees the same sequence every run
+	channel_init(ch, &processCfg, __atomic_fetch_add(&processStreams, 1, __ATOMIC_RELAXED));
+}
+
+ssize_t send_packet(struct channel* ch, int socket, const void* message, size_t length, const struct sockaddr* dest_addr, socklen_t dest_len)
+{ // Impairs a copy, the caller may resend the same buffer later
+	uint8_t copy[MAX_SEND_BYTES];
+	assert(length <= sizeof(copy));
+	memcpy(copy, message, length);
+	uint64_t deliverAt[2];
+	unsigned int copies = channel_apply(ch, 0, copy, length, deliverAt);
+	ssize_t bytes = (ssize_t)length; // A dropped packet looks sent, like on a real network
+	for (unsigned int i = 0; i < copies; i++) { bytes = sendto(socket, copy, length, 0, dest_addr, dest_len); }
 	return bytes;
 }
@@ -1,8 +1,54 @@
 #ifndef UNRELIABLE_H
 #define UNRELIABLE_H
-// Simulates packet loss and packet corruption
-void init_random();
-ssize_t recv_packet(int, uint8_t*, size_t, struct sockaddr*, socklen_t*);
-ssize_t send_packet(int, const void*, size_t, const struct sockaddr*, socklen_t);
+// Simulates an imperfect network. Every decision comes from a seeded generator, so a test sees the same losses every run.
+// A channel is configured from a spec of comma separated key=value pairs, e.g. "loss=0.01,delay=20ms,jitter=2ms,seed=7":
+//   loss=P          drop each packet with probability P (Bernoulli)
+//   ge=P:R[:H[:K]]  Gilbert-Elliott burst loss: go from the good to the bad state with probability P and back with R,
+//                   losing packets with probability H in the bad state (default 1) and K in the good one (default 0)
+//   delay=T         one way latency (microseconds, or with an ms/s suffix)
+//   jitter=T        extra latency drawn uniformly from [-T, T], which also reorders packets sent closer together than it
+//   rate=B          bottleneck of B bits per second (k/m/g suffixes) in front of the latency
+//   queue=N         bytes waiting for the bottleneck before it drops packets (k/m suffixes, default 256k)
+//   reorder=P       hold a packet back by delay+1ms with probability P, so the ones after it overtake it
+//   dup=P[:T]       send a packet twice with probability P, the copy T later (default 0), e.g. after a retransmission
+//   corrupt=P       flip one random bit of a packet with probability P
+//   seed=N          seed of the random decisions (default 1)
+// Sender and Receiver take a spec with -u and apply the immediate impairments (loss, ge, dup, corrupt) to everything they
+// send. The timed ones need packets to be held, so only the Impair relay applies them (and all the others).
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+struct channel_config {
+	double loss;
+	double geP, geR, geBadLoss, geGoodLoss; // Gilbert-Elliott, geP = 0 turns it off
+	uint64_t delayUs;
+	uint64_t jitterUs;
+	uint64_t rateBps; // Bits per second, 0 for no bottleneck
+	uint64_t queueBytes;
+	double reorder;
+	double dup;
+	uint64_t dupLagUs; // How much later the copy arrives
+	double corrupt;
+	uint64_t seed;
+};
+
+struct channel {
+	struct channel_config cfg;
+	uint64_t rng; // Generator state
+	int bad; // Gilbert-Elliott state
+	uint64_t linkFree; // When the bottleneck is done with the packets it already holds
+	unsigned long packets, dropped, overflows, duplicated, corrupted, reordered; // What happened so far
+};
+
+int channel_parse(const char* spec, struct channel_config* cfg); // Returns 0 if the spec is malformed
+int channel_timed(const struct channel_config* cfg); // Uses delay, jitter, rate, reorder or a duplicate lag
+void channel_init(struct channel* ch, const struct channel_config* cfg, uint64_t stream); // Each stream draws its own sequence
+unsigned int channel_apply(struct channel* ch, uint64_t now, uint8_t* packet, size_t len, uint64_t deliverAt[2]); // Copies to deliver (0-2) and when, corrupts in place
+
+int unreliable_setup(const char* spec); // Impair everything this process sends. Returns 0 if the spec is malformed or timed
+int unreliable_active(void);
+void unreliable_open(struct channel* ch); // A channel for one socket, every call gets the next stream
+ssize_t send_packet(struct channel* ch, int socket, const void* message, size_t length, const struct sockaddr* dest_addr, socklen_t dest_len);
 
 #endif
@@ -0,0 +1,150 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/udp.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../BatchIO.h"
+// Loopback benchmark for BatchIO. A child process receives while the parent blasts packets, once per mode:
+//   single   one sendto()/recvfrom() per packet (what the programs did before)
+//   mmsg     sendmmsg()/recvmmsg() batches
+//   gso      sendmmsg()/recvmmsg() with UDP_SEGMENT and UDP_GRO
+// Reports packets/s delivered and CPU seconds (sender + receiver) per GB delivered.
+// Usage: ./BatchBench [packets (default 200000)] [packet-bytes (default 1472)] [port (default 47000)]
+
+#define QUIET_MS (300) // The receiver stops after this long without a packet
+
+struct result { // What the receiving child reports back through the pipe
+	unsigned long packets;
+	unsigned long bytes;
+	double first, last; // Monotonic time of the first and last packet
+	double cpu; // Receiver CPU seconds
+	unsigned long syscalls;
+};
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static double cpu_sec(void)
+{
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+static int make_socket(int port, int bindIt)
+{
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+	assert(sock != -1);
+	int bufSize = 8*1024*1024; // Capped by net.core.[rw]mem_max
+	setsockopt(sock, SOL_SOCKET, bindIt ? SO_RCVBUF : SO_SNDBUF, &bufSize, sizeof(bufSize));
+	if (bindIt) {
+		struct sockaddr_in addr = {0};
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		assert(bind(sock, (struct sockaddr*)&addr, sizeof(addr)) != -1);
+		struct timeval tv = { 0, QUIET_MS*1000 };
+		setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	}
+	return sock;
+}
+
+static void receiver(int port, int mode, size_t packetBytes, int out)
+{ // Child: count everything that arrives until the sender has been quiet for a while
+	int sock = make_socket(port, 1);
+	struct recv_batch rb;
+	batch_recv_init(&rb, sock, packetBytes, mode != 0);
+	if (mode == 1 && rb.gro) { int off = 0; setsockopt(sock, SOL_UDP, UDP_GRO, &off, sizeof(off)); rb.gro = 0; }
+	assert(write(out, "r", 1) == 1); // Tell the parent we are bound
+
+	struct result res = {0};
+	double cpu0 = cpu_sec();
+	while (batch_recv(&rb, 1) > 0) {
+		uint8_t* packet;
+		size_t len;
+		while (batch_next(&rb, &packet, &len, NULL, NULL)) {
+			if (!res.packets) { res.first = now_sec(); }
+			res.packets+=1;
+			res.bytes += len;
+		}
+		res.last = now_sec();
+	}
+	res.cpu = cpu_sec()-cpu0;
+	res.syscalls = rb.syscalls;
+	assert(write(out, &res, sizeof(res)) == sizeof(res));
+	batch_recv_free(&rb);
+	close(sock);
+	exit(0);
+}
+
+static void run(const char* name, int mode, unsigned long packets, size_t packetBytes, int port)
+{
+	int fds[2];
+	assert(pipe(fds) == 0);
+	fflush(stdout); // The child must not inherit (and print) our buffered output
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (!pid) { close(fds[0]); receiver(port, mode, packetBytes, fds[1]); }
+	close(fds[1]);
+	char ready;
+	assert(read(fds[0], &ready, 1) == 1);
+
+	int sock = make_socket(port, 0);
+	struct sockaddr_in dest = {0};
+	dest.sin_family = AF_INET;
+	dest.sin_port = htons(port);
+	dest.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	uint8_t* ring = calloc(BATCH_SIZE, packetBytes); // Same buffers over and over, like the Sender's packet ring
+	assert(ring);
+	struct send_batch sb;
+	batch_send_init(&sb, sock, mode != 0);
+	if (mode == 1) { sb.gso = 0; }
+
+	double cpu0 = cpu_sec();
+	double start = now_sec();
+	for (unsigned long i = 0; i < packets; i++) {
+		uint8_t* packet = ring + (i % BATCH_SIZE)*packetBytes;
+		memcpy(packet, &i, sizeof(i));
+		batch_send(&sb, packet, packetBytes, (struct sockaddr*)&dest, sizeof(dest));
+	}
+	batch_flush(&sb);
+	double sendTime = now_sec()-start;
+	double sendCpu = cpu_sec()-cpu0;
+
+	struct result res;
+	assert(read(fds[0], &res, sizeof(res)) == sizeof(res));
+	waitpid(pid, NULL, 0);
+	close(fds[0]);
+	close(sock);
+	free(ring);
+
+	double elapsed = (res.packets > 1) ? res.last-start : sendTime;
+	double gb = res.bytes/1e9;
+	printf("%-7s %10lu %10lu %12.0f %10.2f %12.2f %10lu %10lu\n", name, packets, res.packets, res.packets/elapsed,
+	       res.bytes/elapsed/1e6, gb ? (sendCpu+res.cpu)/gb : 0, sb.syscalls, res.syscalls);
+}
+
+int main(int argc, char* argv[])
+{
+	unsigned long packets = (argc > 1) ? strtoul(argv[1], NULL, 10) : 200000;
+	size_t packetBytes = (argc > 2) ? strtoul(argv[2], NULL, 10) : 1472;
+	int port = (argc > 3) ? atoi(argv[3]) : 47000;
+	assert(packetBytes >= sizeof(unsigned long) && packetBytes <= 65507);
+
+	printf("%lu packets of %zu bytes over loopback\n", packets, packetBytes);
+	printf("%-7s %10s %10s %12s %10s %12s %10s %10s\n", "mode", "sent", "received", "packets/s", "MB/s", "CPU s/GB", "send-sys", "recv-sys");
+	run("single", 0, packets, packetBytes, port);
+	run("mmsg", 1, packets, packetBytes, port);
+	run("gso", 2, packets, packetBytes, port);
+	return 0;
+}
@@ -0,0 +1,403 @@
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+// Goodput benchmark. Runs Sender and Receiver over loopback for every size and network profile, and records goodput,
+// the share of resent packets, CPU time and peak RSS of both programs into a JSON report. Profiles other than loopback
+// run through the Impair relay. With a baseline, every result is compared against it and the run fails on a regression.
+// Sync profiles update a stale copy held by a server (-d) with delta sync (-r), and fail if the server did not survive.
+// Usage: ./BenchRun [-s sizes (default 1k,64k,1m,16m,256m,1g)] [-P profiles (default all)] [-n repeats (default 1)]
+//                   [-o report.json] [-b baseline.json] [-t tolerance (default 0.25)] [-p port (default 46000)] [-d dir (default /tmp)]
+// Sizes take k/m/g suffixes, e.g. -s 1k,1m,1g,4g. Run it from the directory with the Sender, Receiver and Impair binaries.
+// The report has one result per line, and baselines are read back the same way: make bench-baseline writes one.
+
+#define MAX_SIZES (16)
+#define MAX_RESULTS (256)
+#define START_US (200000) // Time the Receiver and relay get to bind before the Sender starts
+#define RUN_TIMEOUT_S (600) // A transfer that takes longer than this counts as failed
+#define RECEIVER_GRACE_US (3000000) // How long the Receiver may take to exit after the Sender
+#define IO_BYTES (64*1024) // Keep our own footprint small: children inherit our peak RSS across fork and exec
+#define NOISE_FLOOR_S (0.05) // Transfers shorter than this are mostly startup, their goodput is not compared
+#define RETRANS_SLACK (0.02) // Resent share may grow by this much (absolute) before it counts as a regression
+#define RETRANS_MIN_PACKETS (500) // Runs with fewer packets are not compared, a single spurious resend would exceed the slack
+#define CPU_FLOOR_S (0.05) // Baselines using less CPU than this are mostly startup and tick rounding, their CPU is not compared
+#define SYNC_LINGER_US (200000) // A server is left running this long after the Sender, so late duplicates still reach it
+#define STALE_EVERY (8) // The stale copy of a sync profile differs from the input in one block of this many
+
+struct profile {
+	const char* name;
+	const char* forward; // Impairments toward the Receiver, NULL for a direct loopback transfer
+	const char* reverse;
+	uint64_t maxBytes; // Larger files are skipped, the slow profiles would take too long for them
+	int sync; // Delta sync into a server that holds a stale copy of the file
+};
+
+static const struct profile profiles[] = {
+	{ "loopback", NULL, NULL, 0 },
+	{ "rtt20", "delay=10ms", "delay=10ms", 16ULL << 20 },
+	{ "loss1", "delay=5ms,loss=0.01,seed=1", "delay=5ms,seed=2", 16ULL << 20 },
+	{ "burst", "delay=5ms,ge=0.005:0.25,seed=3", "delay=5ms,seed=4", 16ULL << 20 },
+	{ "bottleneck", "rate=200m,delay=5ms,seed=5", "delay=5ms,seed=6", 16ULL << 20 },
+	{ "wan", "rate=100m,delay=20ms,jitter=1ms,loss=0.005,seed=7", "delay=20ms,loss=0.005,seed=8", 16ULL << 20 },
+	{ "dupsync", "delay=5ms,dup=1:50ms,seed=9", "delay=5ms,dup=0.1,seed=10", 16ULL << 20, 1 }, // Every MAPREQ and the FIN come again late
+};
+#define NUM_PROFILES (sizeof(profiles)/sizeof(profiles[0]))
+
+struct result {
+	char profile[32];
+	uint64_t size;
+	int ok; // Output matched the input
+	double seconds; // Sender wall time, median over the repeats
+	double goodputMbps;
+	double retransRatio; // Resent packets over packets sent
+	unsigned long packetsSent; // By the Sender, resends included
+	double cpuSeconds; // Sender + Receiver, user + system
+	long senderRssKb;
+	long receiverRssKb;
+};
+
+static const char* dir = "/tmp";
+static int basePort = 46000;
+static unsigned int runs = 0; // Transfers started, each gets its own ports
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static double cpu_of(struct rusage* ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_utime.tv_usec/1e6 + ru->ru_stime.tv_sec + ru->ru_stime.tv_usec/1e6;
+}
+
+static int parse_size(const char* s, uint64_t* out)
+{
+	char* end = NULL;
+	double v = strtod(s, &end);
+	if (end == s || v <= 0) { return 0; }
+	uint64_t scale = 1;
+	if (*end == 'k' || *end == 'K') { scale = 1ULL << 10; end+=1; }
+	else if (*end == 'm' || *end == 'M') { scale = 1ULL << 20; end+=1; }
+	else if (*end == 'g' || *end == 'G') { scale = 1ULL << 30; end+=1; }
+	if (*end) { return 0; }
+	*out = (uint64_t)(v*scale);
+	return 1;
+}
+
+static void make_input(const char* path, uint64_t size)
+{ // Random data, so nothing along the way can shortcut it. Kept between runs if it already has the right size
+	struct stat sb;
+	if (stat(path, &sb) == 0 && (uint64_t)sb.st_size == size) { return; }
+	FILE* f = fopen(path, "wb");
+	assert(f);
+	static uint64_t block[IO_BYTES/sizeof(uint64_t)];
+	uint64_t x = 0x9E3779B97F4A7C15ULL ^ size;
+	for (uint64_t done = 0; done < size;) {
+		for (size_t i = 0; i < sizeof(block)/sizeof(block[0]); i++) { x ^= x << 13; x ^= x >> 7; x ^= x << 17; block[i] = x; }
+		size_t n = (size-done < sizeof(block)) ? size-done : sizeof(block);
+		assert(fwrite(block, 1, n, f) == n);
+		done += n;
+	}
+	assert(fclose(f) == 0);
+}
+
+static void make_stale(const char* input, const char* path)
+{ // A copy of input with one byte changed in every STALE_EVERY blocks, what a server holds before a sync
+	FILE* in = fopen(input, "rb");
+	FILE* out = fopen(path, "wb");
+	assert(in && out);
+	static uint8_t block[IO_BYTES];
+	for (unsigned int i = 0;; i++) {
+		size_t n = fread(block, 1, sizeof(block), in);
+		if (!n) { break; }
+		if (i % STALE_EVERY == 0) { block[n/2] ^= 0xFF; }
+		assert(fwrite(block, 1, n, out) == n);
+	}
+	fclose(in);
+	assert(fclose(out) == 0);
+}
+
+static int same_file(const char* a, const char* b)
+{
+	FILE* fa = fopen(a, "rb");
+	FILE* fb = fopen(b, "rb");
+	int same = fa && fb;
+	static char bufA[IO_BYTES], bufB[IO_BYTES];
+	while (same) {
+		size_t na = fread(bufA, 1, sizeof(bufA), fa);
+		size_t nb = fread(bufB, 1, sizeof(bufB), fb);
+		if (na != nb || memcmp(bufA, bufB, na)) { same = 0; }
+		if (na < sizeof(bufA)) { break; }
+	}
+	if (fa) { fclose(fa); }
+	if (fb) { fclose(fb); }
+	return same;
+}
+
+static pid_t spawn(char* const argv[], int outFd)
+{ // Start a program with its stdout going to outFd (or nowhere)
+	pid_t pid = fork();
+	assert(pid != -1);
+	if (pid == 0) {
+		int devNull = open("/dev/null", O_WRONLY);
+		dup2(outFd >= 0 ? outFd : devNull, STDOUT_FILENO);
+		dup2(devNull, STDERR_FILENO);
+		execv(argv[0], argv);
+		_exit(127);
+	}
+	return pid;
+}
+
+static int wait_for(pid_t pid, double timeoutSec, struct rusage* ru)
+{ // Reap pid within the timeout, killing it if it overstays. Returns its exit status, -1 if it had to be killed
+	double deadline = now_sec() + timeoutSec;
+	int status = 0;
+	for (;;) {
+		pid_t r = wait4(pid, &status, WNOHANG, ru);
+		if (r == pid) { return WIFEXITED(status) ? WEXITSTATUS(status) : -1; }
+		if (now_sec() > deadline) {
+			kill(pid, SIGKILL);
+			wait4(pid, &status, 0, ru);
+			return -1;
+		}
+		usleep(1000);
+	}
+}
+
+static int run_once(const struct profile* p, const char* input, const char* output, struct result* r)
+{ // One transfer. Fills in r and returns 1 if the output matched the input
+	char port[16], relayPort[16];
+	int receiverPort = basePort + 2*(runs % 1000);
+	snprintf(port, sizeof(port), "%d", receiverPort);
+	snprintf(relayPort, sizeof(relayPort), "%d", receiverPort+1);
+	runs+=1;
+	unlink(output);
+
+	char syncDir[256], target[512]; // A sync server writes the file under its own name into syncDir
+	snprintf(syncDir, sizeof(syncDir), "%s/bench-sync", dir);
+	const char* name = strrchr(input, '/');
+	snprintf(target, sizeof(target), "%s/%s", syncDir, name ? name+1 : input);
+	if (p->sync) {
+		mkdir(syncDir, 0755);
+		make_stale(input, target);
+	}
+	char* receiverArgs[] = { "./Receiver", port, (char*)output, NULL };
+	char* serverArgs[] = { "./Receiver", "-d", port, syncDir, NULL };
+	pid_t receiver = spawn(p->sync ? serverArgs : receiverArgs, -1);
+	pid_t relay = -1;
+	if (p->forward) {
+		char* relayArgs[] = { "./Impair", "-f", (char*)p->forward, "-r", (char*)p->reverse, relayPort, "127.0.0.1", port, NULL };
+		relay = spawn(relayArgs, -1);
+	}
+	usleep(START_US);
+
+	char senderOut[256];
+	snprintf(senderOut, sizeof(senderOut), "%s/bench-sender.out", dir);
+	int outFd = open(senderOut, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	assert(outFd != -1);
+	char* senderArgs[] = { "./Sender", "127.0.0.1", p->forward ? relayPort : port, (char*)input, NULL };
+	char* syncArgs[] = { "./Sender", "-r", "127.0.0.1", p->forward ? relayPort : port, (char*)input, NULL };
+	double start = now_sec();
+	pid_t sender = spawn(p->sync ? syncArgs : senderArgs, outFd);
+	close(outFd);
+	struct rusage senderRu, receiverRu, relayRu;
+	int senderStatus = wait_for(sender, RUN_TIMEOUT_S, &senderRu);
+	r->seconds = now_sec() - start;
+	int receiverStatus;
+	if (p->sync) { // A server never exits by itself, it has to be alive to pass
+		usleep(SYNC_LINGER_US);
+		int alive = (wait4(receiver, NULL, WNOHANG, &receiverRu) == 0);
+		if (alive) { kill(receiver, SIGTERM); wait_for(receiver, RECEIVER_GRACE_US/1e6, &receiverRu); }
+		receiverStatus = alive ? 0 : -1;
+	}
+	else { receiverStatus = wait_for(receiver, RECEIVER_GRACE_US/1e6, &receiverRu); }
+	if (relay != -1) { kill(relay, SIGINT); wait_for(relay, 1, &relayRu); }
+
+	unsigned long sent = 0, resent = 0;
+	FILE* f = fopen(senderOut, "r");
+	char line[256];
+	while (f && fgets(line, sizeof(line), f)) { sscanf(line, "Packets sent: %lu (%lu resent)", &sent, &resent); }
+	if (f) { fclose(f); }
+	unlink(senderOut);
+
+	r->ok = senderStatus == 0 && receiverStatus == 0 && same_file(input, p->sync ? target : output);
+	r->goodputMbps = r->size*8/r->seconds/1e6;
+	r->retransRatio = sent ? (double)resent/sent : 0;
+	r->packetsSent = sent;
+	r->cpuSeconds = cpu_of(&senderRu) + cpu_of(&receiverRu);
+	r->senderRssKb = senderRu.ru_maxrss;
+	r->receiverRssKb = receiverRu.ru_maxrss;
+	unlink(output);
+	if (p->sync) { unlink(target); }
+	return r->ok;
+}
+
+static int by_seconds(const void* a, const void* b)
+{
+	double x = ((const struct result*)a)->seconds, y = ((const struct result*)b)->seconds;
+	return (x > y) - (x < y);
+}
+
+static void write_report(FILE* f, struct result* results, unsigned int count)
+{ // One result per line, so load_baseline() can read it back without a JSON parser
+	fprintf(f, "{\"results\": [\n");
+	for (unsigned int i = 0; i < count; i++) {
+		struct result* r = &results[i];
+		fprintf(f, "{\"profile\": \"%s\", \"size\": %llu, \"ok\": %s, \"seconds\": %.4f, \"goodput_mbps\": %.2f, "
+		           "\"retrans_ratio\": %.4f, \"cpu_seconds\": %.4f, \"sender_rss_kb\": %ld, \"receiver_rss_kb\": %ld, \"packets_sent\": %lu}%s\n",
+		        r->profile, (unsigned long long)r->size, r->ok ? "true" : "false", r->seconds, r->goodputMbps,
+		        r->retransRatio, r->cpuSeconds, r->senderRssKb, r->receiverRssKb, r->packetsSent, (i+1 < count) ? "," : "");
+	}
+	fprintf(f, "]}\n");
+}
+
+static unsigned int load_baseline(const char* path, struct result* out)
+{
+	FILE* f = fopen(path, "r");
+	if (!f) { fprintf(stderr, "No baseline at %s\n", path); return 0; }
+	unsigned int count = 0;
+	char line[1024];
+	while (count < MAX_RESULTS && fgets(line, sizeof(line), f)) {
+		struct result* r = &out[count];
+		unsigned long long size = 0;
+		char ok[8];
+		if (sscanf(line, "{\"profile\": \"%31[^\"]\", \"size\": %llu, \"ok\": %7[a-z], \"seconds\": %lf, \"goodput_mbps\": %lf, "
+		                 "\"retrans_ratio\": %lf, \"cpu_seconds\": %lf, \"sender_rss_kb\": %ld, \"receiver_rss_kb\": %ld, \"packets_sent\": %lu",
+		           r->profile, &size, ok, &r->seconds, &r->goodputMbps, &r->retransRatio, &r->cpuSeconds,
+		           &r->senderRssKb, &r->receiverRssKb, &r->packetsSent) >= 9) { // Older reports have no packet count
+			r->size = size;
+			r->ok = !strcmp(ok, "true");
+			count+=1;
+		}
+	}
+	fclose(f);
+	return count;
+}
+
+static int compare(struct result* r, struct result* base, double tolerance)
+{ // Print every way r is worse than its baseline. Returns the number of regressions
+	int bad = 0;
+	const char* what = r->profile;
+	unsigned long long size = r->size;
+	if (!r->ok) { printf("REGRESSION %s %llu: transfer failed\n", what, size); return 1; }
+	if (base->seconds >= NOISE_FLOOR_S && r->goodputMbps < base->goodputMbps*(1-tolerance)) {
+		printf("REGRESSION %s %llu: goodput %.2f Mbit/s, baseline %.2f\n", what, size, r->goodputMbps, base->goodputMbps); bad+=1;
+	}
+	if (r->packetsSent >= RETRANS_MIN_PACKETS && r->retransRatio > base->retransRatio + RETRANS_SLACK) {
+		printf("REGRESSION %s %llu: resent %.2f%%, baseline %.2f%%\n", what, size, 100*r->retransRatio, 100*base->retransRatio); bad+=1;
+	}
+	if (base->cpuSeconds >= CPU_FLOOR_S && r->cpuSeconds > base->cpuSeconds*(1+tolerance)) {
+		printf("REGRESSION %s %llu: CPU %.3fs, baseline %.3fs\n", what, size, r->cpuSeconds, base->cpuSeconds); bad+=1;
+	}
+	long rss = (r->senderRssKb > r->receiverRssKb) ? r->senderRssKb : r->receiverRssKb;
+	long baseRss = (base->senderRssKb > base->receiverRssKb) ? base->senderRssKb : base->receiverRssKb;
+	if (rss > baseRss*(1+tolerance) + 1024) { // A megabyte of slack, small runs are mostly the libraries
+		printf("REGRESSION %s %llu: peak RSS %ld KB, baseline %ld KB\n", what, size, rss, baseRss); bad+=1;
+	}
+	return bad;
+}
+
+int main(int argc, char* argv[])
+{
+	const char* sizesArg = "1k,64k,1m,16m,256m,1g";
+	const char* profilesArg = NULL;
+	const char* reportPath = NULL;
+	const char* baselinePath = NULL;
+	unsigned int repeats = 1;
+	double tolerance = 0.25;
+	int opt;
+	while ((opt = getopt(argc, argv, "s:P:n:o:b:t:p:d:")) != -1) {
+		switch (opt) {
+			case 's': sizesArg = optarg; break;
+			case 'P': profilesArg = optarg; break;
+			case 'n': repeats = atoi(optarg); break;
+			case 'o': reportPath = optarg; break;
+			case 'b': baselinePath = optarg; break;
+			case 't': tolerance = atof(optarg); break;
+			case 'p': basePort = atoi(optarg); break;
+			case 'd': dir = optarg; break;
+			default: assert(0);
+		}
+	}
+	assert(repeats > 0 && repeats <= 16);
+	setvbuf(stdout, NULL, _IOLBF, 0); // Progress shows up as it happens, even through a pipe
+
+	uint64_t sizes[MAX_SIZES];
+	unsigned int numSizes = 0;
+	char* list = strdup(sizesArg);
+	for (char* s = strtok(list, ","); s; s = strtok(NULL, ",")) { assert(numSizes < MAX_SIZES && parse_size(s, &sizes[numSizes])); numSizes+=1; }
+	free(list);
+
+	static struct result results[MAX_RESULTS];
+	unsigned int count = 0;
+	printf("%-12s %12s %10s %12s %9s %9s %12s %12s\n", "profile", "bytes", "seconds", "Mbit/s", "resent%", "cpu s", "sender KB", "receiver KB");
+	for (unsigned int pi = 0; pi < NUM_PROFILES; pi++) {
+		const struct profile* p = &profiles[pi];
+		if (profilesArg) { // Only the profiles named in the comma separated list
+			size_t len = strlen(p->name);
+			const char* at = strstr(profilesArg, p->name);
+			if (!at || (at != profilesArg && at[-1] != ',') || (at[len] != ',' && at[len] != '\0')) { continue; }
+		}
+		for (unsigned int si = 0; si < numSizes; si++) {
+			if (p->maxBytes && sizes[si] > p->maxBytes) { continue; }
+			char input[256], output[256];
+			snprintf(input, sizeof(input), "%s/bench-%llu.bin", dir, (unsigned long long)sizes[si]);
+			snprintf(output, sizeof(output), "%s/bench-%llu.out", dir, (unsigned long long)sizes[si]);
+			make_input(input, sizes[si]);
+
+			struct result tries[16];
+			int ok = 1;
+			for (unsigned int i = 0; i < repeats; i++) {
+				memset(&tries[i], 0, sizeof(tries[i]));
+				tries[i].size = sizes[si];
+				ok = run_once(p, input, output, &tries[i]) && ok;
+			}
+			qsort(tries, repeats, sizeof(tries[0]), by_seconds);
+			assert(count < MAX_RESULTS);
+			struct result* r = &results[count++];
+			*r = tries[repeats/2]; // The median run
+			snprintf(r->profile, sizeof(r->profile), "%s", p->name);
+			r->ok = ok;
+			printf("%-12s %12llu %10.4f %12.2f %9.2f %9.3f %12ld %12ld%s\n", r->profile, (unsigned long long)r->size, r->seconds,
+			       r->goodputMbps, 100*r->retransRatio, r->cpuSeconds, r->senderRssKb, r->receiverRssKb, r->ok ? "" : "  FAILED");
+		}
+	}
+
+	if (reportPath) {
+		FILE* f = fopen(reportPath, "w");
+		assert(f);
+		write_report(f, results, count);
+		fclose(f);
+		printf("Report written to %s\n", reportPath);
+	}
+
+	int failures = 0;
+	for (unsigned int i = 0; i < count; i++) { failures += !results[i].ok; }
+	if (baselinePath) {
+		static struct result baseline[MAX_RESULTS];
+		unsigned int numBase = load_baseline(baselinePath, baseline);
+		int regressions = 0;
+		for (unsigned int i = 0; i < count; i++) {
+			struct result* base = NULL;
+			for (unsigned int j = 0; j < numBase && !base; j++) {
+				if (!strcmp(baseline[j].profile, results[i].profile) && baseline[j].size == results[i].size) { base = &baseline[j]; }
+			}
+			if (base) { regressions += compare(&results[i], base, tolerance); }
+			else if (!results[i].ok) { regressions+=1; }
+		}
+		printf("%d regression(s) against %s\n", regressions, baselinePath);
+		return regressions ? 1 : 0;
+	}
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../Compression.h"
+// Micro-benchmark for the chunk codec. Round trips every chunk of every input and feeds the decoder garbled
+// chunks first, then reports the ratio and MB/s on one core at the default and the jumbo chunk size.
+// Usage: ./CompressBench [seconds-per-case (default 0.5)] [files... (default exampleFiles/*.txt)]
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static uint8_t* read_file(const char* name, size_t* size)
+{ // NULL if it can't be read, the bench still runs on the generated inputs
+	FILE* f = fopen(name, "rb");
+	if (!f) { return NULL; }
+	fseek(f, 0, SEEK_END);
+	*size = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	uint8_t* buf = malloc(*size ? *size : 1);
+	assert(buf && fread(buf, 1, *size, f) == *size);
+	fclose(f);
+	return buf;
+}
+
+static void verify(const uint8_t* buf, size_t size, size_t chunk)
+{ // Every chunk has to come back exactly, and a garbled one must be rejected or decode within bounds, never overrun
+	uint8_t* packed = malloc(chunk);
+	uint8_t* out = malloc(chunk);
+	assert(packed && out);
+	for (size_t off = 0; off < size; off += chunk) {
+		size_t len = (size-off < chunk) ? size-off : chunk;
+		size_t n = lz_compress(buf+off, len, packed, len ? len-1 : 0);
+		assert(n < len || !n);
+		if (!n) { continue; } // Sent as it is
+		assert(lz_decompress(packed, n, out, len) && memcmp(out, buf+off, len) == 0);
+		assert(!lz_decompress(packed, n, out, len-1)); // The Receiver knows the size, any other is an error
+		assert(!lz_decompress(packed, n-1, out, len) || n == 1);
+		for (int r = 0; r < 16; r++) { // Random damage: whatever comes out, it stays inside out
+			uint8_t saved[4];
+			size_t at = rand() % n;
+			size_t k = (n-at < 4) ? n-at : 4;
+			memcpy(saved, packed+at, k);
+			for (size_t i = 0; i < k; i++) { packed[at+i] ^= rand(); }
+			lz_decompress(packed, n, out, len);
+			memcpy(packed+at, saved, k);
+		}
+	}
+	free(out);
+	free(packed);
+}
+
+static void run(const char* name, const uint8_t* buf, size_t size, size_t chunk, double seconds)
+{ // Compresses the whole input chunk by chunk like the Sender does, then decompresses what shrank like the Receiver
+	uint8_t* packed = malloc(size+chunk);
+	size_t* lens = malloc((size/chunk+1)*sizeof(size_t));
+	uint8_t* out = malloc(chunk);
+	assert(packed && lens && out);
+	size_t wire = 0, shrank = 0, chunks = 0;
+	unsigned long passes = 0;
+	double start = now_sec(), elapsed = 0;
+	while ((elapsed = now_sec()-start) < seconds || !passes) {
+		wire = shrank = chunks = 0;
+		for (size_t off = 0; off < size; off += chunk, chunks++) {
+			size_t len = (size-off < chunk) ? size-off : chunk;
+			lens[chunks] = lz_compress(buf+off, len, packed+off, len-1);
+			wire += lens[chunks] ? lens[chunks] : len;
+			shrank += (lens[chunks] != 0);
+		}
+		passes+=1;
+	}
+	double compressRate = (double)size*passes/elapsed/1e6;
+
+	passes = 0;
+	start = now_sec();
+	while ((elapsed = now_sec()-start) < seconds || !passes) {
+		size_t c = 0;
+		for (size_t off = 0; off < size; off += chunk, c++) {
+			size_t len = (size-off < chunk) ? size-off : chunk;
+			if (lens[c]) { assert(lz_decompress(packed+off, lens[c], out, len)); }
+		}
+		passes+=1;
+	}
+	double decompressRate = (double)size*passes/elapsed/1e6;
+	printf("%-12s %6zu %10zu %8.3f %7zu/%-7zu %10.1f ", name, chunk, size, (double)wire/size, shrank, chunks, compressRate);
+	if (shrank) { printf("%10.1f\n", decompressRate); }
+	else { printf("%10s\n", "-"); } // Nothing to decompress
+	free(out);
+	free(lens);
+	free(packed);
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+	size_t chunks[] = { 1452, 8952 }; // A 1500 and a 9000 byte MTU
+	const char* defaults[] = { "exampleFiles/alice.txt", "exampleFiles/1MB.txt" };
+	const char** files = (argc > 2) ? (const char**)argv+2 : defaults;
+	int numFiles = (argc > 2) ? argc-2 : 2;
+
+	size_t genSize = 4<<20;
+	uint8_t* random = malloc(genSize); // Incompressible, the case the Sender has to notice quickly
+	uint8_t* zeros = calloc(genSize, 1);
+	uint8_t* skewed = malloc(genSize); // Few distinct bytes and no repeats, barely compressible
+	assert(random && zeros && skewed);
+	srand(1);
+	for (size_t i = 0; i < genSize; i++) { random[i] = rand(); skewed[i] = "aabbbcccc"[rand() % 9]; }
+
+	for (size_t c = 0; c < sizeof(chunks)/sizeof(chunks[0]); c++) {
+		verify(random, genSize, chunks[c]);
+		verify(zeros, genSize, chunks[c]);
+		verify(skewed, genSize, chunks[c]);
+		for (int f = 0; f < numFiles; f++) {
+			size_t size = 0;
+			uint8_t* buf = read_file(files[f], &size);
+			if (buf) { verify(buf, size, chunks[c]); free(buf); }
+		}
+	}
+	printf("Every chunk round trips\n");
+	printf("%-12s %6s %10s %8s %15s %10s %10s\n", "input", "chunk", "bytes", "ratio", "shrank", "comp MB/s", "dec MB/s");
+
+	for (size_t c = 0; c < sizeof(chunks)/sizeof(chunks[0]); c++) {
+		for (int f = 0; f < numFiles; f++) {
+			size_t size = 0;
+			uint8_t* buf = read_file(files[f], &size);
+			if (!buf) { printf("%-12s can't be read\n", files[f]); continue; }
+			const char* name = strrchr(files[f], '/') ? strrchr(files[f], '/')+1 : files[f];
+			if (size) { run(name, buf, size, chunks[c], seconds); }
+			free(buf);
+		}
+		run("random", random, genSize, chunks[c], seconds);
+		run("zeros", zeros, genSize, chunks[c], seconds);
+		run("skewed", skewed, genSize, chunks[c], seconds);
+	}
+
+	free(skewed);
+	free(zeros);
+	free(random);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "../Parity.h"
+// Micro-benchmark for the parity XOR engines. Checks every engine against a byte-at-a-time XOR and rebuilds a chunk from
+// the parity of its group, then reports GB/s on one core for packet sized and bulk buffers.
+// Usage: ./ParityBench [seconds-per-case (default 0.5)]
+
+static double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static void verify(const uint8_t* buf, size_t size)
+{ // Every engine has to agree with the reference for every length and alignment
+	uint8_t* want = malloc(size);
+	uint8_t* got = malloc(size);
+	assert(want && got);
+	for (size_t len = 0; len < 600; len++) {
+		size_t off = len % 13; // Odd offsets catch alignment assumptions
+		for (size_t i = 0; i < len; i++) { want[i] = buf[i] ^ buf[size/2+off+i]; }
+		for (int impl = XOR_WORD; impl <= XOR_AVX2; impl++) {
+			if (!xor_supported(impl)) { continue; }
+			memcpy(got+off, buf, len);
+			xor_into_with(impl, got+off, buf+size/2+off, len);
+			assert(memcmp(got+off, want, len) == 0);
+		}
+	}
+
+	size_t chunk = 8952, group = 8; // A group the way the Sender builds it, then the Receiver's side with one chunk lost
+	assert(group*chunk <= size);
+	uint8_t* parity = calloc(chunk, 1);
+	assert(parity);
+	for (size_t i = 0; i < group; i++) { xor_into(parity, buf+i*chunk, chunk); }
+	size_t lost = 3;
+	for (size_t i = 0; i < group; i++) { if (i != lost) { xor_into(parity, buf+i*chunk, chunk); } }
+	assert(memcmp(parity, buf+lost*chunk, chunk) == 0);
+	free(parity);
+	free(got);
+	free(want);
+}
+
+int main(int argc, char* argv[])
+{
+	double seconds = (argc > 1) ? atof(argv[1]) : 0.5;
+	size_t sizes[] = { 1452, 8952, 65536, 1<<20 }; // A default chunk, a jumbo chunk, bulk
+	size_t maxSize = 1<<20;
+
+	uint8_t* buf = malloc(2*maxSize);
+	uint8_t* dst = malloc(maxSize);
+	assert(buf && dst);
+	srand(1);
+	for (size_t i = 0; i < 2*maxSize; i++) { buf[i] = rand(); }
+	memset(dst, 0, maxSize);
+
+	verify(buf, 2*maxSize);
+	printf("All engines match the reference. Active engine: %s\n", xor_impl_name(xor_active()));
+	printf("%-8s %10s %12s %12s\n", "engine", "bytes", "GB/s", "ns/call");
+
+	for (int impl = XOR_WORD; impl <= XOR_AVX2; impl++) {
+		if (!xor_supported(impl)) { printf("%-8s not supported on this CPU\n", xor_impl_name(impl)); continue; }
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+			size_t len = sizes[s];
+			unsigned long calls = 0;
+			double start = now_sec(), elapsed = 0;
+			while ((elapsed = now_sec()-start) < seconds) {
+				for (int r = 0; r < 64; r++) { xor_into_with(impl, dst, buf+(r%8)*len%maxSize, len); }
+				calls += 64;
+			}
+			printf("%-8s %10zu %12.3f %12.1f\n", xor_impl_name(impl), len, (double)calls*len/elapsed/1e9, elapsed*1e9/calls);
+		}
+	}
+
+	free(dst);
+	free(buf);
+	return 0;
+}